@@ -0,0 +1,303 @@
+/* Micro and macro benchmarks of the dice expression evaluator.
+ *
+ * Covers lexing and parsing, rolling dices of different sizes with and
+ * without ignored rolls, the string builder, the checked arithmetic macros
+ * and evaluating a corpus of realistic expressions end to end. See harness.h
+ * for saving and comparing baselines.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "harness.h"
+#include "diceexpr.h"
+#include "numflow.h"
+#include "str.h"
+
+#define SEED 0x5eed
+// Number of operands of the checked arithmetic benchmarks.
+#define NF_OPERANDS 1024
+
+// Expressions seen at a table.
+static const char *corpus[] = {
+    "1d20+5", "2d6+3", "4d6<", "1d8+1d6+2", "3d6", "1d100", "2d20>+7",
+    "8d6", "1d12-1", "10d10>>>+4", "d20", "2d4+2d4+1", "6d6<<-3", "1d10+1d4"
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+// A long expression for parsing throughput.
+static const char long_expression[] =
+    "1d20+2d6+3d8-4+5d10>+6d12<-7+8d4+9d6>>-10+11d20<<+12d100-13+14d6+15d8"
+    "-16+17d10+18d12>-19+20d4<+21d6-22+23d20+24d100>>>-25+26d6<<<+27d8-28";
+
+typedef struct {
+    de_ctx *ctx;
+    de_expr *expr;
+    enum de_transcript transcript;
+} roll_arg;
+
+typedef struct {
+    int_least64_t a[NF_OPERANDS], b[NF_OPERANDS];
+} nf_arg;
+
+static void
+bench_validate_corpus(void *arg, uint64_t iterations);
+
+static void
+bench_validate_long(void *arg, uint64_t iterations);
+
+static void
+bench_roll(void *arg, uint64_t iterations);
+
+static void
+run_roll(de_ctx *ctx, const char *expr, enum de_transcript transcript);
+
+static void
+bench_str_char(void *arg, uint64_t iterations);
+
+static void
+bench_str_chars(void *arg, uint64_t iterations);
+
+static void
+bench_str_int(void *arg, uint64_t iterations);
+
+static void
+bench_str_format(void *arg, uint64_t iterations);
+
+static void
+bench_nf_plus(void *arg, uint64_t iterations);
+
+static void
+bench_nf_multiply(void *arg, uint64_t iterations);
+
+static void
+bench_unchecked_plus(void *arg, uint64_t iterations);
+
+static void
+bench_parse(void *arg, uint64_t iterations);
+
+static void
+bench_parse_r(void *arg, uint64_t iterations);
+
+int
+main(int argc, char **argv) {
+    if (bench_init(argc, argv) != 0)
+        return EXIT_FAILURE;
+
+    de_ctx *ctx = de_ctx_new();
+    str *s = str_new(NULL);
+    if (ctx == NULL || s == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    de_ctx_seed(ctx, SEED);
+
+    bench_run("validate/corpus", bench_validate_corpus, ctx);
+    bench_run("validate/long", bench_validate_long, ctx);
+
+    static const char *rolls[] = {
+        "1d6", "3d6", "100d6", "10000d6", "1000000d6", "100d1000000",
+        "10000d1000000000", "4d6<", "100d20<<<<>>>>", "10000d1000000<>",
+        "10000d1000000000>>>"
+    };
+    for (size_t i = 0; i < sizeof(rolls) / sizeof(rolls[0]); i++)
+        run_roll(ctx, rolls[i], DE_TRANSCRIPT_NONE);
+    run_roll(ctx, "100d6", DE_TRANSCRIPT_FULL);
+    run_roll(ctx, "10000d6", DE_TRANSCRIPT_TRUNCATED);
+    run_roll(ctx, "10000d6", DE_TRANSCRIPT_SUMMARY);
+
+    bench_run("str/append_char", bench_str_char, s);
+    bench_run("str/append_chars", bench_str_chars, s);
+    bench_run("str/append_int", bench_str_int, s);
+    bench_run("str/append_format", bench_str_format, s);
+
+    nf_arg *nf = malloc(sizeof(*nf));
+    if (nf == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+    for (size_t i = 0; i < NF_OPERANDS; i++) {
+        // Mostly small values like dice sums, some near the limits.
+        int shift = i % 8 == 0 ? 1 : 40;
+        nf->a[i] = (int_least64_t) (de_rng_next(&rng) >> shift) - (i % 2 ?
+            INT_LEAST64_MAX >> shift : 0);
+        nf->b[i] = (int_least64_t) (de_rng_next(&rng) >> 40);
+    }
+    bench_run("nf/plus", bench_nf_plus, nf);
+    bench_run("nf/multiply", bench_nf_multiply, nf);
+    bench_run("nf/unchecked_plus", bench_unchecked_plus, nf);
+    free(nf);
+
+    bench_run("e2e/de_parse", bench_parse, NULL);
+    bench_run("e2e/de_parse_r", bench_parse_r, ctx);
+
+    str_free(s);
+    de_ctx_free(ctx);
+
+    return bench_finish() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// One operation is validating one expression of the corpus.
+static void
+bench_validate_corpus(void *arg, uint64_t iterations) {
+    de_ctx *ctx = arg;
+    uint64_t errors = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+        errors += de_validate(ctx, corpus[i % CORPUS_SIZE]) != 0;
+    bench_use(errors);
+}
+
+static void
+bench_validate_long(void *arg, uint64_t iterations) {
+    de_ctx *ctx = arg;
+    uint64_t errors = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+        errors += de_validate(ctx, long_expression) != 0;
+    bench_use(errors);
+}
+
+static void
+bench_roll(void *arg, uint64_t iterations) {
+    roll_arg *r = arg;
+    const char *rolled;
+    int_least64_t value, sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        de_eval(r->ctx, r->expr, &value,
+            r->transcript == DE_TRANSCRIPT_NONE ? NULL : &rolled);
+        sum += value;
+    }
+    bench_use(sum);
+}
+
+/* Benchmark evaluating a compiled expression.
+ */
+static void
+run_roll(de_ctx *ctx, const char *expr, enum de_transcript transcript) {
+    static const char *transcripts[] = { "", "/full", "/truncated",
+        "/summary" };
+
+    roll_arg r = { ctx, NULL, transcript };
+    if (de_compile(ctx, expr, &r.expr) != 0) {
+        fprintf(stderr, "can't compile %s\n", expr);
+        exit(EXIT_FAILURE);
+    }
+    de_ctx_set_transcript(ctx, transcript);
+
+    char name[64];
+    snprintf(name, sizeof(name), "roll/%s%s", expr, transcripts[transcript]);
+    bench_run(name, bench_roll, &r);
+
+    de_ctx_set_transcript(ctx, DE_TRANSCRIPT_FULL);
+    de_expr_free(r.expr);
+}
+
+// One operation is appending one character, the string is reused.
+static void
+bench_str_char(void *arg, uint64_t iterations) {
+    str *s = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (i % 64 == 0)
+            str_erase(s);
+        str_append_char(s, '0' + i % 10);
+    }
+    bench_use(s->len);
+}
+
+static void
+bench_str_chars(void *arg, uint64_t iterations) {
+    str *s = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (i % 16 == 0)
+            str_erase(s);
+        str_append_chars(s, "(1+2+3)");
+    }
+    bench_use(s->len);
+}
+
+static void
+bench_str_int(void *arg, uint64_t iterations) {
+    str *s = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (i % 16 == 0)
+            str_erase(s);
+        str_append_int(s, (int_least64_t) (i * 2654435761u % 1000000) - 500);
+    }
+    bench_use(s->len);
+}
+
+static void
+bench_str_format(void *arg, uint64_t iterations) {
+    str *s = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (i % 16 == 0)
+            str_erase(s);
+        str_append_format(s, "%d+%d", (int) (i % 20), (int) (i % 6));
+    }
+    bench_use(s->len);
+}
+
+// One operation is one checked addition.
+static void
+bench_nf_plus(void *arg, uint64_t iterations) {
+    nf_arg *nf = arg;
+    uint64_t overflows = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t j = i % NF_OPERANDS;
+        enum flow_type overflow;
+        NF_PLUS(nf->a[j], nf->b[j], INT_LEAST64, overflow);
+        overflows += overflow != 0;
+    }
+    bench_use(overflows);
+}
+
+static void
+bench_nf_multiply(void *arg, uint64_t iterations) {
+    nf_arg *nf = arg;
+    uint64_t overflows = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t j = i % NF_OPERANDS;
+        enum flow_type overflow;
+        NF_MULTIPLY(nf->a[j], nf->b[j], INT_LEAST64, overflow);
+        overflows += overflow != 0;
+    }
+    bench_use(overflows);
+}
+
+// Reference for the checked additions.
+static void
+bench_unchecked_plus(void *arg, uint64_t iterations) {
+    nf_arg *nf = arg;
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t j = i % NF_OPERANDS;
+        sum += (uint64_t) nf->a[j] + (uint64_t) nf->b[j];
+    }
+    bench_use(sum);
+}
+
+// One operation is evaluating one expression of the corpus.
+static void
+bench_parse(void *arg, uint64_t iterations) {
+    (void) arg;
+    int_least64_t value, sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        char *rolled = NULL;
+        if (de_parse(corpus[i % CORPUS_SIZE], &value, &rolled) == 0)
+            sum += value;
+        free(rolled);
+    }
+    bench_use(sum);
+}
+
+static void
+bench_parse_r(void *arg, uint64_t iterations) {
+    de_ctx *ctx = arg;
+    const char *rolled;
+    int_least64_t value, sum = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        if (de_parse_r(ctx, corpus[i % CORPUS_SIZE], &value, &rolled) == 0)
+            sum += value;
+    }
+    bench_use(sum);
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "harness.h"
+
+// A run must take at least this long to be timed, in seconds.
+#define MIN_TIME 0.1
+// Number of timed runs, the median is reported.
+#define RUNS 5
+// The maximum number of benchmarks.
+#define MAX_RESULTS 256
+// Default allowed slowdown compared to the baseline, in percent.
+#define DEFAULT_TOLERANCE 20.0
+
+typedef struct {
+    char name[64];
+    double ns_per_op, allocs_per_op, bytes_per_op;
+} result;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+// Allocation counters, updated by the wrappers.
+static uint64_t allocs, allocated_bytes;
+static volatile uint64_t sink;
+
+static result results[MAX_RESULTS];
+static size_t nresults;
+static const char *json_file, *baseline_file;
+static double tolerance = DEFAULT_TOLERANCE;
+
+static double
+now(void);
+
+static double
+time_run(bench_fn fn, void *arg, uint64_t iterations);
+
+static int
+compare_doubles(const void *a, const void *b);
+
+static int
+compare_baseline(void);
+
+void*
+__wrap_malloc(size_t size) {
+    allocs++;
+    allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void*
+__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    allocated_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+void*
+__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    allocated_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+void
+__wrap_free(void *ptr) {
+    __real_free(ptr);
+}
+
+int
+bench_init(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc)
+            goto error;
+        if (strcmp(argv[i], "--json") == 0)
+            json_file = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0)
+            baseline_file = argv[++i];
+        else if (strcmp(argv[i], "--tolerance") == 0)
+            tolerance = atof(argv[++i]);
+        else
+            goto error;
+    }
+
+    return 0;
+
+    error:
+        fprintf(stderr, "Usage: %s [--json file] [--baseline file] "
+            "[--tolerance percent]\n", argv[0]);
+        return 1;
+}
+
+void
+bench_run(const char *name, bench_fn fn, void *arg) {
+    if (nresults == MAX_RESULTS) {
+        fprintf(stderr, "too many benchmarks\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Warm up caches and buffers, then find the number of iterations.
+    fn(arg, 1);
+    uint64_t iterations = 1;
+    while (time_run(fn, arg, iterations) < MIN_TIME)
+        iterations *= 2;
+
+    double times[RUNS];
+    uint64_t start_allocs = allocs, start_bytes = allocated_bytes;
+    for (int i = 0; i < RUNS; i++)
+        times[i] = time_run(fn, arg, iterations);
+    qsort(times, RUNS, sizeof(times[0]), compare_doubles);
+
+    result *r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns_per_op = times[RUNS / 2] / iterations * 1e9;
+    r->allocs_per_op = (double) (allocs - start_allocs) / RUNS / iterations;
+    r->bytes_per_op = (double) (allocated_bytes - start_bytes) / RUNS /
+        iterations;
+    printf("%-40s %12.2f ns/op %10.3f allocs/op %12.1f B/op\n", r->name,
+        r->ns_per_op, r->allocs_per_op, r->bytes_per_op);
+}
+
+int
+bench_finish(void) {
+    if (json_file != NULL) {
+        FILE *f = fopen(json_file, "w");
+        if (f == NULL) {
+            perror(json_file);
+            return 1;
+        }
+        // One result per line, so that the baseline is easy to read back.
+        fprintf(f, "[\n");
+        for (size_t i = 0; i < nresults; i++) {
+            result *r = &results[i];
+            fprintf(f, "{\"name\": \"%s\", \"ns_per_op\": %.3f, "
+                "\"allocs_per_op\": %.6f, \"bytes_per_op\": %.3f}%s\n",
+                r->name, r->ns_per_op, r->allocs_per_op, r->bytes_per_op,
+                i + 1 < nresults ? "," : "");
+        }
+        fprintf(f, "]\n");
+        fclose(f);
+    }
+
+    return baseline_file != NULL ? compare_baseline() : 0;
+}
+
+void
+bench_use(uint64_t value) {
+    sink += value;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+time_run(bench_fn fn, void *arg, uint64_t iterations) {
+    double start = now();
+    fn(arg, iterations);
+    return now() - start;
+}
+
+static int
+compare_doubles(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/* Compare the results to the baseline and print the regressions.
+ * Benchmarks missing from either are skipped.
+ * @return Non-zero if there are regressions.
+ */
+static int
+compare_baseline(void) {
+    FILE *f = fopen(baseline_file, "r");
+    if (f == NULL) {
+        perror(baseline_file);
+        return 1;
+    }
+
+    int regressions = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        result base;
+        if (sscanf(line, "{\"name\": \"%63[^\"]\", \"ns_per_op\": %lf, "
+                "\"allocs_per_op\": %lf, \"bytes_per_op\": %lf", base.name,
+                &base.ns_per_op, &base.allocs_per_op,
+                &base.bytes_per_op) != 4)
+            continue;
+
+        for (size_t i = 0; i < nresults; i++) {
+            result *r = &results[i];
+            if (strcmp(r->name, base.name) != 0)
+                continue;
+
+            double change = (r->ns_per_op / base.ns_per_op - 1) * 100;
+            if (change > tolerance) {
+                printf("REGRESSION %s: %.2f ns/op, baseline %.2f (%+.1f%%)\n",
+                    r->name, r->ns_per_op, base.ns_per_op, change);
+                regressions++;
+            }
+            // Allocation counts are deterministic, allow only rounding.
+            if (r->allocs_per_op > base.allocs_per_op + 1e-6) {
+                printf("REGRESSION %s: %.3f allocs/op, baseline %.3f\n",
+                    r->name, r->allocs_per_op, base.allocs_per_op);
+                regressions++;
+            }
+        }
+    }
+    fclose(f);
+    printf("%d regressions against %s (tolerance %.0f%%)\n", regressions,
+        baseline_file, tolerance);
+
+    return regressions > 0;
+}
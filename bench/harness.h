@@ -0,0 +1,57 @@
+#ifndef HARNESS_H
+    #define HARNESS_H
+
+/** @file
+ *
+ * @description A small harness for micro benchmarks.
+ *
+ * A benchmark is run with a growing number of iterations until it takes long
+ * enough to time, then timed a few times and the median is reported. Memory
+ * allocations are counted by wrapping malloc(), calloc(), realloc() and
+ * free() with the linker option --wrap, so only allocations by the program
+ * and static libraries are counted, not those inside the C library.
+ *
+ * Results can be saved as JSON and compared to a saved baseline. A result is
+ * a regression if it's slower than the baseline by more than the tolerance
+ * or allocates more.
+ */
+
+#include <stdint.h>
+
+/** A benchmark.
+ * @param arg Argument given to bench_run().
+ * @param iterations Number of operations to run.
+ */
+typedef void (*bench_fn)(void *arg, uint64_t iterations);
+
+/** Parse command line options of the harness.
+ * --json FILE saves the results, --baseline FILE compares the results to a
+ * baseline and --tolerance PERCENT sets the allowed slowdown.
+ * @param argc
+ * @param argv
+ * @return Zero on success, non-zero on invalid options.
+ */
+int
+bench_init(int argc, char **argv);
+
+/** Run and report a benchmark.
+ * @param name Unique name, used to match the baseline.
+ * @param fn
+ * @param arg Passed to fn.
+ */
+void
+bench_run(const char *name, bench_fn fn, void *arg);
+
+/** Save the results and compare them to the baseline.
+ * @return Zero if there are no regressions, non-zero otherwise.
+ */
+int
+bench_finish(void);
+
+/** Keep a value from being optimized away.
+ * @param value
+ */
+void
+bench_use(uint64_t value);
+
+#endif // HARNESS_H
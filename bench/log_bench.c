@@ -0,0 +1,111 @@
+/* Throughput of the roll log.
+ *
+ * Appends records from one thread and from several threads at once, which is
+ * the time a roll waits for logging, and then reads the log back with the
+ * memory mapped reader.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "rolllog.h"
+
+#define RECORDS 1000000
+#define THREADS 4
+#define EXPRESSION "4d6<+3d8-2"
+#define ROLLED "4d6<[3,5,1,6]+3d8[2,8,4]-2"
+
+static double
+now(void);
+
+static void*
+append_records(void *arg);
+
+int
+main(void) {
+    char path[] = "/tmp/log_benchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    unlink(path);
+
+    de_log *log = NULL;
+    int e = de_log_open(path, &log);
+    if (e != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(e));
+        return EXIT_FAILURE;
+    }
+    double start = now();
+    append_records(log);
+    double elapsed = now() - start;
+    printf("append/1 thread: %.2f ns/record\n", elapsed / RECORDS * 1e9);
+
+    pthread_t threads[THREADS];
+    start = now();
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, append_records, log);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = now() - start;
+    printf("append/%d threads: %.2f ns/record\n", THREADS,
+        elapsed / (THREADS * RECORDS) * 1e9);
+
+    start = now();
+    if ((e = de_log_close(log)) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(e));
+        return EXIT_FAILURE;
+    }
+    printf("close: %.3f s\n", now() - start);
+
+    de_log_reader reader;
+    if ((e = de_log_map(path, &reader)) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(e));
+        return EXIT_FAILURE;
+    }
+    start = now();
+    de_log_entry entry;
+    uint64_t n = 0, sum = 0;
+    while (de_log_next(&reader, &entry)) {
+        n++;
+        sum += entry.value;
+    }
+    elapsed = now() - start;
+    printf("scan: %.2f ns/record, %llu records (%llu)\n", elapsed / n * 1e9,
+        (unsigned long long) n, (unsigned long long) sum);
+    de_log_unmap(&reader);
+    unlink(path);
+
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Append RECORDS records to the log.
+ */
+static void*
+append_records(void *arg) {
+    de_log *log = arg;
+    de_log_entry entry = { 0, { 1, 2, 3, 4 }, 0, 0, 0, 0, EXPRESSION,
+        strlen(EXPRESSION), ROLLED, strlen(ROLLED) };
+    for (int i = 0; i < RECORDS; i++) {
+        entry.time = i;
+        entry.roll = i;
+        entry.value = i % 30;
+        if (de_log_append(log, &entry) != 0) {
+            fprintf(stderr, "append failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return NULL;
+}
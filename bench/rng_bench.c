@@ -0,0 +1,169 @@
+/* Throughput and statistical quality of the random number generators.
+ *
+ * Throughput is measured for raw 64 bit output and for bounded integers of
+ * different ranges, and compared to the old rand() based formula. Quality is
+ * checked with a chi-square test of the faces of common dices and a test for
+ * bias of a very large dice. Exits with non-zero status if a test fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include "rng.h"
+
+#define SEED 0x5eed
+#define THROUGHPUT_ITERATIONS 100000000
+#define CHI_SQUARE_ITERATIONS 60000000
+
+static double
+now(void);
+
+static void
+bench_next(void);
+
+static void
+bench_bounded(uint64_t range);
+
+static void
+bench_rand(int_least64_t dice);
+
+static int
+chi_square(uint64_t dice);
+
+static int
+large_dice_bias(void);
+
+int
+main(void) {
+    int failed = 0;
+
+    printf("# Throughput\n");
+    bench_next();
+    uint64_t ranges[] = { 6, 20, 100000, (UINT64_C(1) << 62) + 1 };
+    for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+        bench_bounded(ranges[i]);
+    bench_rand(6);
+    bench_rand(100000);
+
+    printf("# Quality\n");
+    uint64_t dices[] = { 2, 6, 20, 100 };
+    for (size_t i = 0; i < sizeof(dices) / sizeof(dices[0]); i++)
+        failed |= chi_square(dices[i]);
+    failed |= large_dice_bias();
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_next(void) {
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+
+    uint64_t x = 0;
+    double start = now();
+    for (long i = 0; i < THROUGHPUT_ITERATIONS; i++)
+        x ^= de_rng_next(&rng);
+    double elapsed = now() - start;
+
+    printf("next: %.2f ns/op (%" PRIx64 ")\n",
+        elapsed / THROUGHPUT_ITERATIONS * 1e9, x & 0xf);
+}
+
+static void
+bench_bounded(uint64_t range) {
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+
+    uint64_t x = 0;
+    double start = now();
+    for (long i = 0; i < THROUGHPUT_ITERATIONS; i++)
+        x += de_rng_bounded(&rng, range);
+    double elapsed = now() - start;
+
+    printf("bounded d%" PRIu64 ": %.2f ns/op (%" PRIx64 ")\n", range,
+        elapsed / THROUGHPUT_ITERATIONS * 1e9, x & 0xf);
+}
+
+// The formula gdice used before: biased and can return dice + 1.
+static void
+bench_rand(int_least64_t dice) {
+    srand(SEED);
+
+    int_least64_t x = 0, out_of_range = 0;
+    double start = now();
+    for (long i = 0; i < THROUGHPUT_ITERATIONS; i++) {
+        int_least64_t r = (int_least64_t) (rand() / (double) RAND_MAX * dice + 1);
+        out_of_range += r > dice;
+        x += r;
+    }
+    double elapsed = now() - start;
+
+    printf("rand() d%" PRIdLEAST64 ": %.2f ns/op, %" PRIdLEAST64
+        " rolls out of range (%" PRIxLEAST64 ")\n", dice,
+        elapsed / THROUGHPUT_ITERATIONS * 1e9, out_of_range, x & 0xf);
+}
+
+/* Chi-square test for the faces of a dice.
+ * The critical value at significance 0.001 is approximated with the
+ * Wilson-Hilferty transformation.
+ */
+static int
+chi_square(uint64_t dice) {
+    uint64_t *counts = calloc(dice, sizeof(*counts));
+    if (counts == NULL)
+        return 1;
+
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+    for (long i = 0; i < CHI_SQUARE_ITERATIONS; i++)
+        counts[de_rng_bounded(&rng, dice)]++;
+
+    double expected = CHI_SQUARE_ITERATIONS / (double) dice;
+    double chi2 = 0;
+    for (uint64_t i = 0; i < dice; i++) {
+        double d = counts[i] - expected;
+        chi2 += d * d / expected;
+    }
+    free(counts);
+
+    double k = dice - 1;
+    double z = 3.090232;
+    double critical = k * pow(1 - 2 / (9 * k) + z * sqrt(2 / (9 * k)), 3);
+    int failed = chi2 > critical;
+    printf("chi-square d%" PRIu64 ": %.2f, critical %.2f: %s\n", dice, chi2,
+        critical, failed ? "FAIL" : "ok");
+
+    return failed;
+}
+
+/* Bias of a dice with 3 * 2^61 sides.
+ * Taking a value modulo the range would make the lower two thirds twice as
+ * likely as the upper third. An unbiased generator gives 1/3 above 2^62.
+ */
+static int
+large_dice_bias(void) {
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+
+    uint64_t range = UINT64_C(3) << 61;
+    long upper = 0;
+    for (long i = 0; i < CHI_SQUARE_ITERATIONS; i++)
+        upper += de_rng_bounded(&rng, range) >= UINT64_C(1) << 62;
+
+    double fraction = upper / (double) CHI_SQUARE_ITERATIONS;
+    double sigma = sqrt(1 / 3.0 * 2 / 3.0 / CHI_SQUARE_ITERATIONS);
+    int failed = fabs(fraction - 1 / 3.0) > 5 * sigma;
+    printf("upper third of d%" PRIu64 ": %.6f, expected %.6f: %s\n", range,
+        fraction, 1 / 3.0, failed ? "FAIL" : "ok");
+
+    return failed;
+}
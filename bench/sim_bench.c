@@ -0,0 +1,69 @@
+/* Scaling of the Monte Carlo simulation with the number of threads.
+ *
+ * The same expression is simulated with 1, 2, 4, ... threads up to the number
+ * of online processors, and the speedup and parallel efficiency relative to
+ * one thread are printed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define SEED 0x5eed
+#define EXPRESSION "4d6<+3d8-2"
+#define EVALUATIONS 20000000
+
+static double
+now(void);
+
+int
+main(void) {
+    de_ctx *ctx = de_ctx_new();
+    de_expr *expr = NULL;
+    if (ctx == NULL || de_compile(ctx, EXPRESSION, &expr) != 0) {
+        fprintf(stderr, "can't compile %s\n", EXPRESSION);
+        return EXIT_FAILURE;
+    }
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1)
+        processors = 1;
+
+    printf("# %s, %d evaluations\n", EXPRESSION, EVALUATIONS);
+    double single = 0;
+    for (long threads = 1; ; threads *= 2) {
+        if (threads > processors)
+            threads = processors;
+
+        de_sim *sim = NULL;
+        double start = now();
+        if (de_simulate(expr, EVALUATIONS, threads, SEED, &sim) != 0) {
+            fprintf(stderr, "simulation failed\n");
+            return EXIT_FAILURE;
+        }
+        double elapsed = now() - start;
+        if (threads == 1)
+            single = elapsed;
+
+        printf("%ld threads: %.3f s, %.2f ns/evaluation, speedup %.2f, "
+            "efficiency %.2f (mean %.4f)\n", threads, elapsed,
+            elapsed / EVALUATIONS * 1e9, single / elapsed,
+            single / elapsed / threads, sim->mean);
+        de_sim_free(sim);
+
+        if (threads == processors)
+            break;
+    }
+
+    de_expr_free(expr);
+    de_ctx_free(ctx);
+
+    return EXIT_SUCCESS;
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
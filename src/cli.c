@@ -0,0 +1,1000 @@
+/* Evaluate dice expressions without a GUI.
+ *
+ * Reads one expression per line from a file or the standard input and writes
+ * one result per line in the same order. The input is split to chunks of
+ * lines which worker threads evaluate in parallel, and the main thread writes
+ * the output of the chunks in order. Regular files are memory mapped and
+ * parsed in place.
+ *
+ * Every line is rolled with its own random number stream derived from the
+ * seed and the line number, so the same seed gives the same output with any
+ * number of threads.
+ *
+ * With --distribution the exact probability distribution of every expression
+ * is written instead of rolling it. With --simulate every expression is
+ * evaluated many times by de_simulate() and the histogram and statistics of
+ * the values are written. The simulations are run one at a time, each with
+ * all the threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "diceexpr.h"
+#include "dist.h"
+#include "sim.h"
+#include "str.h"
+
+// Approximate size of a chunk of input in bytes.
+#define CHUNK_BYTES (64 * 1024)
+// Number of chunks per worker being read, evaluated or written at a time.
+#define CHUNKS_PER_WORKER 4
+
+enum format {
+    FORMAT_PLAIN,   // Value or error.
+    FORMAT_TSV,     // Expression, value, rolled expression and error.
+    FORMAT_JSON     // JSON object per line.
+};
+
+typedef struct {
+    enum format format;
+    // Form rolled expressions.
+    int verbose;
+    uint64_t seed;
+    // Print statistics of the evaluator to stderr.
+    int stats;
+    // Write exact distributions instead of rolling.
+    int distribution;
+    // Number of evaluations of every expression to simulate, zero to roll.
+    uint64_t simulations;
+    // Threads of a simulation.
+    unsigned int simulation_threads;
+} options;
+
+/* Lines of input and their results. A chunk is owned by the main thread
+ * while it's read and written and by one worker while it's evaluated.
+ */
+typedef struct {
+    // Lines of input, in buf or in the memory mapped file.
+    const char *data;
+    size_t len;
+    char *buf;
+    size_t buf_size;
+    // Number of the first line in the input, zero based.
+    uint64_t first_line;
+    // Results.
+    str *out;
+    // Number of expressions which failed.
+    uint64_t failed;
+    // Non-zero if can't allocate memory for the results.
+    int memory_error;
+    // Non-zero if evaluated.
+    int done;
+} chunk;
+
+typedef struct {
+    int fd;
+    // Memory mapped file or MAP_FAILED if read with read().
+    const char *map;
+    size_t map_len;
+    // Read position in the memory mapped file.
+    size_t pos;
+    // Incomplete last line of the previous read.
+    char *carry;
+    size_t carry_len, carry_size;
+    // Number of lines before the next chunk.
+    uint64_t line;
+    int eof;
+} input;
+
+/* State shared by the main thread and the workers. Chunks are used as a ring
+ * buffer, chunk i is in chunks[i % nchunks].
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    // Signaled when a chunk is read or the input ends.
+    pthread_cond_t readable;
+    // Signaled when a chunk is evaluated.
+    pthread_cond_t evaluated;
+    chunk *chunks;
+    size_t nchunks;
+    // Number of chunks read, taken by a worker and written.
+    uint64_t nread, ntaken, nwritten;
+    // No more chunks will be read.
+    int eof;
+    const options *opts;
+    // Statistics of the finished workers.
+    de_stats stats;
+} pipeline;
+
+static void
+usage(FILE *stream, const char *program);
+
+static int
+parse_options(int argc, char **argv, options *opts, unsigned int *threads,
+    const char **file);
+
+static int
+open_input(input *in, const char *file);
+
+static void
+close_input(input *in);
+
+static int
+input_ready(const input *in);
+
+static int
+read_chunk(input *in, chunk *c);
+
+static int
+read_mapped_chunk(input *in, chunk *c);
+
+static int
+reserve(char **buf, size_t *size, size_t n);
+
+static void*
+work(void *arg);
+
+static void
+evaluate_chunk(de_ctx *ctx, const options *opts, chunk *c);
+
+static int
+append_result(str *out, const options *opts, const char *expr, size_t len,
+    enum parse_error e, int_least64_t value, const char *rolled);
+
+static enum parse_error
+compile(de_ctx *ctx, const char *expr, size_t len, de_expr **compiled);
+
+static enum parse_error
+distribution(de_ctx *ctx, const char *expr, size_t len, de_pmf **pmf);
+
+static enum parse_error
+simulation(de_ctx *ctx, const options *opts, const char *expr, size_t len,
+    uint64_t line, de_sim **sim);
+
+static int
+append_simulation(str *out, const options *opts, const char *expr,
+    size_t len, enum parse_error e, const de_sim *sim);
+
+static int
+append_distribution(str *out, const options *opts, const char *expr,
+    size_t len, enum parse_error e, const de_pmf *pmf);
+
+static int
+append_escaped(str *out, const char *s, size_t len, int json);
+
+static uint64_t
+count_lines(const char *data, size_t len);
+
+static uint64_t
+random_seed(void);
+
+int
+main(int argc, char **argv) {
+    options opts = { FORMAT_PLAIN, 0, random_seed(), 0, 0, 0, 0 };
+    unsigned int threads = 0;
+    const char *file = NULL;
+    if (parse_options(argc, argv, &opts, &threads, &file) != 0)
+        return EXIT_FAILURE;
+
+    input in;
+    if (open_input(&in, file) != 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    // A simulation uses all the threads, one line is evaluated at a time.
+    if (opts.simulations > 0) {
+        opts.simulation_threads = threads;
+        threads = 1;
+    }
+    pipeline p = { .nchunks = threads * CHUNKS_PER_WORKER, .opts = &opts };
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    p.chunks = calloc(p.nchunks, sizeof(*p.chunks));
+    if (workers == NULL || p.chunks == NULL)
+        goto memory_error;
+    for (size_t i = 0; i < p.nchunks; i++) {
+        if ((p.chunks[i].out = str_new(NULL)) == NULL)
+            goto memory_error;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.readable, NULL);
+    pthread_cond_init(&p.evaluated, NULL);
+
+    unsigned int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, work, &p) != 0)
+            break;
+    }
+    if (started == 0)
+        goto memory_error;
+
+    int status = EXIT_SUCCESS;
+    pthread_mutex_lock(&p.lock);
+    for (;;) {
+        // Write evaluated chunks in order.
+        chunk *c;
+        while (p.nwritten < p.nread &&
+               (c = &p.chunks[p.nwritten % p.nchunks])->done) {
+            pthread_mutex_unlock(&p.lock);
+            if (c->memory_error) {
+                fprintf(stderr, "Out of memory\n");
+                abort();
+            }
+            fwrite(c->out->str, 1, c->out->len, stdout);
+            if (c->failed > 0)
+                status = EXIT_FAILURE;
+            pthread_mutex_lock(&p.lock);
+            c->done = 0;
+            p.nwritten++;
+        }
+        if (p.eof && p.nwritten == p.nread)
+            break;
+
+        /* Read the next chunk if there's a free one. Don't block reading
+         * while results are waiting, so that lines written to a pipe one by
+         * one get their results right away.
+         */
+        int idle = p.nread == p.nwritten;
+        if (!p.eof && p.nread - p.nwritten < p.nchunks &&
+            (idle || input_ready(&in))) {
+            c = &p.chunks[p.nread % p.nchunks];
+            pthread_mutex_unlock(&p.lock);
+            if (idle)
+                fflush(stdout);
+            int filled = in.map != MAP_FAILED ? read_mapped_chunk(&in, c) :
+                read_chunk(&in, c);
+            if (filled < 0) {
+                fprintf(stderr, "%s: %s\n", file == NULL ? "stdin" : file,
+                    strerror(errno));
+                status = EXIT_FAILURE;
+            }
+            pthread_mutex_lock(&p.lock);
+            if (filled > 0)
+                p.nread++;
+            p.eof = filled <= 0;
+            pthread_cond_broadcast(&p.readable);
+            continue;
+        }
+
+        pthread_cond_wait(&p.evaluated, &p.lock);
+    }
+    pthread_mutex_unlock(&p.lock);
+
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    if (opts.stats)
+        de_stats_print(&p.stats, stderr);
+    if (fflush(stdout) != 0 || ferror(stdout)) {
+        fprintf(stderr, "stdout: %s\n", strerror(errno));
+        status = EXIT_FAILURE;
+    }
+
+    pthread_cond_destroy(&p.evaluated);
+    pthread_cond_destroy(&p.readable);
+    pthread_mutex_destroy(&p.lock);
+    for (size_t i = 0; i < p.nchunks; i++) {
+        str_free(p.chunks[i].out);
+        free(p.chunks[i].buf);
+    }
+    free(p.chunks);
+    free(workers);
+    close_input(&in);
+
+    return status;
+
+    memory_error:
+        fprintf(stderr, "Out of memory\n");
+        abort();
+}
+
+static void
+usage(FILE *stream, const char *program) {
+    fprintf(stream,
+        "Usage: %s [-f plain|tsv|json] [-j threads] [-s seed] [-v] [-d]\n"
+        "       [-n count] [--stats] [file]\n"
+        "Evaluate dice expressions, one per line, from file or stdin.\n"
+        "\n"
+        "  -f format   output format, plain by default\n"
+        "  -j threads  number of worker threads, the number of processors\n"
+        "              by default\n"
+        "  -s seed     seed, the same seed gives the same results\n"
+        "  -v          output rolled expressions\n"
+        "  -d, --distribution\n"
+        "              output the exact distribution instead of rolling\n"
+        "  -n, --simulate count\n"
+        "              roll count times and output the histogram and\n"
+        "              statistics of the values\n"
+        "  --stats     print statistics of the evaluator to stderr\n"
+        "  -h          show this help\n", program);
+}
+
+/* Parse command line options.
+ * @return Zero on success, non-zero if the program should exit.
+ */
+static int
+parse_options(int argc, char **argv, options *opts, unsigned int *threads,
+    const char **file) {
+    static const struct option long_options[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { "distribution", no_argument, NULL, 'd' },
+        { "simulate", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    char *end;
+    while ((opt = getopt_long(argc, argv, "f:j:s:n:vdh", long_options,
+                NULL)) != -1) {
+        switch (opt) {
+            case 'f':
+                if (strcmp(optarg, "plain") == 0)
+                    opts->format = FORMAT_PLAIN;
+                else if (strcmp(optarg, "tsv") == 0)
+                    opts->format = FORMAT_TSV;
+                else if (strcmp(optarg, "json") == 0)
+                    opts->format = FORMAT_JSON;
+                else
+                    goto error;
+                break;
+            case 'j':
+                errno = 0;
+                *threads = strtoul(optarg, &end, 10);
+                if (errno != 0 || *end != '\0' || *threads > 1024)
+                    goto error;
+                break;
+            case 's':
+                errno = 0;
+                opts->seed = strtoull(optarg, &end, 0);
+                if (errno != 0 || *end != '\0')
+                    goto error;
+                break;
+            case 'v':
+                opts->verbose = 1;
+                break;
+            case 'd':
+                opts->distribution = 1;
+                break;
+            case 'n':
+                errno = 0;
+                opts->simulations = strtoull(optarg, &end, 0);
+                if (errno != 0 || *end != '\0' || opts->simulations == 0 ||
+                    *optarg == '-')
+                    goto error;
+                break;
+            case 'S':
+                opts->stats = 1;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                goto error;
+        }
+    }
+    if (argc - optind > 1 || (opts->distribution && opts->simulations > 0))
+        goto error;
+    if (optind < argc && strcmp(argv[optind], "-") != 0)
+        *file = argv[optind];
+
+    return 0;
+
+    error:
+        usage(stderr, argv[0]);
+        return 1;
+}
+
+/* Open the input and memory map it if it's a regular file.
+ * @param file Name of the file, standard input if NULL.
+ * @return Zero on success, non-zero otherwise and errno is set.
+ */
+static int
+open_input(input *in, const char *file) {
+    memset(in, 0, sizeof(*in));
+    in->map = MAP_FAILED;
+    in->fd = file == NULL ? STDIN_FILENO : open(file, O_RDONLY);
+    if (in->fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->map_len = st.st_size;
+        }
+    }
+
+    return 0;
+}
+
+static void
+close_input(input *in) {
+    if (in->map != MAP_FAILED)
+        munmap((void*) in->map, in->map_len);
+    if (in->fd != STDIN_FILENO)
+        close(in->fd);
+    free(in->carry);
+}
+
+/* Can the next chunk be read without blocking.
+ */
+static int
+input_ready(const input *in) {
+    if (in->map != MAP_FAILED)
+        return 1;
+
+    struct pollfd fd = { in->fd, POLLIN, 0 };
+    return poll(&fd, 1, 0) > 0;
+}
+
+/* Read the next chunk of complete lines with read().
+ * Doesn't wait for CHUNK_BYTES, so that lines written to a pipe one by one
+ * are evaluated right away.
+ * @return Positive if read a chunk, zero at the end of input, negative on
+ * error and errno is set.
+ */
+static int
+read_chunk(input *in, chunk *c) {
+    if (reserve(&c->buf, &c->buf_size, in->carry_len + CHUNK_BYTES) != 0)
+        goto memory_error;
+    if (in->carry_len > 0)
+        memcpy(c->buf, in->carry, in->carry_len);
+    size_t len = in->carry_len;
+    in->carry_len = 0;
+
+    while (!in->eof) {
+        if (reserve(&c->buf, &c->buf_size, len + CHUNK_BYTES) != 0)
+            goto memory_error;
+        ssize_t n = read(in->fd, c->buf + len, c->buf_size - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            in->eof = 1;
+            break;
+        }
+
+        const char *newline = memrchr(c->buf + len, '\n', n);
+        len += n;
+        if (newline != NULL) {
+            // Keep the incomplete last line for the next chunk.
+            size_t complete = newline - c->buf + 1;
+            in->carry_len = len - complete;
+            if (reserve(&in->carry, &in->carry_size, in->carry_len) != 0)
+                goto memory_error;
+            memcpy(in->carry, c->buf + complete, in->carry_len);
+            len = complete;
+            break;
+        }
+    }
+
+    c->data = c->buf;
+    c->len = len;
+    c->first_line = in->line;
+    in->line += count_lines(c->data, c->len);
+
+    return len > 0;
+
+    memory_error:
+        fprintf(stderr, "Out of memory\n");
+        abort();
+}
+
+/* Take the next chunk of complete lines from the memory mapped file.
+ * @return Positive if took a chunk, zero at the end of the file.
+ */
+static int
+read_mapped_chunk(input *in, chunk *c) {
+    size_t left = in->map_len - in->pos;
+    if (left == 0)
+        return 0;
+
+    size_t len = left;
+    if (left > CHUNK_BYTES) {
+        const char *newline = memchr(in->map + in->pos + CHUNK_BYTES, '\n',
+            left - CHUNK_BYTES);
+        if (newline != NULL)
+            len = newline - (in->map + in->pos) + 1;
+    }
+
+    c->data = in->map + in->pos;
+    c->len = len;
+    c->first_line = in->line;
+    in->line += count_lines(c->data, c->len);
+    in->pos += len;
+
+    return 1;
+}
+
+/* Make a buffer at least n bytes.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+reserve(char **buf, size_t *size, size_t n) {
+    if (n <= *size)
+        return 0;
+
+    size_t new_size = *size == 0 ? n : *size;
+    while (new_size < n)
+        new_size *= 2;
+    char *temp = realloc(*buf, new_size);
+    if (temp == NULL)
+        return 1;
+    *buf = temp;
+    *size = new_size;
+
+    return 0;
+}
+
+/* Evaluate chunks until the input ends.
+ * @param arg Pipeline.
+ */
+static void*
+work(void *arg) {
+    pipeline *p = arg;
+
+    de_ctx *ctx = de_ctx_new();
+    if (ctx == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        abort();
+    }
+    de_ctx_set_transcript(ctx,
+        p->opts->verbose ? DE_TRANSCRIPT_TRUNCATED : DE_TRANSCRIPT_NONE);
+    if (p->opts->stats)
+        de_ctx_set_stats(ctx, 1);
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->ntaken == p->nread && !p->eof)
+            pthread_cond_wait(&p->readable, &p->lock);
+        if (p->ntaken == p->nread)
+            break;
+        chunk *c = &p->chunks[p->ntaken++ % p->nchunks];
+        pthread_mutex_unlock(&p->lock);
+
+        evaluate_chunk(ctx, p->opts, c);
+
+        pthread_mutex_lock(&p->lock);
+        c->done = 1;
+        pthread_cond_signal(&p->evaluated);
+    }
+    de_stats stats;
+    de_ctx_get_stats(ctx, &stats);
+    de_stats_add(&p->stats, &stats);
+    pthread_mutex_unlock(&p->lock);
+
+    de_ctx_free(ctx);
+
+    return NULL;
+}
+
+/* Evaluate the lines of a chunk and store the results in its output.
+ */
+static void
+evaluate_chunk(de_ctx *ctx, const options *opts, chunk *c) {
+    str_erase(c->out);
+    c->failed = 0;
+    c->memory_error = 0;
+
+    const char *line = c->data, *end = c->data + c->len;
+    for (uint64_t n = c->first_line; line < end; n++) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t len = (newline != NULL ? newline : end) - line;
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+
+        int retval;
+        if (opts->distribution) {
+            de_pmf *pmf = NULL;
+            enum parse_error e = distribution(ctx, line, len, &pmf);
+            if (e != 0)
+                c->failed++;
+            retval = append_distribution(c->out, opts, line, len, e, pmf);
+            de_pmf_free(pmf);
+        }
+        else if (opts->simulations > 0) {
+            de_sim *sim = NULL;
+            enum parse_error e = simulation(ctx, opts, line, len, n, &sim);
+            if (e != 0)
+                c->failed++;
+            retval = append_simulation(c->out, opts, line, len, e, sim);
+            de_sim_free(sim);
+        }
+        else {
+            int_least64_t value = 0;
+            const char *rolled = NULL;
+            de_rng_seed_stream(de_ctx_rng(ctx), opts->seed, n);
+            enum parse_error e = de_parse_rn(ctx, line, len, &value,
+                opts->verbose ? &rolled : NULL);
+            if (e != 0)
+                c->failed++;
+            retval = append_result(c->out, opts, line, len, e, value, rolled);
+        }
+        if (retval != 0) {
+            c->memory_error = 1;
+            return;
+        }
+
+        line = newline != NULL ? newline + 1 : end;
+    }
+}
+
+/* Append the result of one expression as a line.
+ * @param rolled Rolled expression, NULL if not formed.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_result(str *out, const options *opts, const char *expr, size_t len,
+    enum parse_error e, int_least64_t value, const char *rolled) {
+    int retval = 0;
+    switch (opts->format) {
+        case FORMAT_PLAIN:
+            if (e != 0) {
+                retval |= str_append_chars(out, "error: ");
+                retval |= str_append_chars(out, de_strerror(e));
+            }
+            else {
+                if (rolled != NULL) {
+                    retval |= str_append_chars(out, rolled);
+                    retval |= str_append_chars(out, " = ");
+                }
+                retval |= str_append_int(out, value);
+            }
+            break;
+        case FORMAT_TSV:
+            retval |= append_escaped(out, expr, len, 0);
+            retval |= str_append_char(out, '\t');
+            if (e == 0)
+                retval |= str_append_int(out, value);
+            retval |= str_append_char(out, '\t');
+            if (rolled != NULL)
+                retval |= append_escaped(out, rolled, strlen(rolled), 0);
+            retval |= str_append_char(out, '\t');
+            if (e != 0)
+                retval |= str_append_chars(out, de_strerror(e));
+            break;
+        case FORMAT_JSON:
+            retval |= str_append_chars(out, "{\"expression\":\"");
+            retval |= append_escaped(out, expr, len, 1);
+            if (e != 0) {
+                retval |= str_append_chars(out, "\",\"error\":\"");
+                retval |= str_append_chars(out, de_strerror(e));
+                retval |= str_append_chars(out, "\"}");
+                break;
+            }
+            retval |= str_append_chars(out, "\",\"value\":");
+            retval |= str_append_int(out, value);
+            if (rolled != NULL) {
+                retval |= str_append_chars(out, ",\"rolled\":\"");
+                retval |= append_escaped(out, rolled, strlen(rolled), 1);
+                retval |= str_append_char(out, '"');
+            }
+            retval |= str_append_char(out, '}');
+            break;
+    }
+
+    return retval | str_append_char(out, '\n');
+}
+
+/* Compile an expression which isn't null terminated.
+ * @param compiled Used to store the compiled expression, must point to NULL.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+compile(de_ctx *ctx, const char *expr, size_t len, de_expr **compiled) {
+    char *text = malloc(len + 1);
+    if (text == NULL)
+        return DE_MEMORY;
+    memcpy(text, expr, len);
+    text[len] = '\0';
+
+    enum parse_error e = de_compile(ctx, text, compiled);
+    free(text);
+
+    return e;
+}
+
+/* Compute the exact distribution of an expression.
+ * @param expr Expression, not null terminated.
+ * @param pmf Used to store the distribution, must point to NULL.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+distribution(de_ctx *ctx, const char *expr, size_t len, de_pmf **pmf) {
+    de_expr *compiled = NULL;
+    enum parse_error e = compile(ctx, expr, len, &compiled);
+    if (e == 0)
+        e = de_distribution(ctx, compiled, pmf);
+    de_expr_free(compiled);
+
+    return e;
+}
+
+/* Simulate an expression. The seed of the simulation is drawn from the
+ * stream of the line, so the same seed and number of threads give the same
+ * histogram.
+ * @param expr Expression, not null terminated.
+ * @param line Line number of the expression, zero based.
+ * @param sim Used to store the result, must point to NULL.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+simulation(de_ctx *ctx, const options *opts, const char *expr, size_t len,
+    uint64_t line, de_sim **sim) {
+    de_expr *compiled = NULL;
+    enum parse_error e = compile(ctx, expr, len, &compiled);
+    if (e == 0) {
+        de_rng rng;
+        de_rng_seed_stream(&rng, opts->seed, line);
+        e = de_simulate(compiled, opts->simulations,
+            opts->simulation_threads, de_rng_next(&rng), sim);
+    }
+    de_expr_free(compiled);
+
+    return e;
+}
+
+/* Append the distribution of one expression as a line. Values with zero
+ * probability are left out, probabilities are written with enough digits
+ * to read back the same doubles.
+ * Plain: value:probability pairs separated by spaces.
+ * TSV: expression, mean, variance, the pairs like plain and error.
+ * JSON: object with the expression, mean, variance, the smallest value and
+ * the probabilities of every value from it.
+ * @param pmf Distribution, NULL if e isn't zero.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_distribution(str *out, const options *opts, const char *expr,
+    size_t len, enum parse_error e, const de_pmf *pmf) {
+    int retval = 0;
+    switch (opts->format) {
+        case FORMAT_PLAIN:
+            if (e != 0) {
+                retval |= str_append_chars(out, "error: ");
+                retval |= str_append_chars(out, de_strerror(e));
+                break;
+            }
+            for (size_t i = 0, shown = 0; i < pmf->len; i++) {
+                if (pmf->p[i] == 0)
+                    continue;
+                retval |= str_append_format(out, "%s%" PRIdLEAST64 ":%.17g",
+                    shown++ > 0 ? " " : "", pmf->min + (int_least64_t) i,
+                    pmf->p[i]);
+            }
+            break;
+        case FORMAT_TSV:
+            retval |= append_escaped(out, expr, len, 0);
+            retval |= str_append_char(out, '\t');
+            if (e == 0) {
+                retval |= str_append_format(out, "%.17g\t%.17g\t",
+                    pmf->mean, pmf->variance);
+                for (size_t i = 0, shown = 0; i < pmf->len; i++) {
+                    if (pmf->p[i] == 0)
+                        continue;
+                    retval |= str_append_format(out, "%s%" PRIdLEAST64
+                        ":%.17g", shown++ > 0 ? " " : "",
+                        pmf->min + (int_least64_t) i, pmf->p[i]);
+                }
+            }
+            else
+                retval |= str_append_chars(out, "\t\t");
+            retval |= str_append_char(out, '\t');
+            if (e != 0)
+                retval |= str_append_chars(out, de_strerror(e));
+            break;
+        case FORMAT_JSON:
+            retval |= str_append_chars(out, "{\"expression\":\"");
+            retval |= append_escaped(out, expr, len, 1);
+            if (e != 0) {
+                retval |= str_append_chars(out, "\",\"error\":\"");
+                retval |= str_append_chars(out, de_strerror(e));
+                retval |= str_append_chars(out, "\"}");
+                break;
+            }
+            retval |= str_append_format(out, "\",\"mean\":%.17g,"
+                "\"variance\":%.17g,\"min\":%" PRIdLEAST64
+                ",\"probabilities\":[", pmf->mean, pmf->variance, pmf->min);
+            for (size_t i = 0; i < pmf->len; i++)
+                retval |= str_append_format(out, "%s%.17g", i > 0 ? "," : "",
+                    pmf->p[i]);
+            retval |= str_append_chars(out, "]}");
+            break;
+    }
+
+    return retval | str_append_char(out, '\n');
+}
+
+/* Append the result of a simulation as a line. Percentiles and the values
+ * of the histogram are the starts of the buckets, see de_sim. Only the
+ * buckets from the smallest to the largest value are written.
+ * Plain: mean, variance, the smallest value, the 5th, 25th, 50th, 75th and
+ * 95th percentiles and the largest value as name=value, then value:count
+ * pairs of the buckets with values, separated by spaces.
+ * TSV: expression, number of evaluations, mean, variance, the smallest
+ * value, the percentiles, the largest value, the width of the buckets, the
+ * pairs like plain and error.
+ * JSON: object with the expression, the statistics, the percentiles, the
+ * start and the width of the buckets and the counts of every bucket.
+ * @param sim Result, NULL if e isn't zero.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_simulation(str *out, const options *opts, const char *expr,
+    size_t len, enum parse_error e, const de_sim *sim) {
+    static const double quantiles[] = { 0.05, 0.25, 0.5, 0.75, 0.95 };
+    static const char *const names[] = { "5", "25", "50", "75", "95" };
+    size_t nquantiles = sizeof(quantiles) / sizeof(quantiles[0]);
+    int retval = 0;
+    if (e != 0) {
+        switch (opts->format) {
+            case FORMAT_PLAIN:
+                retval |= str_append_chars(out, "error: ");
+                retval |= str_append_chars(out, de_strerror(e));
+                break;
+            case FORMAT_TSV:
+                retval |= append_escaped(out, expr, len, 0);
+                // Empty columns of the statistics and the histogram.
+                for (int i = 0; i < 13; i++)
+                    retval |= str_append_char(out, '\t');
+                retval |= str_append_chars(out, de_strerror(e));
+                break;
+            case FORMAT_JSON:
+                retval |= str_append_chars(out, "{\"expression\":\"");
+                retval |= append_escaped(out, expr, len, 1);
+                retval |= str_append_chars(out, "\",\"error\":\"");
+                retval |= str_append_chars(out, de_strerror(e));
+                retval |= str_append_chars(out, "\"}");
+                break;
+        }
+        return retval | str_append_char(out, '\n');
+    }
+
+    size_t first = ((uint64_t) sim->min - (uint64_t) sim->lo) / sim->width;
+    size_t last = ((uint64_t) sim->max - (uint64_t) sim->lo) / sim->width;
+    switch (opts->format) {
+        case FORMAT_PLAIN:
+            retval |= str_append_format(out, "mean=%.17g variance=%.17g "
+                "min=%" PRIdLEAST64, sim->mean, sim->variance, sim->min);
+            for (size_t i = 0; i < nquantiles; i++)
+                retval |= str_append_format(out, " p%s=%" PRIdLEAST64,
+                    names[i], de_sim_percentile(sim, quantiles[i]));
+            retval |= str_append_format(out, " max=%" PRIdLEAST64, sim->max);
+            for (size_t i = first; i <= last; i++) {
+                if (sim->counts[i] == 0)
+                    continue;
+                retval |= str_append_format(out, " %" PRIdLEAST64 ":%"
+                    PRIu64, sim->lo + (int_least64_t) (i * sim->width),
+                    sim->counts[i]);
+            }
+            break;
+        case FORMAT_TSV:
+            retval |= append_escaped(out, expr, len, 0);
+            retval |= str_append_format(out, "\t%" PRIu64 "\t%.17g\t%.17g\t%"
+                PRIdLEAST64, sim->n, sim->mean, sim->variance, sim->min);
+            for (size_t i = 0; i < nquantiles; i++)
+                retval |= str_append_format(out, "\t%" PRIdLEAST64,
+                    de_sim_percentile(sim, quantiles[i]));
+            retval |= str_append_format(out, "\t%" PRIdLEAST64 "\t%" PRIu64
+                "\t", sim->max, sim->width);
+            for (size_t i = first, shown = 0; i <= last; i++) {
+                if (sim->counts[i] == 0)
+                    continue;
+                retval |= str_append_format(out, "%s%" PRIdLEAST64 ":%"
+                    PRIu64, shown++ > 0 ? " " : "",
+                    sim->lo + (int_least64_t) (i * sim->width),
+                    sim->counts[i]);
+            }
+            retval |= str_append_char(out, '\t');
+            break;
+        case FORMAT_JSON:
+            retval |= str_append_chars(out, "{\"expression\":\"");
+            retval |= append_escaped(out, expr, len, 1);
+            retval |= str_append_format(out, "\",\"n\":%" PRIu64 ",\"mean\":"
+                "%.17g,\"variance\":%.17g,\"min\":%" PRIdLEAST64 ",\"max\":%"
+                PRIdLEAST64 ",\"percentiles\":{", sim->n, sim->mean,
+                sim->variance, sim->min, sim->max);
+            for (size_t i = 0; i < nquantiles; i++)
+                retval |= str_append_format(out, "%s\"%s\":%" PRIdLEAST64,
+                    i > 0 ? "," : "", names[i],
+                    de_sim_percentile(sim, quantiles[i]));
+            retval |= str_append_format(out, "},\"start\":%" PRIdLEAST64
+                ",\"width\":%" PRIu64 ",\"counts\":[",
+                sim->lo + (int_least64_t) (first * sim->width), sim->width);
+            for (size_t i = first; i <= last; i++)
+                retval |= str_append_format(out, "%s%" PRIu64,
+                    i > first ? "," : "", sim->counts[i]);
+            retval |= str_append_chars(out, "]}");
+            break;
+    }
+
+    return retval | str_append_char(out, '\n');
+}
+
+/* Append a string escaped for TSV or a JSON string.
+ * TSV escapes backslashes, tabs and line breaks with a backslash. JSON also
+ * escapes double quotes and other control characters. Other bytes, like
+ * UTF-8 sequences, are copied as is.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_escaped(str *out, const char *s, size_t len, int json) {
+    static const char hex[] = "0123456789abcdef";
+
+    if (str_reserve(out, len) != 0)
+        return 1;
+
+    int retval = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        switch (c) {
+            case '\\':
+                retval |= str_append_chars(out, "\\\\");
+                break;
+            case '\t':
+                retval |= str_append_chars(out, "\\t");
+                break;
+            case '\n':
+                retval |= str_append_chars(out, "\\n");
+                break;
+            case '\r':
+                retval |= str_append_chars(out, "\\r");
+                break;
+            case '"':
+                retval |= json ? str_append_chars(out, "\\\"") :
+                    str_append_char(out, c);
+                break;
+            default:
+                if (json && c < 0x20) {
+                    retval |= str_append_chars(out, "\\u00");
+                    retval |= str_append_char(out, hex[c >> 4]);
+                    retval |= str_append_char(out, hex[c & 0xf]);
+                }
+                else
+                    retval |= str_append_char(out, c);
+                break;
+        }
+    }
+
+    return retval;
+}
+
+/* Number of newlines.
+ */
+static uint64_t
+count_lines(const char *data, size_t len) {
+    uint64_t n = 0;
+    const char *end = data + len;
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        n++;
+        data++;
+    }
+
+    return n;
+}
+
+/* A seed different on every run.
+ */
+static uint64_t
+random_seed(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+        ((uint64_t) getpid() << 32);
+}
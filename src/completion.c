@@ -0,0 +1,255 @@
+#include <string.h>
+#include "completion.h"
+
+/* An expression of a completion store.
+ */
+typedef struct {
+    gchar *expr;
+    // Stamp of the last use.
+    guint64 stamp;
+    // Link of the entry in the most recently used queue, data is the entry.
+    GList link;
+} entry;
+
+static void
+ensure_loaded(completion_store *c);
+
+static void
+touch(completion_store *c, const gchar *expr, gboolean index);
+
+static void
+drop_least_recent(completion_store *c);
+
+static guint
+lower_bound(const completion_store *c, const gchar *expr);
+
+static gint
+compare_entries(gconstpointer a, gconstpointer b);
+
+static void
+free_entries(completion_store *c);
+
+completion_store*
+completion_store_new(const gchar *path, guint capacity) {
+    g_return_val_if_fail(path != NULL, NULL);
+    g_return_val_if_fail(capacity > 0, NULL);
+
+    completion_store *c = g_new(completion_store, 1);
+    c->path = g_strdup(path);
+    c->capacity = capacity;
+    g_queue_init(&c->mru);
+    c->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    c->sorted = g_ptr_array_new();
+    c->next_stamp = 0;
+    c->loaded = FALSE;
+    c->dirty = FALSE;
+
+    return c;
+}
+
+void
+completion_store_add(completion_store *c, const gchar *expr) {
+    g_return_if_fail(expr != NULL && *expr != '\0');
+    g_return_if_fail(strchr(expr, '\n') == NULL);
+
+    ensure_loaded(c);
+    touch(c, expr, TRUE);
+    drop_least_recent(c);
+    c->dirty = TRUE;
+}
+
+GPtrArray*
+completion_store_match(completion_store *c, const gchar *prefix, guint max) {
+    ensure_loaded(c);
+
+    // The max most recently used matches, the most recent first.
+    GPtrArray *best = g_ptr_array_sized_new(max);
+    if (max == 0)
+        return best;
+
+    size_t len = strlen(prefix);
+    for (guint i = lower_bound(c, prefix); i < c->sorted->len; i++) {
+        entry *e = g_ptr_array_index(c->sorted, i);
+        // Expressions with the prefix are next to each other.
+        if (strncmp(e->expr, prefix, len) != 0)
+            break;
+
+        if (best->len == max) {
+            entry *last = g_ptr_array_index(best, max - 1);
+            if (last->stamp > e->stamp)
+                continue;
+            g_ptr_array_set_size(best, max - 1);
+        }
+        guint j = best->len;
+        while (j > 0 && ((entry*) g_ptr_array_index(best, j - 1))->stamp <
+               e->stamp)
+            j--;
+        g_ptr_array_insert(best, j, e);
+    }
+    for (guint i = 0; i < best->len; i++)
+        best->pdata[i] = ((entry*) best->pdata[i])->expr;
+
+    return best;
+}
+
+void
+completion_store_clear(completion_store *c) {
+    free_entries(c);
+    // The file is overwritten on save.
+    c->loaded = TRUE;
+    c->dirty = TRUE;
+}
+
+void
+completion_store_set_capacity(completion_store *c, guint capacity) {
+    g_return_if_fail(capacity > 0);
+
+    c->capacity = capacity;
+    // Otherwise dropped when loaded.
+    if (c->loaded && g_queue_get_length(&c->mru) > capacity) {
+        drop_least_recent(c);
+        c->dirty = TRUE;
+    }
+}
+
+gboolean
+completion_store_save(completion_store *c, GError **error) {
+    if (!c->dirty)
+        return TRUE;
+
+    GString *contents = g_string_new("");
+    for (GList *it = c->mru.tail; it != NULL; it = it->prev) {
+        entry *e = it->data;
+        g_string_append(contents, e->expr);
+        g_string_append_c(contents, '\n');
+    }
+
+    gchar *dir = g_path_get_dirname(c->path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    gboolean saved = g_file_set_contents(c->path, contents->str,
+        contents->len, error);
+    g_string_free(contents, TRUE);
+    if (saved)
+        c->dirty = FALSE;
+
+    return saved;
+}
+
+void
+completion_store_free(completion_store *c) {
+    free_entries(c);
+    g_hash_table_destroy(c->entries);
+    g_ptr_array_free(c->sorted, TRUE);
+    g_free(c->path);
+    g_free(c);
+}
+
+/* Read the file of the store on first use.
+ * Expressions are indexed once after reading all of them, instead of
+ * inserting them to the sorted array one by one.
+ */
+static void
+ensure_loaded(completion_store *c) {
+    if (c->loaded)
+        return;
+    c->loaded = TRUE;
+
+    gchar *contents;
+    if (!g_file_get_contents(c->path, &contents, NULL, NULL))
+        return;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (gchar **line = lines; *line != NULL; line++) {
+        if (**line != '\0')
+            touch(c, *line, FALSE);
+    }
+    g_strfreev(lines);
+    drop_least_recent(c);
+
+    for (GList *it = c->mru.head; it != NULL; it = it->next)
+        g_ptr_array_add(c->sorted, it->data);
+    g_ptr_array_sort(c->sorted, compare_entries);
+}
+
+/* Add an expression or mark it used.
+ * @param c
+ * @param expr
+ * @param index If TRUE, a new expression is inserted to the sorted array.
+ */
+static void
+touch(completion_store *c, const gchar *expr, gboolean index) {
+    entry *e = g_hash_table_lookup(c->entries, expr);
+    if (e != NULL)
+        g_queue_unlink(&c->mru, &e->link);
+    else {
+        e = g_new(entry, 1);
+        e->expr = g_strdup(expr);
+        e->link.data = e;
+        e->link.prev = NULL;
+        e->link.next = NULL;
+        g_hash_table_insert(c->entries, e->expr, e);
+        if (index)
+            g_ptr_array_insert(c->sorted, lower_bound(c, expr), e);
+    }
+    e->stamp = c->next_stamp++;
+    g_queue_push_head_link(&c->mru, &e->link);
+}
+
+/* Remove the least recently used expressions if there are more than the
+ * capacity.
+ */
+static void
+drop_least_recent(completion_store *c) {
+    while (g_queue_get_length(&c->mru) > c->capacity) {
+        entry *e = g_queue_pop_tail_link(&c->mru)->data;
+        g_hash_table_remove(c->entries, e->expr);
+        // Not indexed while loading.
+        guint i = lower_bound(c, e->expr);
+        if (i < c->sorted->len && g_ptr_array_index(c->sorted, i) == e)
+            g_ptr_array_remove_index(c->sorted, i);
+        g_free(e->expr);
+        g_free(e);
+    }
+}
+
+/* Index of the first expression in the sorted array not less than expr.
+ */
+static guint
+lower_bound(const completion_store *c, const gchar *expr) {
+    guint low = 0, high = c->sorted->len;
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        entry *e = g_ptr_array_index(c->sorted, mid);
+        if (strcmp(e->expr, expr) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* Compare entries by expression, for g_ptr_array_sort().
+ */
+static gint
+compare_entries(gconstpointer a, gconstpointer b) {
+    const entry *x = *(entry* const*) a;
+    const entry *y = *(entry* const*) b;
+    return strcmp(x->expr, y->expr);
+}
+
+/* Free every entry of a store.
+ */
+static void
+free_entries(completion_store *c) {
+    GList *link;
+    while ((link = g_queue_pop_head_link(&c->mru)) != NULL) {
+        entry *e = link->data;
+        g_free(e->expr);
+        g_free(e);
+    }
+    g_hash_table_remove_all(c->entries);
+    g_ptr_array_set_size(c->sorted, 0);
+}
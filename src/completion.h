@@ -0,0 +1,91 @@
+#ifndef COMPLETION_H
+    #define COMPLETION_H
+
+#include <glib.h>
+
+/** The default maximum number of expressions in a completion store.
+ */
+#define COMPLETION_DEFAULT_CAPACITY 10000
+
+/** Expressions for completing the dice expression entry.
+ * Expressions are kept in most recently used order without duplicates. At
+ * most capacity expressions are kept, the least recently used ones are
+ * dropped. Expressions are also kept sorted, so the expressions starting
+ * with a prefix are found with a binary search instead of comparing every
+ * expression.
+ *
+ * The expressions are saved to a file, one per line, the least recently used
+ * first. The file is read on first use, not when the store is created.
+ */
+typedef struct {
+    // File the expressions are loaded from and saved to.
+    gchar *path;
+    // The maximum number of expressions kept.
+    guint capacity;
+    // Expressions, the most recently used first. Owns the entries.
+    GQueue mru;
+    // Entries by expression.
+    GHashTable *entries;
+    // Entries sorted by expression.
+    GPtrArray *sorted;
+    // Stamp of the next use, larger stamps are used more recently.
+    guint64 next_stamp;
+    // Whether the file has been read and the store changed since.
+    gboolean loaded, dirty;
+} completion_store;
+
+/** Create a completion store.
+ * @param path File of the expressions. Doesn't need to exist.
+ * @param capacity The maximum number of expressions, at least one.
+ * @return completion_store object.
+ */
+completion_store*
+completion_store_new(const gchar *path, guint capacity);
+
+/** Add an expression or mark it used if it's in the store already.
+ * @param c
+ * @param expr Expression, not empty and without newlines.
+ */
+void
+completion_store_add(completion_store *c, const gchar *expr);
+
+/** Find the most recently used expressions starting with a prefix.
+ * @param c
+ * @param prefix
+ * @param max The maximum number of expressions to find.
+ * @return Expressions, the most recently used first. Owned by the store and
+ * valid until it's changed, free only the array.
+ */
+GPtrArray*
+completion_store_match(completion_store *c, const gchar *prefix, guint max);
+
+/** Remove all expressions.
+ * @param c
+ */
+void
+completion_store_clear(completion_store *c);
+
+/** Set the maximum number of expressions.
+ * The least recently used expressions are dropped if there are more.
+ * @param c
+ * @param capacity At least one.
+ */
+void
+completion_store_set_capacity(completion_store *c, guint capacity);
+
+/** Save the expressions to the file if they've changed.
+ * @param c
+ * @param error
+ * @return TRUE on success, FALSE if can't write the file.
+ */
+gboolean
+completion_store_save(completion_store *c, GError **error);
+
+/** Free completion store resources.
+ * The expressions aren't saved.
+ * @param c
+ */
+void
+completion_store_free(completion_store *c);
+
+#endif // COMPLETION_H
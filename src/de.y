@@ -1,38 +1,46 @@
 %{
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
 #include <limits.h>
 #include <assert.h>
 #include <inttypes.h>
-#include "str.h"
 #include "diceexpr.h"
+#include "deimpl.h"
 #include "numflow.h"
 
-int yylex();
-void yyerror(const char *s);
-// Set dice expression as input for lexer. Can't be NULL.
-void set_scan_string(const char *expr);
-// Free lexer's buffer.
-void delete_buffer();
-static enum parse_error roll(int_least64_t nrolls,
-                             int_least64_t dice,
-                             int_least64_t small,
-                             int_least64_t large,
-                             int_least64_t *sum);
-static int sort_ascending(const void *a, const void *b);
-
-// Number of smallest and largest rolls to ignore.
-static int_least64_t ignore_small, ignore_large;
-// Dice expression after dices are rolled.
-static str *rolled_expr;
-// Evaluated result of a dice expression.
-static int_least64_t result;
-// Parser error.
-static enum parse_error parse_error;
+void yyerror(void *scanner, de_ctx *ctx, const char *s);
+// Create a scanner reading ctx->input. Returns non-zero on error.
+int scanner_new(de_ctx *ctx, void **scanner);
+// Reset scanner to read ctx->input from the beginning.
+void scanner_reset(void *scanner);
+// Free scanner.
+void scanner_free(void *scanner);
+static enum parse_error emit(de_ctx *ctx, enum de_op_type type,
+    int_least64_t value);
+static enum parse_error emit_dice(de_ctx *ctx, int_least64_t nrolls,
+    int_least64_t dice);
+static enum parse_error append(de_ctx *ctx, const de_op *op);
+static enum parse_error analyze(de_ctx *ctx, const de_op *op);
+static enum parse_error set_bounds(de_ctx *ctx, de_interval *bounds,
+    int_least64_t min, enum flow_type min_flow, int_least64_t max,
+    enum flow_type max_flow);
+static enum parse_error compile(de_ctx *ctx, const char *expr, size_t len,
+    de_expr *out);
 %}
 
-%code requires { #define YYSTYPE int_least64_t }
+%code requires {
+    #define YYSTYPE int_least64_t
+    #include "deimpl.h"
+}
+
+%code {
+    int yylex(YYSTYPE *lvalp, void *scanner);
+}
+
+%define api.pure full
+%lex-param { void *scanner }
+%parse-param { void *scanner } { de_ctx *ctx }
 
 %token INTEGER
 %token INVALID_CHARACTER OVERFLOW
@@ -47,98 +55,82 @@ static enum parse_error parse_error;
 %%
 
 parse:
-    expr { result = $1; }
+    expr
     ;
 
 expr:
     INVALID_CHARACTER {
-        parse_error = DE_INVALID_CHARACTER;
+        ctx->parse_error = DE_INVALID_CHARACTER;
         YYERROR;
     }
 
     | OVERFLOW {
-        parse_error = DE_OVERFLOW;
+        ctx->parse_error = DE_OVERFLOW;
         YYERROR;
     }
 
     | INTEGER {
-        if (str_append_format(rolled_expr, "%" PRIdLEAST64, $1) != 0) {
-            parse_error = DE_MEMORY;
+        if ((ctx->parse_error = emit(ctx, DE_OP_INTEGER, $1)) != 0)
             YYERROR;
-        }
-        $$ = $1;
     }
 
     | '-' {
-        if (str_append_char(rolled_expr, '-')) {
-            parse_error = DE_MEMORY;
+        if ((ctx->parse_error = emit(ctx, DE_OP_MINUS_SIGN, 0)) != 0)
             YYERROR;
-        }
     } expr %prec UMINUS  {
-        enum flow_type overflow;
-        NF_MINUS(0, $3, INT_LEAST64, overflow);
-        if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+        if ((ctx->parse_error = emit(ctx, DE_OP_NEGATE, 0)) != 0)
             YYERROR;
-        }
-        $$ = -$3;
     }
 
     | '+' {
-        if (str_append_char(rolled_expr, '+')) {
-            parse_error = DE_MEMORY;
+        if ((ctx->parse_error = emit(ctx, DE_OP_PLUS_SIGN, 0)) != 0)
             YYERROR;
-        }
-    } expr %prec UPLUS { $$ = $3; }
+    } expr %prec UPLUS
 
     | expr '-' {
-        if (str_append_char(rolled_expr, '-')) {
-            parse_error = DE_MEMORY;
+        if ((ctx->parse_error = emit(ctx, DE_OP_MINUS_SIGN, 0)) != 0)
             YYERROR;
-        }
     } expr {
-        enum flow_type overflow;
-        NF_MINUS($1, $4, INT_LEAST64, overflow);
-        if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+        if ((ctx->parse_error = emit(ctx, DE_OP_SUBTRACT, 0)) != 0)
             YYERROR;
-        }
-        $$ = $1 - $4;
     }
 
     | expr '+' {
-        if (str_append_char(rolled_expr, '+')) {
-            parse_error = DE_MEMORY;
+        if ((ctx->parse_error = emit(ctx, DE_OP_PLUS_SIGN, 0)) != 0)
             YYERROR;
-        }
     } expr {
-        enum flow_type overflow;
-        NF_PLUS($1, $4, INT_LEAST64, overflow);
-        if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+        if ((ctx->parse_error = emit(ctx, DE_OP_ADD, 0)) != 0)
             YYERROR;
-        }
-        $$ = $1 + $4;
     }
 
     | maybe_int 'd' INTEGER ignore_list {
-        int_least64_t sum;
-        enum parse_error e =
-            roll($1, $3, ignore_small, ignore_large, &sum);
-        if (e != 0) {
-            parse_error = e;
+        if ($1 <= 0) {
+            ctx->parse_error = DE_NROLLS;
+            YYERROR;
+        }
+        if ($3 <= 0) {
+            ctx->parse_error = DE_DICE;
+            YYERROR;
+        }
+        if ($1 > MAX_MATERIALIZED_DICE_ROLLS && $3 > MAX_HISTOGRAM_DICE_SIDES) {
+            ctx->parse_error = DE_ROLLS_TOO_LARGE;
             YYERROR;
         }
-        $$ = sum;
-        ignore_small = 0;
-        ignore_large = 0;
+        if (ctx->ignore_small >= $1 - ctx->ignore_large) {
+            ctx->parse_error = DE_IGNORE;
+            YYERROR;
+        }
+        if ((ctx->parse_error = emit_dice(ctx, $1, $3)) != 0)
+            YYERROR;
+        ctx->ignore_small = 0;
+        ctx->ignore_large = 0;
     }
     ;
 
 maybe_int:
     INTEGER {
         if ($1 > MAX_NUMBER_OF_DICE_ROLLS) {
-            parse_error = DE_ROLLS_TOO_LARGE;
+            ctx->parse_error = DE_ROLLS_TOO_LARGE;
             YYERROR;
         }
         $$ = $1;
@@ -156,171 +148,511 @@ ignore_list:
 ignore:
     '<' {
         enum flow_type overflow;
-        NF_PLUS(ignore_small, 1, INT_LEAST64, overflow);
+        NF_PLUS(ctx->ignore_small, 1, INT_LEAST64, overflow);
         if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+            ctx->parse_error = DE_OVERFLOW;
             YYERROR;
         }
-        ignore_small++;
+        ctx->ignore_small++;
     }
 
     | '>' {
         enum flow_type overflow;
-        NF_PLUS(ignore_large, 1, INT_LEAST64, overflow);
+        NF_PLUS(ctx->ignore_large, 1, INT_LEAST64, overflow);
         if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+            ctx->parse_error = DE_OVERFLOW;
             YYERROR;
         }
-        ignore_large++;
+        ctx->ignore_large++;
     }
 
     | '<' INTEGER {
         enum flow_type overflow;
-        NF_PLUS(ignore_small, $2, INT_LEAST64, overflow);
+        NF_PLUS(ctx->ignore_small, $2, INT_LEAST64, overflow);
         if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+            ctx->parse_error = DE_OVERFLOW;
             YYERROR;
         }
-        ignore_small += $2;
+        ctx->ignore_small += $2;
     }
 
     | '>' INTEGER {
         enum flow_type overflow;
-        NF_PLUS(ignore_large, $2, INT_LEAST64, overflow);
+        NF_PLUS(ctx->ignore_large, $2, INT_LEAST64, overflow);
         if (overflow != 0) {
-            parse_error = DE_OVERFLOW;
+            ctx->parse_error = DE_OVERFLOW;
             YYERROR;
         }
-        ignore_large += $2;
+        ctx->ignore_large += $2;
     }
     ;
 
 %%
 
+de_ctx*
+de_ctx_new(void) {
+    de_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return NULL;
+
+    de_rng_seed(&ctx->rng, 0);
+    const char *stats = getenv("GDICE_STATS");
+    ctx->stats_print = stats != NULL && *stats != '\0';
+    ctx->stats_enabled = ctx->stats_print;
+    ctx->transcript = DE_TRANSCRIPT_TRUNCATED;
+    ctx->transcript_limit = DE_TRANSCRIPT_DEFAULT_LIMIT;
+    if ((ctx->rolled_expr = str_new(NULL)) == NULL)
+        goto error;
+    if (scanner_new(ctx, &ctx->scanner) != 0)
+        goto error;
+
+    return ctx;
+
+    error:
+        de_ctx_free(ctx);
+        return NULL;
+}
+
+void
+de_ctx_free(de_ctx *ctx) {
+    if (ctx == NULL)
+        return;
+
+    if (ctx->stats_print)
+        de_stats_print(&ctx->stats, stderr);
+    if (ctx->scanner != NULL)
+        scanner_free(ctx->scanner);
+    if (ctx->rolled_expr != NULL)
+        str_free(ctx->rolled_expr);
+    free(ctx->rolls);
+    free(ctx->scratch);
+    free(ctx->counts);
+    free(ctx->program.ops);
+    for (size_t i = 0; i < DE_DIST_CACHE_SIZE; i++)
+        de_pmf_free(ctx->dist_cache[i].pmf);
+    free(ctx);
+}
+
+void
+de_ctx_seed(de_ctx *ctx, uint64_t seed) {
+    assert(ctx != NULL);
+
+    de_rng_seed(&ctx->rng, seed);
+}
+
+void
+de_ctx_set_transcript(de_ctx *ctx, enum de_transcript transcript) {
+    assert(ctx != NULL);
+
+    ctx->transcript = transcript;
+}
+
+void
+de_ctx_set_transcript_limit(de_ctx *ctx, size_t limit) {
+    assert(ctx != NULL);
+
+    ctx->transcript_limit = limit;
+}
+
+void
+de_ctx_set_progress(de_ctx *ctx, de_progress_fn progress, void *data) {
+    assert(ctx != NULL);
+
+    ctx->progress = progress;
+    ctx->progress_data = data;
+}
+
+void
+de_ctx_set_stats(de_ctx *ctx, int enabled) {
+    assert(ctx != NULL);
+
+    ctx->stats_enabled = enabled;
+}
+
+void
+de_ctx_get_stats(const de_ctx *ctx, de_stats *stats) {
+    assert(ctx != NULL);
+    assert(stats != NULL);
+
+    *stats = ctx->stats;
+}
+
+void
+de_ctx_reset_stats(de_ctx *ctx) {
+    assert(ctx != NULL);
+
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+void
+de_stats_add(de_stats *sum, const de_stats *stats) {
+    assert(sum != NULL);
+    assert(stats != NULL);
+
+    sum->parses += stats->parses;
+    sum->evaluations += stats->evaluations;
+    sum->tokens += stats->tokens;
+    sum->rolls += stats->rolls;
+    sum->selections += stats->selections;
+    sum->allocations += stats->allocations;
+    sum->allocated_bytes += stats->allocated_bytes;
+    sum->lex_ns += stats->lex_ns;
+    sum->parse_ns += stats->parse_ns;
+    sum->rng_ns += stats->rng_ns;
+    sum->select_ns += stats->select_ns;
+    sum->format_ns += stats->format_ns;
+}
+
+void
+de_stats_print(const de_stats *stats, FILE *stream) {
+    assert(stats != NULL);
+    assert(stream != NULL);
+
+    fprintf(stream,
+        "parses:      %" PRIu64 " (%" PRIu64 " tokens)\n"
+        "evaluations: %" PRIu64 " (%" PRIu64 " rolls, %" PRIu64
+            " selections)\n"
+        "allocations: %" PRIu64 " (%" PRIu64 " bytes)\n"
+        "lex:         %.3f ms\n"
+        "parse:       %.3f ms\n"
+        "rng:         %.3f ms\n"
+        "select:      %.3f ms\n"
+        "format:      %.3f ms\n",
+        stats->parses, stats->tokens, stats->evaluations, stats->rolls,
+        stats->selections, stats->allocations, stats->allocated_bytes,
+        stats->lex_ns / 1e6, stats->parse_ns / 1e6, stats->rng_ns / 1e6,
+        stats->select_ns / 1e6, stats->format_ns / 1e6);
+}
+
+de_rng*
+de_ctx_rng(de_ctx *ctx) {
+    assert(ctx != NULL);
+
+    return &ctx->rng;
+}
+
+enum parse_error
+de_compile(de_ctx *ctx, const char *expr, de_expr **compiled) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+    assert(*compiled == NULL);
+
+    de_expr *e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return DE_MEMORY;
+
+    enum parse_error retval = compile(ctx, expr, strlen(expr), e);
+    if (retval != 0) {
+        de_expr_free(e);
+        return retval;
+    }
+    *compiled = e;
+
+    return 0;
+}
+
+enum parse_error
+de_validate(de_ctx *ctx, const char *expr) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+
+    return compile(ctx, expr, strlen(expr), NULL);
+}
+
+enum parse_error
+de_bounds(const de_expr *expr, int_least64_t *min, int_least64_t *max) {
+    assert(expr != NULL);
+
+    if (min != NULL)
+        *min = expr->bounds.min;
+    if (max != NULL)
+        *max = expr->bounds.max;
+
+    return expr->checked ? DE_OVERFLOW : 0;
+}
+
+void
+de_expr_free(de_expr *expr) {
+    if (expr == NULL)
+        return;
+
+    free(expr->ops);
+    free(expr);
+}
+
+enum parse_error
+de_parse_r(de_ctx *ctx, const char *expr, int_least64_t *value,
+           const char **rolled_expression) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+
+    return de_parse_rn(ctx, expr, strlen(expr), value, rolled_expression);
+}
+
+enum parse_error
+de_parse_rn(de_ctx *ctx, const char *expr, size_t len, int_least64_t *value,
+            const char **rolled_expression) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+
+    enum parse_error retval = compile(ctx, expr, len, &ctx->program);
+    if (retval != 0)
+        return retval;
+
+    return de_eval(ctx, &ctx->program, value, rolled_expression);
+}
+
 enum parse_error
 de_parse(const char *expr, int_least64_t *value, char **rolled_expression) {
     assert(expr != NULL);
     assert(*rolled_expression == NULL);
 
-    if ((rolled_expr = str_new(NULL)) == NULL)
+    de_ctx *ctx = de_ctx_new();
+    if (ctx == NULL)
         return DE_MEMORY;
+    de_ctx_seed(ctx, rand());
+
+    const char *rolled = NULL;
+    enum parse_error retval = de_parse_r(ctx, expr, value, &rolled);
+    if (retval == 0) {
+        // Take the rolled expression from the context instead of copying it.
+        *rolled_expression = str_release(ctx->rolled_expr);
+        ctx->rolled_expr = NULL;
+    }
 
-    enum parse_error retval = 0;
+    de_ctx_free(ctx);
 
-    set_scan_string(expr);
-    int parse_retval = yyparse();
-    // Any other error than bison's memory error.
-    if (parse_retval == 1) {
-        // If parse_error is set, then it's some other error than syntax error.
-        retval = parse_error == 0 ? DE_SYNTAX_ERROR : parse_error;
-        goto end;
-    }
-    else if (parse_retval == 2) {
-        retval = DE_MEMORY;
-        goto end;
+    return retval;
+}
+
+const char*
+de_strerror(enum parse_error e) {
+    switch (e) {
+        case DE_MEMORY:
+            return "out of memory";
+        case DE_INVALID_CHARACTER:
+            return "invalid character";
+        case DE_SYNTAX_ERROR:
+            return "syntax error";
+        case DE_NROLLS:
+            return "number of rolls must be positive";
+        case DE_DICE:
+            return "number of sides must be positive";
+        case DE_IGNORE:
+            return "too many ignored rolls";
+        case DE_OVERFLOW:
+            return "integer overflow";
+        case DE_ROLLS_TOO_LARGE:
+            return "too many rolls";
+        case DE_CANCELLED:
+            return "cancelled";
+        case DE_TOO_EXPENSIVE:
+            return "too expensive to compute exactly";
     }
-    *value = result;
-    if (str_copy_to_chars(rolled_expr, rolled_expression) != 0)
-        retval = DE_MEMORY;
-
-    end:
-        delete_buffer();
-        yylex_destroy();
-        str_free(rolled_expr);
-        // Initialize all file globals for the next call.
-        rolled_expr = NULL;
-        ignore_small = 0;
-        ignore_large = 0;
-        parse_error = 0;
-        result = 0;
 
-    return retval;
+    return "unknown error";
 }
 
-/* Roll a dice.
- * Arguments must satisfy: ignore_small + ignore_large < nrolls.
- * @param nrolls Number of rolls for a dice. Must be > 0.
- * @param dice Number of sides in a dice. Must be > 0.
- * @param small Ignore this many smallest rolls.
- * @param large Ignore this many largest rolls.
- * @param dice_sum Sum of dices rolled.
+/* Compile a dice expression.
+ * @param ctx Context, its scanner is used.
+ * @param expr Dice expression, doesn't need to be null terminated.
+ * @param len Length of expr.
+ * @param out Compiled expression. Its old operations are overwritten and its
+ * memory reused. If NULL, the expression is only validated and no operations
+ * are emitted.
  * @return Zero on success, enum parse_error otherwise.
  */
 static enum parse_error
-roll(int_least64_t nrolls,
-     int_least64_t dice,
-     int_least64_t small,
-     int_least64_t large,
-     int_least64_t *dice_sum) {
-    if (nrolls <= 0)
-        return DE_NROLLS;
-    if (dice <= 0)
-        return DE_DICE;
-    if (small + large >= nrolls)
-        return DE_IGNORE;
-
-    enum flow_type interror;
-    NF_UMULTIPLY(nrolls, sizeof(int_least64_t), SIZE, interror);
-    if (interror != 0)
-        return DE_OVERFLOW;
-    int_least64_t *rolls = malloc(nrolls * sizeof(*rolls));
-    if (rolls == NULL)
+compile(de_ctx *ctx, const char *expr, size_t len, de_expr *out) {
+    // Initialize the state of the previous call.
+    ctx->ignore_small = 0;
+    ctx->ignore_large = 0;
+    ctx->parse_error = 0;
+    ctx->input = expr;
+    ctx->input_len = len;
+    ctx->input_pos = 0;
+    ctx->target = out;
+    ctx->depth = 0;
+    ctx->may_overflow = 0;
+    if (out != NULL) {
+        out->len = 0;
+        out->depth = 0;
+    }
+    scanner_reset(ctx->scanner);
+
+    uint64_t start = de_stats_clock(ctx), lex_ns = ctx->stats.lex_ns;
+    int parse_retval = yyparse(ctx->scanner, ctx);
+    ctx->target = NULL;
+    if (ctx->stats_enabled) {
+        ctx->stats.parses++;
+        // Scanning is timed separately.
+        ctx->stats.parse_ns += de_stats_clock(ctx) - start -
+            (ctx->stats.lex_ns - lex_ns);
+    }
+    // Any other error than bison's memory error.
+    if (parse_retval == 1)
+        // If parse_error is set, then it's some other error than syntax error.
+        return ctx->parse_error == 0 ? DE_SYNTAX_ERROR : ctx->parse_error;
+    else if (parse_retval == 2)
         return DE_MEMORY;
 
-    for (int_least64_t i = 0; i < nrolls; i++)
-        rolls[i] = (int_least64_t) (rand() / (double) RAND_MAX * dice + 1);
+    if (out != NULL) {
+        out->bounds = ctx->bounds[0];
+        out->checked = ctx->may_overflow;
+    }
 
-    qsort(rolls, nrolls, sizeof(int_least64_t), sort_ascending);
+    return 0;
+}
 
-    int retval = 0;
-    if (str_append_char(rolled_expr, '(') != 0) {
-        retval = DE_MEMORY;
-        goto free;
-    }
+/* Append an operation to the expression being compiled.
+ * @param ctx
+ * @param type
+ * @param value Value of DE_OP_INTEGER, otherwise not used.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+emit(de_ctx *ctx, enum de_op_type type, int_least64_t value) {
+    de_op op = { type, value, 0, 0, 0 };
+    return append(ctx, &op);
+}
 
-    int_least64_t sum = 0;
-    int_least64_t nth_included_roll = 0;
-    for (int_least64_t i = small; i < nrolls - large; i++, nth_included_roll++) {
-        NF_PLUS(sum, rolls[i], INT_LEAST64, interror);
-        if (interror != 0) {
-            retval = DE_OVERFLOW;
-            goto free;
-        }
-        sum += rolls[i];
-
-        const char *format_with_plus_or_not =
-            nth_included_roll > 0 && nth_included_roll < nrolls - large ?
-                "+%" PRIdLEAST64 : "%" PRIdLEAST64;
-        if (str_append_format(rolled_expr, format_with_plus_or_not, rolls[i])
-            != 0) {
-            retval = DE_MEMORY;
-            goto free;
-        }
-    }
+/* Append a dice operation to the expression being compiled.
+ * Number of rolls to ignore are taken from ctx.
+ * @param ctx
+ * @param nrolls
+ * @param dice
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+emit_dice(de_ctx *ctx, int_least64_t nrolls, int_least64_t dice) {
+    de_op op = { DE_OP_DICE, nrolls, dice, ctx->ignore_small,
+        ctx->ignore_large };
+    return append(ctx, &op);
+}
 
-    if (str_append_char(rolled_expr, ')') != 0) {
-        retval = DE_MEMORY;
-        goto free;
+/* Analyze an operation and append it to the expression being compiled, if
+ * any. Validating analyzes the operations too, so that it finds the same
+ * errors as compiling.
+ * @param ctx
+ * @param op
+ * @return Zero on success, DE_MEMORY if can't allocate memory or the
+ * evaluation stack would be too deep, DE_OVERFLOW if the expression always
+ * overflows.
+ */
+static enum parse_error
+append(de_ctx *ctx, const de_op *op) {
+    enum parse_error retval = analyze(ctx, op);
+    if (retval != 0)
+        return retval;
+
+    de_expr *e = ctx->target;
+    // Only validating.
+    if (e == NULL)
+        return 0;
+
+    if (e->len == e->size) {
+        size_t size = e->size == 0 ? 8 : e->size * 2;
+        de_op *temp = realloc(e->ops, size * sizeof(*temp));
+        if (temp == NULL)
+            return DE_MEMORY;
+        e->ops = temp;
+        e->size = size;
+        de_stats_alloc(ctx, size * sizeof(*temp));
     }
+    e->ops[e->len++] = *op;
+    if (ctx->depth > e->depth)
+        e->depth = ctx->depth;
 
-    *dice_sum = sum;
+    return 0;
+}
 
-    free:
-        free(rolls);
+/* Keep track of the depth of the evaluation stack and the bounds of the
+ * values on it.
+ * The bounds are exact, because every value is rolled independently. A bound
+ * which overflows is saturated and ctx->may_overflow set, so the bounds hold
+ * the values of the evaluations which don't overflow.
+ * @param ctx
+ * @param op
+ * @return Zero on success, DE_MEMORY if the stack would be too deep,
+ * DE_OVERFLOW if every evaluation overflows.
+ */
+static enum parse_error
+analyze(de_ctx *ctx, const de_op *op) {
+    de_interval *top = ctx->depth > 0 ? &ctx->bounds[ctx->depth - 1] : NULL;
+    int_least64_t nkept, min, max;
+    enum flow_type min_flow, max_flow;
+
+    switch (op->type) {
+        case DE_OP_INTEGER:
+            if (ctx->depth == DE_MAX_DEPTH)
+                return DE_MEMORY;
+            top = &ctx->bounds[ctx->depth++];
+            top->min = top->max = op->value;
+            return 0;
+        case DE_OP_DICE:
+            if (ctx->depth == DE_MAX_DEPTH)
+                return DE_MEMORY;
+            top = &ctx->bounds[ctx->depth++];
+            // Every kept roll is at least one, at least one roll is kept.
+            nkept = op->value - op->small - op->large;
+            NF_MULTIPLY(nkept, op->dice, INT_LEAST64, max_flow);
+            max = max_flow == 0 ? nkept * op->dice : 0;
+            return set_bounds(ctx, top, nkept, 0, max, max_flow);
+        case DE_OP_MINUS_SIGN: case DE_OP_PLUS_SIGN:
+            return 0;
+        case DE_OP_NEGATE:
+            NF_MINUS(0, top->max, INT_LEAST64, min_flow);
+            NF_MINUS(0, top->min, INT_LEAST64, max_flow);
+            min = min_flow == 0 ? -top->max : 0;
+            max = max_flow == 0 ? -top->min : 0;
+            return set_bounds(ctx, top, min, min_flow, max, max_flow);
+        case DE_OP_SUBTRACT:
+            NF_MINUS(top[-1].min, top->max, INT_LEAST64, min_flow);
+            NF_MINUS(top[-1].max, top->min, INT_LEAST64, max_flow);
+            min = min_flow == 0 ? top[-1].min - top->max : 0;
+            max = max_flow == 0 ? top[-1].max - top->min : 0;
+            ctx->depth--;
+            return set_bounds(ctx, top - 1, min, min_flow, max, max_flow);
+        case DE_OP_ADD:
+            NF_PLUS(top[-1].min, top->min, INT_LEAST64, min_flow);
+            NF_PLUS(top[-1].max, top->max, INT_LEAST64, max_flow);
+            min = min_flow == 0 ? top[-1].min + top->min : 0;
+            max = max_flow == 0 ? top[-1].max + top->max : 0;
+            ctx->depth--;
+            return set_bounds(ctx, top - 1, min, min_flow, max, max_flow);
+    }
 
-    return retval;
+    return 0;
 }
 
-static int
-sort_ascending(const void *a, const void *b) {
-    const int_least64_t *x = a;
-    const int_least64_t *y = b;
+/* Set the bounds of a value from bounds computed with overflow checks.
+ * @param ctx
+ * @param bounds
+ * @param min
+ * @param min_flow Overflow of min, min isn't used if non-zero.
+ * @param max
+ * @param max_flow Overflow of max, max isn't used if non-zero.
+ * @return Zero on success, DE_OVERFLOW if every value overflows.
+ */
+static enum parse_error
+set_bounds(de_ctx *ctx, de_interval *bounds, int_least64_t min,
+    enum flow_type min_flow, int_least64_t max, enum flow_type max_flow) {
+    if (min_flow == NF_OVERFLOW || max_flow == NF_UNDERFLOW)
+        return DE_OVERFLOW;
+    if (min_flow == NF_UNDERFLOW) {
+        min = INT_LEAST64_MIN;
+        ctx->may_overflow = 1;
+    }
+    if (max_flow == NF_OVERFLOW) {
+        max = INT_LEAST64_MAX;
+        ctx->may_overflow = 1;
+    }
+    bounds->min = min;
+    bounds->max = max;
 
-    if (*x < *y)  return -1;
-    if (*x == *y) return 0;
-    else          return 1;
+    return 0;
 }
 
 // Empty, because on syntax error we don't want to print anything.
 void
-yyerror(const char *s) { }
+yyerror(void *scanner, de_ctx *ctx, const char *s) { }
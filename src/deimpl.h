@@ -0,0 +1,179 @@
+#ifndef DEIMPL_H
+    #define DEIMPL_H
+
+/** @file
+ *
+ * @description Internals of the dice expression evaluator shared by the
+ * parser, the scanner and the evaluator. Not part of the public API, use
+ * diceexpr.h instead.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "diceexpr.h"
+#include "str.h"
+#include "rng.h"
+#include "dist.h"
+
+/** The maximum depth of the evaluation stack.
+ * Operators are left associative and unary operators bind tighter than
+ * binary ones, so the grammar never needs more than two values on the stack.
+ */
+#define DE_MAX_DEPTH 8
+
+/** Number of distributions of dices cached in a context.
+ */
+#define DE_DIST_CACHE_SIZE 16
+
+/** @enum de_op_type Operations of a compiled dice expression.
+ * Operations are stored in the order the parser reduces them, so the
+ * operations evaluated in order both produce the rolled expression from left
+ * to right and compute the value of the expression using a stack.
+ */
+enum de_op_type {
+    DE_OP_INTEGER,          // Push value.
+    DE_OP_DICE,             // Roll a dice and push the sum.
+    DE_OP_MINUS_SIGN,       // Append '-' to rolled expression.
+    DE_OP_PLUS_SIGN,        // Append '+' to rolled expression.
+    DE_OP_NEGATE,           // Negate the top of the stack.
+    DE_OP_SUBTRACT,         // Pop two values and push their difference.
+    DE_OP_ADD               // Pop two values and push their sum.
+};
+
+/** An operation of a compiled dice expression.
+ */
+typedef struct {
+    enum de_op_type type;
+    // Value of DE_OP_INTEGER, number of rolls of DE_OP_DICE.
+    int_least64_t value;
+    // Number of sides and smallest and largest rolls to ignore of DE_OP_DICE.
+    int_least64_t dice, small, large;
+} de_op;
+
+/** The smallest and the largest value of a subexpression.
+ */
+typedef struct {
+    int_least64_t min, max;
+} de_interval;
+
+/** Compiled dice expression.
+ */
+struct de_expr {
+    de_op *ops;
+    // Number of operations and the amount of memory allocated for them.
+    size_t len, size;
+    // The maximum depth of the evaluation stack.
+    size_t depth;
+    // Bounds of the value, saturated if evaluating may overflow.
+    de_interval bounds;
+    // Non-zero if evaluating may overflow, otherwise arithmetic isn't checked.
+    int checked;
+};
+
+/** A cached distribution of a dice.
+ */
+typedef struct {
+    // Number of rolls, sides and smallest and largest rolls to ignore.
+    int_least64_t nrolls, dice, small, large;
+    // NULL if the entry is empty.
+    de_pmf *pmf;
+} de_dist_entry;
+
+/** Evaluation context.
+ * Holds all state of one evaluation, so that different contexts can be used
+ * from different threads at the same time. Buffers are kept between calls
+ * and only grown, so reusing a context doesn't allocate in steady state.
+ */
+struct de_ctx {
+    // Reentrant scanner, reads from input.
+    void *scanner;
+    // Dice expression being parsed and the read position in it.
+    const char *input;
+    size_t input_len, input_pos;
+    // Expression being compiled and the current depth of its stack.
+    de_expr *target;
+    size_t depth;
+    // Bounds of the values on the stack and whether a bound was saturated.
+    de_interval bounds[DE_MAX_DEPTH];
+    int may_overflow;
+    // Parser error.
+    enum parse_error parse_error;
+    // Number of smallest and largest rolls to ignore.
+    int_least64_t ignore_small, ignore_large;
+    // Expression compiled by de_parse_r().
+    de_expr program;
+    // Dice expression after dices are rolled and what to write to it.
+    str *rolled_expr;
+    enum de_transcript transcript;
+    size_t transcript_limit;
+    // Buffer for rolls of a dice and its size in elements.
+    int_least64_t *rolls;
+    size_t rolls_size;
+    // Buffers for selecting ignored rolls and their sizes in elements.
+    int_least64_t *scratch, *counts;
+    size_t scratch_size, counts_size;
+    // Random number generator.
+    de_rng rng;
+    // Progress callback, its data and the progress of the evaluation.
+    de_progress_fn progress;
+    void *progress_data;
+    uint64_t progress_rolled, progress_total;
+    // Distributions of dices, indexed by a hash of the dice.
+    de_dist_entry dist_cache[DE_DIST_CACHE_SIZE];
+    // Statistics, collected only if stats_enabled is non-zero.
+    int stats_enabled;
+    // Print the statistics when freed, set by GDICE_STATS.
+    int stats_print;
+    de_stats stats;
+};
+
+/** Read the clock for statistics.
+ * @param ctx
+ * @return Monotonic time in nanoseconds, zero if statistics are disabled.
+ */
+static inline uint64_t
+de_stats_clock(const de_ctx *ctx) {
+    if (!ctx->stats_enabled)
+        return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Add the time since start to a timer if statistics are enabled.
+ * @param ctx
+ * @param timer
+ * @param start Value of de_stats_clock() when the phase started.
+ */
+static inline void
+de_stats_time(de_ctx *ctx, uint64_t *timer, uint64_t start) {
+    if (ctx->stats_enabled)
+        *timer += de_stats_clock(ctx) - start;
+}
+
+/** Count an allocation if statistics are enabled.
+ * @param ctx
+ * @param bytes Size of the allocation.
+ */
+static inline void
+de_stats_alloc(de_ctx *ctx, size_t bytes) {
+    if (ctx->stats_enabled) {
+        ctx->stats.allocations++;
+        ctx->stats.allocated_bytes += bytes;
+    }
+}
+
+/** Make a buffer of a context large enough.
+ * The buffer is only grown, never shrunk.
+ * @param ctx Context owning the buffer, growing is counted in its statistics.
+ * @param buf Buffer, can point to NULL.
+ * @param size Size of the buffer in elements, updated when the buffer grows.
+ * @param n Number of elements the buffer must hold.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+int
+de_reserve(de_ctx *ctx, int_least64_t **buf, size_t *size, int_least64_t n);
+
+#endif // DEIMPL_H
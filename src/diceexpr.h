@@ -13,7 +13,10 @@
  * ignore ::= ('<' | '>' [INTEGER])*
  */
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include "rng.h"
 /** @enum parse_error de_parse() return values on error.
  */
 enum parse_error {
@@ -24,17 +27,306 @@ enum parse_error {
     DE_DICE,                // Number of sides for a dice is not positive.
     DE_IGNORE,              // Number of ignores for a dice is too large.
     DE_OVERFLOW,            // Integer overflow.
-    DE_ROLLS_TOO_LARGE      // Too many number of rolls, program may hang or
-};                          // memory can run out.
+    DE_ROLLS_TOO_LARGE,     // Too many number of rolls, program may hang or
+                            // memory can run out.
+    DE_CANCELLED,           // Evaluation was cancelled by progress callback.
+    DE_TOO_EXPENSIVE        // Exact distribution has too many values or
+                            // takes too long to compute, see dist.h.
+};
 
 /**
  * The maximum number of rolls for a one dice.
  */
-#define MAX_NUMBER_OF_DICE_ROLLS 10000
+#define MAX_NUMBER_OF_DICE_ROLLS 1000000000
+
+/**
+ * The maximum number of sides for a dice whose rolls are counted per side.
+ * Rolls of a dice with more sides are kept in memory one by one.
+ */
+#define MAX_HISTOGRAM_DICE_SIDES 1000000
+
+/**
+ * The maximum number of rolls for a dice with more than
+ * MAX_HISTOGRAM_DICE_SIDES sides.
+ */
+#define MAX_MATERIALIZED_DICE_ROLLS 1000000
+
+/** @enum de_transcript What to write to the rolled expression.
+ */
+enum de_transcript {
+    DE_TRANSCRIPT_NONE,     // Nothing, only compute the value.
+    DE_TRANSCRIPT_FULL,     // Every kept roll.
+    DE_TRANSCRIPT_TRUNCATED,// Kept rolls up to the limit, then …(N more).
+    DE_TRANSCRIPT_SUMMARY   // Number of kept rolls of every face, like
+};                          // (12×1+9×2), up to the limit of faces.
+
+/**
+ * The default limit of rolls or faces per dice in a transcript.
+ */
+#define DE_TRANSCRIPT_DEFAULT_LIMIT 100
+
+/** Statistics of an evaluation context, see de_ctx_set_stats().
+ * Times are in nanoseconds.
+ */
+typedef struct {
+    // Expressions parsed or validated and evaluations of them.
+    uint64_t parses, evaluations;
+    // Tokens read by the scanner.
+    uint64_t tokens;
+    // Rolls of all dices evaluated.
+    uint64_t rolls;
+    // Dices whose ignored rolls were selected.
+    uint64_t selections;
+    // Allocations of the buffers of the context and their sizes.
+    uint64_t allocations, allocated_bytes;
+    // Scanning, parsing without scanning, drawing random numbers, selecting
+    // ignored rolls and forming rolled expressions.
+    uint64_t lex_ns, parse_ns, rng_ns, select_ns, format_ns;
+} de_stats;
+
+/** Evaluation context.
+ * A context holds all mutable state of the parser, the scanner and the dice
+ * roller. Different contexts can be used from different threads at the same
+ * time, but one context must not be shared between threads without locking.
+ */
+typedef struct de_ctx de_ctx;
+
+/** Create a new evaluation context.
+ * The random number generator of the context is seeded with zero, see
+ * de_ctx_seed(). If the environment variable GDICE_STATS is set and not
+ * empty, statistics are collected and printed to stderr when the context is
+ * freed.
+ * @return New context or NULL if can't allocate memory.
+ */
+de_ctx*
+de_ctx_new(void);
+
+/** Free an evaluation context.
+ * @param ctx Can be NULL.
+ */
+void
+de_ctx_free(de_ctx *ctx);
+
+/** Seed the random number generator of a context.
+ * The same seed and the same expressions give the same rolls.
+ * @param ctx Can't be NULL.
+ * @param seed
+ */
+void
+de_ctx_seed(de_ctx *ctx, uint64_t seed);
+
+/** Get the random number generator of a context.
+ * Can be used to roll dices outside of dice expressions with the same
+ * generator or to plug in a custom generator by setting de_rng::next.
+ * @param ctx Can't be NULL.
+ * @return The generator, owned by ctx.
+ */
+de_rng*
+de_ctx_rng(de_ctx *ctx);
+
+/** Set what is written to the rolled expression.
+ * The default is DE_TRANSCRIPT_TRUNCATED. With DE_TRANSCRIPT_NONE no rolled
+ * expression is formed, which is faster if only the value is needed. The
+ * length of truncated transcripts and summaries is bounded for any number of
+ * rolls. A full transcript takes a few bytes per kept roll, gigabytes for a
+ * dice of MAX_NUMBER_OF_DICE_ROLLS rolls, so it must be asked for.
+ *
+ * Rolls are listed in the order they were rolled, except for dices with many
+ * rolls per side or more than MAX_MATERIALIZED_DICE_ROLLS rolls, which are
+ * rolled by counting the rolls of every side. Their rolls are listed in
+ * ascending order, and a truncated transcript of them which doesn't fit the
+ * limit is written as a summary, so it doesn't show only the smallest
+ * rolls.
+ * @param ctx Can't be NULL.
+ * @param transcript
+ */
+void
+de_ctx_set_transcript(de_ctx *ctx, enum de_transcript transcript);
+
+/** Set the limit of a truncated transcript or a summary.
+ * Kept rolls of a dice after limit rolls, or limit faces for a summary, are
+ * replaced by …(N more), and the text of them is never formed. The default is
+ * DE_TRANSCRIPT_DEFAULT_LIMIT.
+ * @param ctx Can't be NULL.
+ * @param limit
+ */
+void
+de_ctx_set_transcript_limit(de_ctx *ctx, size_t limit);
+
+/** Number of rolls between calls to a progress callback.
+ */
+#define DE_PROGRESS_INTERVAL 65536
+
+/** Progress callback of an evaluation.
+ * Called from the thread evaluating, after every DE_PROGRESS_INTERVAL rolls
+ * of a dice and after every dice.
+ * @param rolled Number of rolls done in the evaluation.
+ * @param total Number of rolls in the evaluation.
+ * @param data Data given to de_ctx_set_progress().
+ * @return Zero to continue, non-zero to cancel the evaluation.
+ */
+typedef int (*de_progress_fn)(uint64_t rolled, uint64_t total, void *data);
+
+/** Set the progress callback of evaluations.
+ * An evaluation cancelled by the callback returns DE_CANCELLED.
+ * @param ctx Can't be NULL.
+ * @param progress NULL to disable, the default.
+ * @param data Passed to progress.
+ */
+void
+de_ctx_set_progress(de_ctx *ctx, de_progress_fn progress, void *data);
+
+/** Enable or disable collecting statistics.
+ * Statistics are disabled by default. When disabled, the cost is a branch per
+ * dice and per parse, when enabled, reading the clock a few times per token
+ * and per dice.
+ * @param ctx Can't be NULL.
+ * @param enabled
+ */
+void
+de_ctx_set_stats(de_ctx *ctx, int enabled);
+
+/** Get the statistics collected since the context was created or reset.
+ * @param ctx Can't be NULL.
+ * @param stats Used to store the statistics.
+ */
+void
+de_ctx_get_stats(const de_ctx *ctx, de_stats *stats);
+
+/** Reset statistics to zero.
+ * @param ctx Can't be NULL.
+ */
+void
+de_ctx_reset_stats(de_ctx *ctx);
+
+/** Add statistics, e.g. of contexts of different threads.
+ * @param sum Statistics added to.
+ * @param stats
+ */
+void
+de_stats_add(de_stats *sum, const de_stats *stats);
+
+/** Print statistics in a human readable form.
+ * @param stats
+ * @param stream
+ */
+void
+de_stats_print(const de_stats *stats, FILE *stream);
+
+/** Parse dice expression using a context.
+ * Reentrant version of de_parse(). The context is reused between calls, so
+ * parsing doesn't allocate memory once the buffers of the context are large
+ * enough.
+ * @param ctx Context, can't be NULL.
+ * @param expr Dice expression, can't be NULL.
+ * @param value Used to store evaluated value.
+ * @param rolled_expression Used to store dice expression after rolling dices,
+ * can be NULL. Points to memory owned by ctx and is valid until the next call
+ * with the same context. NULL if the transcript of ctx is DE_TRANSCRIPT_NONE.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+enum parse_error
+de_parse_r(de_ctx *ctx, const char *expr, int_least64_t *value,
+           const char **rolled_expression);
+
+/** Parse dice expression of a given length using a context.
+ * Like de_parse_r(), but the expression doesn't need to be null terminated,
+ * so expressions can be parsed in place, e.g. lines of a memory mapped file.
+ * @param ctx Context, can't be NULL.
+ * @param expr Dice expression, can't be NULL.
+ * @param len Length of expr in bytes.
+ * @param value Used to store evaluated value.
+ * @param rolled_expression Like in de_parse_r().
+ * @return Zero on success, enum parse_error otherwise.
+ */
+enum parse_error
+de_parse_rn(de_ctx *ctx, const char *expr, size_t len, int_least64_t *value,
+            const char **rolled_expression);
+
+/** Compiled dice expression.
+ * A compiled expression is immutable, so it can be evaluated many times and
+ * shared between threads.
+ */
+typedef struct de_expr de_expr;
+
+/** Compile dice expression.
+ * Check the syntax of an expression and the number of rolls, sides and
+ * ignores of its dices, but don't roll anything. The bounds of the value are
+ * computed too, an expression which overflows whatever is rolled is an
+ * error.
+ * @param ctx Context used for parsing, can't be NULL. The compiled expression
+ * doesn't refer to it.
+ * @param expr Dice expression, can't be NULL.
+ * @param compiled Used to store the compiled expression, must point to NULL.
+ * Free with de_expr_free().
+ * @return Zero on success, enum parse_error otherwise.
+ */
+enum parse_error
+de_compile(de_ctx *ctx, const char *expr, de_expr **compiled);
+
+/** Validate dice expression.
+ * Check the same things as de_compile(), but don't store the compiled
+ * expression. Doesn't use the random number generator and doesn't allocate
+ * memory, except parser stack for very deeply nested signs, so it's cheap
+ * enough to call on every edit of an expression.
+ * @param ctx Context used for parsing, can't be NULL.
+ * @param expr Dice expression, can't be NULL.
+ * @return Zero if the expression is valid, enum parse_error otherwise.
+ */
+enum parse_error
+de_validate(de_ctx *ctx, const char *expr);
+
+/** Free compiled dice expression.
+ * @param expr Can be NULL.
+ */
+void
+de_expr_free(de_expr *expr);
+
+/** The smallest and the largest value of a compiled expression.
+ * The bounds are exact, e.g. 2d6+1 is between 3 and 13. If evaluating the
+ * expression may overflow, the bounds are saturated to INT_LEAST64_MIN and
+ * INT_LEAST64_MAX and hold for evaluations which don't overflow. If it can't,
+ * the expression is evaluated without overflow checks.
+ * @param expr Compiled expression, can't be NULL.
+ * @param min Used to store the smallest value, can be NULL.
+ * @param max Used to store the largest value, can be NULL.
+ * @return Zero if evaluating can't overflow, DE_OVERFLOW if it may.
+ */
+enum parse_error
+de_bounds(const de_expr *expr, int_least64_t *min, int_least64_t *max);
+
+/** Evaluate compiled dice expression.
+ * Roll the dices of the expression using the random number generator of ctx.
+ * @param ctx Context, can't be NULL.
+ * @param expr Compiled expression, can't be NULL.
+ * @param value Used to store evaluated value.
+ * @param rolled_expression Used to store dice expression after rolling dices,
+ * can be NULL. Points to memory owned by ctx and is valid until the next call
+ * with the same context. NULL if the transcript of ctx is DE_TRANSCRIPT_NONE.
+ * If rolled_expression is NULL, the rolled expression isn't formed.
+ * @return Zero on success, DE_OVERFLOW, DE_MEMORY or DE_CANCELLED otherwise.
+ */
+enum parse_error
+de_eval(de_ctx *ctx, const de_expr *expr, int_least64_t *value,
+        const char **rolled_expression);
+
+/** Evaluate compiled dice expression many times.
+ * Rolled expressions aren't formed and the buffers of ctx are grown only
+ * once, so this is faster than calling de_eval() n times.
+ * @param ctx Context, can't be NULL.
+ * @param expr Compiled expression, can't be NULL.
+ * @param n Number of evaluations.
+ * @param out Array of at least n elements for the evaluated values. On error,
+ * values before the failed evaluation are stored.
+ * @return Zero on success, DE_OVERFLOW, DE_MEMORY or DE_CANCELLED otherwise.
+ */
+enum parse_error
+de_eval_batch(de_ctx *ctx, const de_expr *expr, size_t n, int_least64_t *out);
 
 /** Parse dice expression.
  * Caller must call srand() once before using this function. Memory for
- * rolled_expression is allocated, caller should free it.
+ * rolled_expression is allocated, caller should free it. The rolled
+ * expression is a truncated transcript, see de_ctx_set_transcript().
  * @param expr Dice expression, can't be NULL.
  * @param value Used to store evaluated value.
  * @param rolled_expr Used to store dice expression after rolling dices.
@@ -43,4 +335,11 @@ enum parse_error {
 enum parse_error
 de_parse(const char *expr, int_least64_t *value, char **rolled_expression);
 
+/** Describe an error.
+ * @param e Error returned by a function of this file.
+ * @return Untranslated description, a static string.
+ */
+const char*
+de_strerror(enum parse_error e);
+
 #endif
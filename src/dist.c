@@ -0,0 +1,636 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "dist.h"
+#include "deimpl.h"
+#include "numflow.h"
+
+/* Convolve directly if the shorter operand has fewer values than this, with
+ * FFT otherwise.
+ */
+#define DIST_DIRECT_MAX 64
+
+/* The maximum number of operations of the order statistic dynamic program.
+ */
+#define DIST_MAX_WORK 1e9
+
+static de_pmf*
+pmf_new(int_least64_t min, size_t len);
+
+static de_pmf*
+pmf_copy(const de_pmf *pmf);
+
+static void
+pmf_finish(de_pmf *pmf);
+
+static void
+pmf_moments(de_pmf *pmf);
+
+static enum parse_error
+pmf_add(const de_pmf *a, const de_pmf *b, de_pmf **sum);
+
+static enum parse_error
+pmf_negate(de_pmf *pmf);
+
+static de_pmf*
+convolve(const de_pmf *a, const de_pmf *b);
+
+static int
+convolve_fft(const double *a, size_t la, const double *b, size_t lb,
+    double *out);
+
+static int
+power_fft(const double *a, size_t la, int_least64_t k, double *out);
+
+static size_t
+fft_size(size_t len);
+
+static double*
+fft_alloc(size_t n, size_t arrays);
+
+static void
+fft(double *re, double *im, size_t n, const double *cos_table,
+    const double *sin_table, int inverse);
+
+static enum parse_error
+dice_pmf(de_ctx *ctx, const de_op *op, const de_pmf **pmf);
+
+static enum parse_error
+sum_pmf(int_least64_t nrolls, int_least64_t dice, de_pmf **pmf);
+
+static enum parse_error
+keep_pmf(int_least64_t nrolls, int_least64_t dice, int_least64_t small,
+    int_least64_t large, de_pmf **pmf);
+
+static int_least64_t
+kept_below(int_least64_t i, int_least64_t small, int_least64_t last);
+
+enum parse_error
+de_distribution(de_ctx *ctx, const de_expr *expr, de_pmf **pmf) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+    assert(pmf != NULL && *pmf == NULL);
+
+    de_pmf *stack[DE_MAX_DEPTH];
+    size_t top = 0;
+    enum parse_error e = 0;
+
+    for (size_t i = 0; i < expr->len; i++) {
+        const de_op *op = &expr->ops[i];
+        const de_pmf *cached = NULL;
+        de_pmf *a, *b, *c = NULL;
+        switch (op->type) {
+        case DE_OP_INTEGER:
+            if ((stack[top] = pmf_new(op->value, 1)) == NULL) {
+                e = DE_MEMORY;
+                goto error;
+            }
+            stack[top]->p[0] = 1;
+            pmf_finish(stack[top]);
+            stack[top++]->mean = op->value;
+            break;
+        case DE_OP_DICE:
+            if ((e = dice_pmf(ctx, op, &cached)) != 0)
+                goto error;
+            if ((stack[top] = pmf_copy(cached)) == NULL) {
+                e = DE_MEMORY;
+                goto error;
+            }
+            top++;
+            break;
+        case DE_OP_MINUS_SIGN:
+        case DE_OP_PLUS_SIGN:
+            break;
+        case DE_OP_NEGATE:
+            if ((e = pmf_negate(stack[top - 1])) != 0)
+                goto error;
+            break;
+        case DE_OP_SUBTRACT:
+        case DE_OP_ADD:
+            b = stack[top - 1];
+            a = stack[top - 2];
+            if (op->type == DE_OP_SUBTRACT && (e = pmf_negate(b)) != 0)
+                goto error;
+            if ((e = pmf_add(a, b, &c)) != 0)
+                goto error;
+            de_pmf_free(a);
+            de_pmf_free(b);
+            stack[top - 2] = c;
+            top--;
+            break;
+        }
+    }
+    assert(top == 1);
+
+    *pmf = stack[0];
+
+    return 0;
+
+    error:
+        while (top > 0)
+            de_pmf_free(stack[--top]);
+        return e;
+}
+
+void
+de_pmf_free(de_pmf *pmf) {
+    if (pmf == NULL)
+        return;
+
+    free(pmf->p);
+    free(pmf->cdf);
+    free(pmf);
+}
+
+double
+de_pmf_probability(const de_pmf *pmf, int_least64_t value) {
+    assert(pmf != NULL);
+
+    if (value < pmf->min || (uint_least64_t) value - pmf->min >= pmf->len)
+        return 0;
+    return pmf->p[value - pmf->min];
+}
+
+double
+de_pmf_cdf(const de_pmf *pmf, int_least64_t value) {
+    assert(pmf != NULL);
+
+    if (value < pmf->min)
+        return 0;
+    if ((uint_least64_t) value - pmf->min >= pmf->len)
+        return 1;
+    return pmf->cdf[value - pmf->min];
+}
+
+int_least64_t
+de_pmf_percentile(const de_pmf *pmf, double q) {
+    assert(pmf != NULL);
+
+    size_t lo = 0, hi = pmf->len - 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (pmf->cdf[mid] >= q)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return pmf->min + (int_least64_t) lo;
+}
+
+/* Allocate a distribution with all probabilities zero.
+ * @return NULL if can't allocate memory.
+ */
+static de_pmf*
+pmf_new(int_least64_t min, size_t len) {
+    de_pmf *pmf = calloc(1, sizeof(*pmf));
+    if (pmf == NULL)
+        return NULL;
+    pmf->min = min;
+    pmf->len = len;
+    pmf->p = calloc(len, sizeof(*pmf->p));
+    pmf->cdf = malloc(len * sizeof(*pmf->cdf));
+    if (pmf->p == NULL || pmf->cdf == NULL) {
+        de_pmf_free(pmf);
+        return NULL;
+    }
+
+    return pmf;
+}
+
+static de_pmf*
+pmf_copy(const de_pmf *pmf) {
+    de_pmf *copy = pmf_new(pmf->min, pmf->len);
+    if (copy == NULL)
+        return NULL;
+    memcpy(copy->p, pmf->p, pmf->len * sizeof(*pmf->p));
+    memcpy(copy->cdf, pmf->cdf, pmf->len * sizeof(*pmf->cdf));
+    copy->mean = pmf->mean;
+    copy->variance = pmf->variance;
+
+    return copy;
+}
+
+/* Clear rounding errors of the probabilities and compute the cumulative
+ * probabilities. The mean and the variance are not touched.
+ */
+static void
+pmf_finish(de_pmf *pmf) {
+    double total = 0;
+    for (size_t i = 0; i < pmf->len; i++) {
+        if (pmf->p[i] < 0)
+            pmf->p[i] = 0;
+        total += pmf->p[i];
+    }
+
+    double cumulative = 0;
+    for (size_t i = 0; i < pmf->len; i++) {
+        pmf->p[i] /= total;
+        cumulative += pmf->p[i];
+        pmf->cdf[i] = cumulative;
+    }
+    pmf->cdf[pmf->len - 1] = 1;
+}
+
+/* Compute the mean and the variance from the probabilities.
+ * Only used for distributions computed without FFT, whose small
+ * probabilities are exact. Moments of sums are sums of the moments.
+ */
+static void
+pmf_moments(de_pmf *pmf) {
+    // Offsets from min keep the precision when the values are large.
+    double mean = 0;
+    for (size_t i = 0; i < pmf->len; i++)
+        mean += i * pmf->p[i];
+    double variance = 0;
+    for (size_t i = 0; i < pmf->len; i++)
+        variance += (i - mean) * (i - mean) * pmf->p[i];
+
+    pmf->mean = pmf->min + mean;
+    pmf->variance = variance;
+}
+
+/* Distribution of the sum of two independent values.
+ * @return Zero on success, DE_OVERFLOW if the sum can overflow,
+ * DE_TOO_EXPENSIVE if it has too many values or DE_MEMORY.
+ */
+static enum parse_error
+pmf_add(const de_pmf *a, const de_pmf *b, de_pmf **sum) {
+    int_least64_t a_max = a->min + (int_least64_t) (a->len - 1);
+    int_least64_t b_max = b->min + (int_least64_t) (b->len - 1);
+    enum flow_type error;
+    NF_PLUS(a->min, b->min, INT_LEAST64, error);
+    if (error != 0)
+        return DE_OVERFLOW;
+    NF_PLUS(a_max, b_max, INT_LEAST64, error);
+    if (error != 0)
+        return DE_OVERFLOW;
+    if (a->len + b->len - 1 > DE_PMF_MAX_SUPPORT)
+        return DE_TOO_EXPENSIVE;
+
+    if ((*sum = convolve(a, b)) == NULL)
+        return DE_MEMORY;
+    pmf_finish(*sum);
+    (*sum)->mean = a->mean + b->mean;
+    (*sum)->variance = a->variance + b->variance;
+
+    return 0;
+}
+
+/* Distribution of the negated value, in place.
+ * @return Zero on success, DE_OVERFLOW if the negation can overflow.
+ */
+static enum parse_error
+pmf_negate(de_pmf *pmf) {
+    if (pmf->min == INT_LEAST64_MIN)
+        return DE_OVERFLOW;
+
+    for (size_t i = 0, j = pmf->len - 1; i < j; i++, j--) {
+        double t = pmf->p[i];
+        pmf->p[i] = pmf->p[j];
+        pmf->p[j] = t;
+    }
+    pmf->min = -(pmf->min + (int_least64_t) (pmf->len - 1));
+    pmf->mean = -pmf->mean;
+    pmf_finish(pmf);
+
+    return 0;
+}
+
+/* Convolve two distributions. The result is not finished.
+ * @return NULL if can't allocate memory.
+ */
+static de_pmf*
+convolve(const de_pmf *a, const de_pmf *b) {
+    de_pmf *c = pmf_new(a->min + b->min, a->len + b->len - 1);
+    if (c == NULL)
+        return NULL;
+
+    if (a->len < DIST_DIRECT_MAX || b->len < DIST_DIRECT_MAX) {
+        for (size_t i = 0; i < a->len; i++) {
+            double pa = a->p[i];
+            if (pa == 0)
+                continue;
+            for (size_t j = 0; j < b->len; j++)
+                c->p[i + j] += pa * b->p[j];
+        }
+    }
+    else if (convolve_fft(a->p, a->len, b->p, b->len, c->p) != 0) {
+        de_pmf_free(c);
+        return NULL;
+    }
+
+    return c;
+}
+
+/* Convolve with FFT.
+ * @param out Must have room for la + lb - 1 values.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+convolve_fft(const double *a, size_t la, const double *b, size_t lb,
+    double *out) {
+    size_t n = fft_size(la + lb - 1);
+    // Real and imaginary parts of both operands and the twiddle factors.
+    double *buf = fft_alloc(n, 4);
+    if (buf == NULL)
+        return 1;
+    double *a_re = buf, *a_im = buf + n, *b_re = buf + 2 * n,
+        *b_im = buf + 3 * n, *cos_table = buf + 4 * n,
+        *sin_table = cos_table + n / 2;
+    memcpy(a_re, a, la * sizeof(*a));
+    memcpy(b_re, b, lb * sizeof(*b));
+
+    fft(a_re, a_im, n, cos_table, sin_table, 0);
+    fft(b_re, b_im, n, cos_table, sin_table, 0);
+    for (size_t i = 0; i < n; i++) {
+        double re = a_re[i] * b_re[i] - a_im[i] * b_im[i];
+        double im = a_re[i] * b_im[i] + a_im[i] * b_re[i];
+        a_re[i] = re;
+        a_im[i] = im;
+    }
+    fft(a_re, a_im, n, cos_table, sin_table, 1);
+
+    for (size_t i = 0; i < la + lb - 1; i++)
+        out[i] = a_re[i] / n;
+    free(buf);
+
+    return 0;
+}
+
+/* Convolve a with itself, so that there are k operands, with FFT by raising
+ * the transform to the power k.
+ * @param out Must have room for k * (la - 1) + 1 values.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+power_fft(const double *a, size_t la, int_least64_t k, double *out) {
+    size_t len = k * (la - 1) + 1;
+    size_t n = fft_size(len);
+    double *buf = fft_alloc(n, 2);
+    if (buf == NULL)
+        return 1;
+    double *re = buf, *im = buf + n, *cos_table = buf + 2 * n,
+        *sin_table = cos_table + n / 2;
+    memcpy(re, a, la * sizeof(*a));
+
+    fft(re, im, n, cos_table, sin_table, 0);
+    for (size_t i = 0; i < n; i++) {
+        double r = pow(hypot(re[i], im[i]), k);
+        double phi = k * atan2(im[i], re[i]);
+        re[i] = r * cos(phi);
+        im[i] = r * sin(phi);
+    }
+    fft(re, im, n, cos_table, sin_table, 1);
+
+    for (size_t i = 0; i < len; i++)
+        out[i] = re[i] / n;
+    free(buf);
+
+    return 0;
+}
+
+/* The smallest power of two at least len.
+ */
+static size_t
+fft_size(size_t len) {
+    size_t n = 1;
+    while (n < len)
+        n <<= 1;
+
+    return n;
+}
+
+/* Allocate zeroed arrays for FFT of size n, followed by the twiddle factors
+ * cos(2 pi i / n) and sin(2 pi i / n) for i < n / 2.
+ * @param arrays Number of arrays of size n.
+ * @return NULL if can't allocate memory.
+ */
+static double*
+fft_alloc(size_t n, size_t arrays) {
+    double *buf = calloc((arrays + 1) * n, sizeof(*buf));
+    if (buf == NULL)
+        return NULL;
+
+    double *cos_table = buf + arrays * n, *sin_table = cos_table + n / 2;
+    const double pi = acos(-1);
+    for (size_t i = 0; i < n / 2; i++) {
+        cos_table[i] = cos(2 * pi * i / n);
+        sin_table[i] = sin(2 * pi * i / n);
+    }
+
+    return buf;
+}
+
+/* In-place iterative radix-2 FFT. The inverse is not scaled.
+ * @param n A power of two.
+ * @param cos_table cos(2 pi i / n) for i < n / 2.
+ * @param sin_table sin(2 pi i / n) for i < n / 2.
+ * @param inverse
+ */
+static void
+fft(double *re, double *im, size_t n, const double *cos_table,
+    const double *sin_table, int inverse) {
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (size_t len = 2; len <= n; len <<= 1) {
+        size_t half = len / 2, step = n / len;
+        for (size_t i = 0; i < n; i += len) {
+            for (size_t k = 0; k < half; k++) {
+                double w_re = cos_table[k * step];
+                double w_im = inverse ? sin_table[k * step] :
+                    -sin_table[k * step];
+                size_t u = i + k, v = i + k + half;
+                double t_re = re[v] * w_re - im[v] * w_im;
+                double t_im = re[v] * w_im + im[v] * w_re;
+                re[v] = re[u] - t_re;
+                im[v] = im[u] - t_im;
+                re[u] += t_re;
+                im[u] += t_im;
+            }
+        }
+    }
+}
+
+/* Distribution of a dice, from the cache of the context if possible.
+ * @param pmf Set to the distribution, owned by the cache.
+ */
+static enum parse_error
+dice_pmf(de_ctx *ctx, const de_op *op, const de_pmf **pmf) {
+    uint_least64_t hash = (uint_least64_t) op->value * 0x9e3779b97f4a7c15u ^
+        (uint_least64_t) op->dice * 0xbf58476d1ce4e5b9u ^
+        (uint_least64_t) op->small * 0x94d049bb133111ebu ^
+        (uint_least64_t) op->large;
+    de_dist_entry *entry = &ctx->dist_cache[(hash ^ hash >> 29) %
+        DE_DIST_CACHE_SIZE];
+    if (entry->pmf != NULL && entry->nrolls == op->value &&
+        entry->dice == op->dice && entry->small == op->small &&
+        entry->large == op->large) {
+        *pmf = entry->pmf;
+        return 0;
+    }
+
+    de_pmf *computed = NULL;
+    enum parse_error e = op->small == 0 && op->large == 0 ?
+        sum_pmf(op->value, op->dice, &computed) :
+        keep_pmf(op->value, op->dice, op->small, op->large, &computed);
+    if (e != 0)
+        return e;
+
+    de_pmf_free(entry->pmf);
+    entry->nrolls = op->value;
+    entry->dice = op->dice;
+    entry->small = op->small;
+    entry->large = op->large;
+    entry->pmf = computed;
+    *pmf = computed;
+
+    return 0;
+}
+
+/* Distribution of the sum of all rolls of a dice. Narrow distributions are
+ * computed by squaring the distribution of one roll, wide ones by raising its
+ * Fourier transform to the power of the number of rolls.
+ */
+static enum parse_error
+sum_pmf(int_least64_t nrolls, int_least64_t dice, de_pmf **pmf) {
+    if (dice - 1 > (DE_PMF_MAX_SUPPORT - 1) / nrolls)
+        return DE_TOO_EXPENSIVE;
+
+    de_pmf *power = pmf_new(1, dice), *result = NULL, *next;
+    if (power == NULL)
+        return DE_MEMORY;
+    for (int_least64_t i = 0; i < dice; i++)
+        power->p[i] = 1.0 / dice;
+
+    double count = nrolls;
+    size_t len = nrolls * (dice - 1) + 1;
+    if (nrolls > 1 && len >= DIST_DIRECT_MAX * DIST_DIRECT_MAX) {
+        if ((result = pmf_new(nrolls, len)) == NULL ||
+            power_fft(power->p, power->len, nrolls, result->p) != 0)
+            goto error;
+        nrolls = 0;
+    }
+
+    while (nrolls > 0) {
+        if (nrolls & 1) {
+            next = result == NULL ? pmf_copy(power) : convolve(result, power);
+            if (next == NULL)
+                goto error;
+            de_pmf_free(result);
+            result = next;
+        }
+        nrolls >>= 1;
+        if (nrolls == 0)
+            break;
+        if ((next = convolve(power, power)) == NULL)
+            goto error;
+        de_pmf_free(power);
+        power = next;
+    }
+    de_pmf_free(power);
+    pmf_finish(result);
+    result->mean = count * (dice + 1) / 2;
+    result->variance = count * ((double) dice * dice - 1) / 12;
+    *pmf = result;
+
+    return 0;
+
+    error:
+        de_pmf_free(power);
+        de_pmf_free(result);
+        return DE_MEMORY;
+}
+
+/* Distribution of the sum of the kept rolls of a dice.
+ * The sides are processed from the smallest. Given that j rolls are smaller
+ * than side v, the number of the other rolls equal to v is binomial with
+ * probability 1 / (dice - v + 1). If the rolls were sorted, rolls from index j
+ * on are equal to v, so whether they are kept depends only on j. The state is
+ * the number of rolls processed and the sum of the kept ones.
+ */
+static enum parse_error
+keep_pmf(int_least64_t nrolls, int_least64_t dice, int_least64_t small,
+    int_least64_t large, de_pmf **pmf) {
+    int_least64_t last = nrolls - large, nkept = last - small;
+    if (dice - 1 > (DE_PMF_MAX_SUPPORT - 1) / nkept)
+        return DE_TOO_EXPENSIVE;
+    double work = (double) dice * nrolls * (nrolls + 1) / 2 *
+        ((double) nkept * dice + 1);
+    if (work > DIST_MAX_WORK)
+        return DE_TOO_EXPENSIVE;
+
+    size_t width = nkept * dice + 1;
+    double *cur = calloc(2 * (nrolls + 1) * width, sizeof(*cur));
+    de_pmf *result = NULL;
+    if (cur == NULL)
+        return DE_MEMORY;
+    double *next = cur + (nrolls + 1) * width;
+    cur[0] = 1;
+
+    for (int_least64_t v = 1; v <= dice; v++) {
+        memset(next, 0, (nrolls + 1) * width * sizeof(*next));
+        double q = 1.0 / (dice - v + 1);
+        double log_odds = log(q) - log1p(-q);
+
+        for (int_least64_t j = 0; j <= nrolls; j++) {
+            const double *row = cur + j * width;
+            // Sums of kept rolls smaller than v.
+            size_t t_max = kept_below(j, small, last) * (v - 1);
+            int_least64_t rem = nrolls - j;
+            double log_w = rem * log1p(-q);
+            for (int_least64_t c = v == dice ? rem : 0; c <= rem; c++) {
+                double w = v == dice ? 1 : exp(log_w);
+                log_w += log((double) (rem - c) / (c + 1)) + log_odds;
+                if (w == 0)
+                    continue;
+                size_t shift = (kept_below(j + c, small, last) -
+                    kept_below(j, small, last)) * v;
+                double *out = next + (j + c) * width + shift;
+                for (size_t t = 0; t <= t_max; t++)
+                    out[t] += row[t] * w;
+            }
+        }
+
+        double *t = cur;
+        cur = next;
+        next = t;
+    }
+
+    if ((result = pmf_new(nkept, nkept * (dice - 1) + 1)) == NULL) {
+        free(cur < next ? cur : next);
+        return DE_MEMORY;
+    }
+    memcpy(result->p, cur + nrolls * width + nkept,
+        result->len * sizeof(*result->p));
+    free(cur < next ? cur : next);
+    pmf_finish(result);
+    pmf_moments(result);
+    *pmf = result;
+
+    return 0;
+}
+
+/* Number of kept rolls among the i smallest rolls.
+ * @param last Index one past the last kept roll.
+ */
+static int_least64_t
+kept_below(int_least64_t i, int_least64_t small, int_least64_t last) {
+    if (i <= small)
+        return 0;
+    return (i < last ? i : last) - small;
+}
@@ -0,0 +1,83 @@
+#ifndef DIST_H
+    #define DIST_H
+
+/** @file
+ *
+ * @description Exact probability distributions of dice expressions.
+ *
+ * The distribution of a dice is computed by convolving the distribution of
+ * one roll with itself, using FFT when the supports are wide. Dices with
+ * ignored rolls are computed with dynamic programming over order statistics.
+ * The distributions of the dices of an expression are combined with
+ * convolutions like the expression is evaluated. Distributions of dices are
+ * cached in the context per number of rolls, sides and ignored rolls.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "diceexpr.h"
+
+/** The maximum number of values in a distribution.
+ */
+#define DE_PMF_MAX_SUPPORT (1 << 22)
+
+/** Probability mass function of a dice expression.
+ */
+typedef struct {
+    // The smallest value, the value of p[0].
+    int_least64_t min;
+    // Number of values.
+    size_t len;
+    // Probabilities and cumulative probabilities of values min..min + len - 1.
+    double *p, *cdf;
+    // Mean and variance.
+    double mean, variance;
+} de_pmf;
+
+/** Compute the exact distribution of a dice expression.
+ * @param ctx Context, distributions of dices are cached to it. Can't be NULL.
+ * @param expr Compiled expression, can't be NULL.
+ * @param pmf Used to store the distribution, must point to NULL. Free with
+ * de_pmf_free().
+ * Dices with ignored rolls take time proportional to the cube of the number
+ * of rolls and the square of the number of sides, so large ones, e.g.
+ * 1000d6<3, are too expensive to compute exactly even though they can be
+ * rolled.
+ * @return Zero on success, DE_MEMORY, DE_OVERFLOW if the expression can
+ * overflow or DE_TOO_EXPENSIVE if the distribution has more than
+ * DE_PMF_MAX_SUPPORT values or is too expensive to compute.
+ */
+enum parse_error
+de_distribution(de_ctx *ctx, const de_expr *expr, de_pmf **pmf);
+
+/** Free a distribution.
+ * @param pmf Can be NULL.
+ */
+void
+de_pmf_free(de_pmf *pmf);
+
+/** Probability of a value.
+ * @param pmf Can't be NULL.
+ * @param value
+ * @return
+ */
+double
+de_pmf_probability(const de_pmf *pmf, int_least64_t value);
+
+/** Probability of a value or a smaller one.
+ * @param pmf Can't be NULL.
+ * @param value
+ * @return
+ */
+double
+de_pmf_cdf(const de_pmf *pmf, int_least64_t value);
+
+/** The smallest value whose cumulative probability is at least q.
+ * @param pmf Can't be NULL.
+ * @param q In [0, 1], e.g. 0.5 for the median.
+ * @return
+ */
+int_least64_t
+de_pmf_percentile(const de_pmf *pmf, double q);
+
+#endif // DIST_H
@@ -0,0 +1,800 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+#include "diceexpr.h"
+#include "deimpl.h"
+#include "numflow.h"
+#include "str.h"
+#include "select.h"
+
+// U+2026 HORIZONTAL ELLIPSIS and U+00D7 MULTIPLICATION SIGN in UTF-8.
+#define ELLIPSIS "\xe2\x80\xa6"
+#define TIMES "\xc3\x97"
+
+/* Roll a dice by counting rolls per side if it has at least this many times
+ * more rolls than sides, even if the rolls would fit in memory.
+ */
+#define HISTOGRAM_ROLLS_PER_SIDE 16
+
+static enum parse_error
+evaluate(de_ctx *ctx, const de_expr *expr, int transcript, int_least64_t *value);
+
+static enum parse_error
+roll(de_ctx *ctx, const de_op *op, int transcript, int checked,
+    int_least64_t *dice_sum);
+
+static int
+use_histogram(int_least64_t nrolls, int_least64_t dice);
+
+static enum parse_error
+roll_histogram(de_ctx *ctx, const de_op *op, int transcript, int checked,
+    int_least64_t *dice_sum);
+
+static int_least64_t
+kept_count(const int_least64_t *counts, int_least64_t side, const de_keep *keep);
+
+static int
+fill_rolls(de_ctx *ctx, int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice);
+
+static int
+report_progress(de_ctx *ctx, int_least64_t nrolls);
+
+static int
+sum_rolls(const int_least64_t *rolls, int_least64_t from, int_least64_t to,
+    int_least64_t dice, int checked, int_least64_t *sum);
+
+static int
+sum_kept(const int_least64_t *rolls, int_least64_t nrolls, const de_keep *keep,
+    int_least64_t dice, int_least64_t nkept, int checked, int_least64_t *sum);
+
+/* Finds the kept rolls in roll order.
+ */
+typedef struct {
+    const de_keep *keep;
+    // Number of rolls equal to low and high still to keep.
+    int_least64_t low_left, high_left;
+} kept_filter;
+
+static void
+kept_filter_init(kept_filter *f, const de_keep *keep);
+
+static int
+is_kept(kept_filter *f, int_least64_t roll);
+
+static enum parse_error
+append_rolls(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, const de_keep *keep, int_least64_t nkept);
+
+static enum parse_error
+append_sorted_summary(de_ctx *ctx, const int_least64_t *rolls,
+    int_least64_t nrolls, const de_keep *keep, int_least64_t nkept);
+
+static enum parse_error
+append_counts(de_ctx *ctx, const int_least64_t *counts, int_least64_t dice,
+    const de_keep *keep, int_least64_t nkept);
+
+static int
+append_face(str *s, int_least64_t count, int_least64_t face, int first);
+
+static int
+append_more(str *s, int_least64_t more, int first);
+
+static int_least64_t
+transcript_limit(const de_ctx *ctx, int_least64_t nkept);
+
+static int
+reserve_transcript(str *s, int_least64_t nrolls, int_least64_t dice);
+
+static int
+compare_rolls(const void *a, const void *b);
+
+enum parse_error
+de_eval(de_ctx *ctx, const de_expr *expr, int_least64_t *value,
+        const char **rolled_expression) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+
+    int transcript = rolled_expression != NULL &&
+        ctx->transcript != DE_TRANSCRIPT_NONE;
+    size_t size = ctx->rolled_expr->size;
+    enum parse_error e = evaluate(ctx, expr, transcript, value);
+    // Growing the rolled expression is counted once per evaluation.
+    if (ctx->rolled_expr->size != size)
+        de_stats_alloc(ctx, ctx->rolled_expr->size);
+    if (e == 0 && rolled_expression != NULL)
+        *rolled_expression = transcript ? ctx->rolled_expr->str : NULL;
+
+    return e;
+}
+
+enum parse_error
+de_eval_batch(de_ctx *ctx, const de_expr *expr, size_t n, int_least64_t *out) {
+    assert(ctx != NULL);
+    assert(expr != NULL);
+    assert(n == 0 || out != NULL);
+
+    /* Reserve the rolls buffer for the largest dice once, so that iterations
+     * don't have to grow it.
+     */
+    for (size_t i = 0; i < expr->len; i++) {
+        const de_op *op = &expr->ops[i];
+        if (op->type == DE_OP_DICE && !use_histogram(op->value, op->dice) &&
+            de_reserve(ctx, &ctx->rolls, &ctx->rolls_size, op->value) != 0)
+            return DE_MEMORY;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        enum parse_error e = evaluate(ctx, expr, 0, &out[i]);
+        if (e != 0)
+            return e;
+    }
+
+    return 0;
+}
+
+/* Evaluate compiled dice expression.
+ * Arithmetic is checked only if the bounds of the expression show that it
+ * may overflow.
+ * @param ctx
+ * @param expr
+ * @param transcript If non-zero, write rolled expression to ctx->rolled_expr.
+ * @param value Used to store evaluated value.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+evaluate(de_ctx *ctx, const de_expr *expr, int transcript, int_least64_t *value) {
+    assert(expr->depth <= DE_MAX_DEPTH);
+
+    int_least64_t stack[DE_MAX_DEPTH];
+    size_t top = 0;
+    enum flow_type overflow;
+    enum parse_error e;
+
+    if (ctx->stats_enabled)
+        ctx->stats.evaluations++;
+    if (ctx->progress != NULL) {
+        ctx->progress_rolled = 0;
+        ctx->progress_total = 0;
+        for (size_t i = 0; i < expr->len; i++) {
+            if (expr->ops[i].type == DE_OP_DICE)
+                ctx->progress_total += expr->ops[i].value;
+        }
+    }
+    if (transcript)
+        str_erase(ctx->rolled_expr);
+    for (size_t i = 0; i < expr->len; i++) {
+        const de_op *op = &expr->ops[i];
+        switch (op->type) {
+            case DE_OP_INTEGER:
+                if (transcript && str_append_int(ctx->rolled_expr, op->value) != 0)
+                    return DE_MEMORY;
+                stack[top++] = op->value;
+                break;
+            case DE_OP_DICE:
+                if ((e = roll(ctx, op, transcript, expr->checked,
+                              &stack[top])) != 0)
+                    return e;
+                top++;
+                break;
+            case DE_OP_MINUS_SIGN:
+                if (transcript && str_append_char(ctx->rolled_expr, '-') != 0)
+                    return DE_MEMORY;
+                break;
+            case DE_OP_PLUS_SIGN:
+                if (transcript && str_append_char(ctx->rolled_expr, '+') != 0)
+                    return DE_MEMORY;
+                break;
+            case DE_OP_NEGATE:
+                if (expr->checked) {
+                    NF_MINUS(0, stack[top - 1], INT_LEAST64, overflow);
+                    if (overflow != 0)
+                        return DE_OVERFLOW;
+                }
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case DE_OP_SUBTRACT:
+                if (expr->checked) {
+                    NF_MINUS(stack[top - 2], stack[top - 1], INT_LEAST64,
+                        overflow);
+                    if (overflow != 0)
+                        return DE_OVERFLOW;
+                }
+                stack[top - 2] -= stack[top - 1];
+                top--;
+                break;
+            case DE_OP_ADD:
+                if (expr->checked) {
+                    NF_PLUS(stack[top - 2], stack[top - 1], INT_LEAST64,
+                        overflow);
+                    if (overflow != 0)
+                        return DE_OVERFLOW;
+                }
+                stack[top - 2] += stack[top - 1];
+                top--;
+                break;
+        }
+    }
+    assert(top == 1);
+
+    *value = stack[0];
+
+    return 0;
+}
+
+/* Roll a dice.
+ * Arguments are checked when the expression is compiled, so
+ * op->small + op->large < op->value.
+ * @param ctx Context, rolls are stored to its buffer.
+ * @param op Dice operation: number of rolls, sides and rolls to ignore.
+ * @param transcript If non-zero, append kept rolls to ctx->rolled_expr in the
+ * order they were rolled.
+ * @param checked If zero, the sum is known not to overflow.
+ * @param dice_sum Sum of dices rolled.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+roll(de_ctx *ctx, const de_op *op, int transcript, int checked,
+    int_least64_t *dice_sum) {
+    int_least64_t nrolls = op->value;
+    int_least64_t dice = op->dice;
+    int_least64_t small = op->small;
+    int_least64_t large = op->large;
+
+    if (use_histogram(nrolls, dice))
+        return roll_histogram(ctx, op, transcript, checked, dice_sum);
+
+    if (de_reserve(ctx, &ctx->rolls, &ctx->rolls_size, nrolls) != 0)
+        return DE_MEMORY;
+    int_least64_t *rolls = ctx->rolls;
+
+    uint64_t start = de_stats_clock(ctx);
+    int cancelled = fill_rolls(ctx, rolls, nrolls, dice);
+    de_stats_time(ctx, &ctx->stats.rng_ns, start);
+    if (cancelled)
+        return DE_CANCELLED;
+    if (ctx->stats_enabled)
+        ctx->stats.rolls += nrolls;
+
+    // Rolls don't need to be ordered if none are ignored.
+    const de_keep *keep = NULL;
+    de_keep k;
+    if (small > 0 || large > 0) {
+        start = de_stats_clock(ctx);
+        enum parse_error e = de_select(ctx, rolls, nrolls, dice, small, large, &k);
+        de_stats_time(ctx, &ctx->stats.select_ns, start);
+        if (ctx->stats_enabled)
+            ctx->stats.selections++;
+        if (e != 0)
+            return e;
+        keep = &k;
+        if (sum_kept(rolls, nrolls, keep, dice, nrolls - small - large,
+                     checked, dice_sum) != 0)
+            return DE_OVERFLOW;
+    }
+    else if (sum_rolls(rolls, 0, nrolls, dice, checked, dice_sum) != 0)
+        return DE_OVERFLOW;
+
+    if (transcript) {
+        start = de_stats_clock(ctx);
+        enum parse_error e = append_rolls(ctx, rolls, nrolls, dice, keep,
+            nrolls - small - large);
+        de_stats_time(ctx, &ctx->stats.format_ns, start);
+        return e;
+    }
+
+    return 0;
+}
+
+/* Check whether to roll a dice by counting rolls per side.
+ * Counting needs memory proportional to the number of sides instead of the
+ * number of rolls.
+ * @param nrolls
+ * @param dice
+ * @return Non-zero if the dice should be rolled with roll_histogram().
+ */
+static int
+use_histogram(int_least64_t nrolls, int_least64_t dice) {
+    if (dice > MAX_HISTOGRAM_DICE_SIDES)
+        return 0;
+    return nrolls > MAX_MATERIALIZED_DICE_ROLLS ||
+        nrolls / HISTOGRAM_ROLLS_PER_SIDE >= dice;
+}
+
+/* Roll a dice by counting rolls per side.
+ * The counts are drawn from the multinomial distribution as a sequence of
+ * binomial draws, one per side, so the rolls are never generated one by one.
+ * Kept rolls are appended to the transcript in ascending order, or as a
+ * summary, see append_counts().
+ * @param ctx Context, the counts are stored to its buffer.
+ * @param op Dice operation.
+ * @param transcript If non-zero, append kept rolls to ctx->rolled_expr.
+ * @param checked If zero, the sum is known not to overflow.
+ * @param dice_sum Sum of dices rolled.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+roll_histogram(de_ctx *ctx, const de_op *op, int transcript, int checked,
+    int_least64_t *dice_sum) {
+    int_least64_t nrolls = op->value;
+    int_least64_t dice = op->dice;
+
+    if (de_reserve(ctx, &ctx->counts, &ctx->counts_size, dice) != 0)
+        return DE_MEMORY;
+    int_least64_t *counts = ctx->counts;
+
+    uint64_t start = de_stats_clock(ctx);
+    int_least64_t left = nrolls;
+    for (int_least64_t i = 0; i < dice - 1; i++) {
+        counts[i] = left == 0 ? 0 :
+            (int_least64_t) de_rng_binomial(&ctx->rng, left, 1.0 / (dice - i));
+        left -= counts[i];
+    }
+    counts[dice - 1] = left;
+    de_stats_time(ctx, &ctx->stats.rng_ns, start);
+    if (ctx->stats_enabled)
+        ctx->stats.rolls += nrolls;
+    if (report_progress(ctx, nrolls) != 0)
+        return DE_CANCELLED;
+
+    de_keep k = { 1, dice, 0, 0 };
+    const de_keep *keep = NULL;
+    if (op->small > 0 || op->large > 0) {
+        start = de_stats_clock(ctx);
+        de_select_counts(counts, dice, nrolls, op->small, op->large, &k);
+        de_stats_time(ctx, &ctx->stats.select_ns, start);
+        if (ctx->stats_enabled)
+            ctx->stats.selections++;
+        keep = &k;
+    }
+
+    int_least64_t sum = 0;
+    enum flow_type interror;
+    if (checked) {
+        NF_MULTIPLY(nrolls - op->small - op->large, dice, INT_LEAST64,
+            interror);
+        checked = interror != 0;
+    }
+    for (int_least64_t side = keep != NULL ? keep->low : 1;
+         side <= (keep != NULL ? keep->high : dice); side++) {
+        int_least64_t n = kept_count(counts, side, keep);
+        if (checked) {
+            NF_MULTIPLY(n, side, INT_LEAST64, interror);
+            if (interror != 0)
+                return DE_OVERFLOW;
+            NF_PLUS(sum, n * side, INT_LEAST64, interror);
+            if (interror != 0)
+                return DE_OVERFLOW;
+        }
+        sum += n * side;
+    }
+    *dice_sum = sum;
+
+    if (transcript) {
+        start = de_stats_clock(ctx);
+        enum parse_error e = append_counts(ctx, counts, dice, keep,
+            nrolls - op->small - op->large);
+        de_stats_time(ctx, &ctx->stats.format_ns, start);
+        return e;
+    }
+
+    return 0;
+}
+
+/* Number of kept rolls of a side.
+ * @param counts Number of rolls of every side.
+ * @param side
+ * @param keep Kept rolls or NULL if every roll is kept.
+ * @return
+ */
+static int_least64_t
+kept_count(const int_least64_t *counts, int_least64_t side, const de_keep *keep) {
+    if (keep == NULL)
+        return counts[side - 1];
+    if (side < keep->low || side > keep->high)
+        return 0;
+    if (side == keep->low)
+        return keep->low_count;
+    if (side == keep->high)
+        return keep->high_count;
+    return counts[side - 1];
+}
+
+/* Make a buffer large enough.
+ */
+int
+de_reserve(de_ctx *ctx, int_least64_t **buf, size_t *size, int_least64_t n) {
+    if ((size_t) n <= *size)
+        return 0;
+
+    enum flow_type interror;
+    NF_UMULTIPLY((size_t) n, sizeof(int_least64_t), SIZE, interror);
+    if (interror != 0)
+        return 1;
+    int_least64_t *temp = realloc(*buf, n * sizeof(*temp));
+    if (temp == NULL)
+        return 1;
+    *buf = temp;
+    *size = n;
+    de_stats_alloc(ctx, n * sizeof(*temp));
+
+    return 0;
+}
+
+/* Roll dices to a buffer.
+ * If ctx has a progress callback, it's called after every
+ * DE_PROGRESS_INTERVAL rolls.
+ * @param ctx
+ * @param rolls Buffer for at least nrolls rolls.
+ * @param nrolls
+ * @param dice Number of sides.
+ * @return Zero on success, non-zero if cancelled.
+ */
+static int
+fill_rolls(de_ctx *ctx, int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice) {
+    int_least64_t step = ctx->progress != NULL ? DE_PROGRESS_INTERVAL : nrolls;
+    for (int_least64_t from = 0; from < nrolls; from += step) {
+        int_least64_t to = nrolls - from < step ? nrolls : from + step;
+        // A local copy lets the compiler keep the state in registers.
+        de_rng rng = ctx->rng;
+        for (int_least64_t i = from; i < to; i++)
+            rolls[i] = (int_least64_t) de_rng_bounded(&rng, dice) + 1;
+        ctx->rng = rng;
+        if (report_progress(ctx, to - from) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Report rolls done to the progress callback of a context, if any.
+ * @param ctx
+ * @param nrolls Number of rolls done since the last report.
+ * @return Non-zero if the evaluation is cancelled, zero otherwise.
+ */
+static int
+report_progress(de_ctx *ctx, int_least64_t nrolls) {
+    if (ctx->progress == NULL)
+        return 0;
+
+    ctx->progress_rolled += nrolls;
+    return ctx->progress(ctx->progress_rolled, ctx->progress_total,
+        ctx->progress_data);
+}
+
+/* Sum rolls from index from to index to - 1.
+ * If the sum can't overflow, no checks are made in the loop, so the compiler
+ * can vectorize it.
+ * @param rolls
+ * @param from
+ * @param to
+ * @param dice Number of sides, the maximum value of a roll.
+ * @param checked If zero, the sum is known not to overflow.
+ * @param sum Used to store the sum.
+ * @return Zero on success, non-zero if the sum overflows.
+ */
+static int
+sum_rolls(const int_least64_t *rolls, int_least64_t from, int_least64_t to,
+    int_least64_t dice, int checked, int_least64_t *sum) {
+    int_least64_t s = 0;
+    enum flow_type interror;
+
+    if (checked) {
+        NF_MULTIPLY(to - from, dice, INT_LEAST64, interror);
+        checked = interror != 0;
+    }
+    if (!checked) {
+        for (int_least64_t i = from; i < to; i++)
+            s += rolls[i];
+    }
+    else {
+        for (int_least64_t i = from; i < to; i++) {
+            NF_PLUS(s, rolls[i], INT_LEAST64, interror);
+            if (interror != 0)
+                return 1;
+            s += rolls[i];
+        }
+    }
+    *sum = s;
+
+    return 0;
+}
+
+/* Sum kept rolls.
+ * Rolls strictly between the smallest and the largest kept roll are summed
+ * without branches, the rolls equal to them are added afterwards.
+ * @param rolls
+ * @param nrolls
+ * @param keep Kept rolls.
+ * @param dice Number of sides, the maximum value of a roll.
+ * @param nkept Number of kept rolls.
+ * @param checked If zero, the sum is known not to overflow.
+ * @param sum Used to store the sum.
+ * @return Zero on success, non-zero if the sum overflows.
+ */
+static int
+sum_kept(const int_least64_t *rolls, int_least64_t nrolls, const de_keep *keep,
+    int_least64_t dice, int_least64_t nkept, int checked, int_least64_t *sum) {
+    int_least64_t s = 0;
+    enum flow_type interror;
+
+    if (checked) {
+        NF_MULTIPLY(nkept, dice, INT_LEAST64, interror);
+        checked = interror != 0;
+    }
+    if (!checked) {
+        for (int_least64_t i = 0; i < nrolls; i++) {
+            int_least64_t r = rolls[i];
+            s += r > keep->low && r < keep->high ? r : 0;
+        }
+        s += keep->low * keep->low_count + keep->high * keep->high_count;
+    }
+    else {
+        int_least64_t low_left = keep->low_count;
+        int_least64_t high_left = keep->high_count;
+        for (int_least64_t i = 0; i < nrolls; i++) {
+            int_least64_t r = rolls[i];
+            if (r == keep->low && low_left > 0)
+                low_left--;
+            else if (r == keep->high && high_left > 0)
+                high_left--;
+            else if (r <= keep->low || r >= keep->high)
+                continue;
+            NF_PLUS(s, r, INT_LEAST64, interror);
+            if (interror != 0)
+                return 1;
+            s += r;
+        }
+    }
+    *sum = s;
+
+    return 0;
+}
+
+/* Append kept rolls to the transcript as (r1+r2+...) in roll order, or as a
+ * summary of the number of every face.
+ * @param ctx
+ * @param rolls
+ * @param nrolls
+ * @param dice Number of sides.
+ * @param keep Kept rolls or NULL if every roll is kept.
+ * @param nkept Number of kept rolls.
+ * @return Zero on success, DE_MEMORY if can't allocate memory.
+ */
+static enum parse_error
+append_rolls(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, const de_keep *keep, int_least64_t nkept) {
+    if (ctx->transcript == DE_TRANSCRIPT_SUMMARY) {
+        if (dice > nkept || dice > SELECT_HISTOGRAM_MAX_SIDES)
+            return append_sorted_summary(ctx, rolls, nrolls, keep, nkept);
+
+        // Count the kept rolls of every side.
+        if (de_reserve(ctx, &ctx->counts, &ctx->counts_size, dice) != 0)
+            return DE_MEMORY;
+        int_least64_t *counts = ctx->counts;
+        memset(counts, 0, dice * sizeof(*counts));
+        kept_filter f;
+        kept_filter_init(&f, keep);
+        for (int_least64_t i = 0; i < nrolls; i++) {
+            if (is_kept(&f, rolls[i]))
+                counts[rolls[i] - 1]++;
+        }
+        return append_counts(ctx, counts, dice, NULL, nkept);
+    }
+
+    str *s = ctx->rolled_expr;
+    int_least64_t limit = transcript_limit(ctx, nkept), shown = 0;
+    if (reserve_transcript(s, limit, dice) != 0 || str_append_char(s, '(') != 0)
+        return DE_MEMORY;
+    kept_filter f;
+    kept_filter_init(&f, keep);
+    // Stop at the limit, the rest of the rolls are only counted.
+    for (int_least64_t i = 0; i < nrolls && shown < limit; i++) {
+        if (!is_kept(&f, rolls[i]))
+            continue;
+        if ((shown > 0 && str_append_char(s, '+') != 0) ||
+            str_append_int(s, rolls[i]) != 0)
+            return DE_MEMORY;
+        shown++;
+    }
+    if (append_more(s, nkept - shown, shown == 0) != 0 ||
+        str_append_char(s, ')') != 0)
+        return DE_MEMORY;
+
+    return 0;
+}
+
+/* Append a summary of kept rolls by sorting a copy of them. Used if there
+ * are too many sides to count the rolls of every side.
+ * @return Zero on success, DE_MEMORY if can't allocate memory.
+ */
+static enum parse_error
+append_sorted_summary(de_ctx *ctx, const int_least64_t *rolls,
+    int_least64_t nrolls, const de_keep *keep, int_least64_t nkept) {
+    if (de_reserve(ctx, &ctx->scratch, &ctx->scratch_size, nkept) != 0)
+        return DE_MEMORY;
+    int_least64_t *a = ctx->scratch, n = 0;
+    kept_filter f;
+    kept_filter_init(&f, keep);
+    for (int_least64_t i = 0; i < nrolls; i++) {
+        if (is_kept(&f, rolls[i]))
+            a[n++] = rolls[i];
+    }
+    qsort(a, n, sizeof(*a), compare_rolls);
+
+    str *s = ctx->rolled_expr;
+    int_least64_t limit = transcript_limit(ctx, nkept), faces = 0, i = 0;
+    if (str_append_char(s, '(') != 0)
+        return DE_MEMORY;
+    for (; i < n && faces < limit; faces++) {
+        int_least64_t j = i;
+        while (j < n && a[j] == a[i])
+            j++;
+        if (append_face(s, j - i, a[i], faces == 0) != 0)
+            return DE_MEMORY;
+        i = j;
+    }
+    if (append_more(s, n - i, faces == 0) != 0 || str_append_char(s, ')') != 0)
+        return DE_MEMORY;
+
+    return 0;
+}
+
+/* Append kept rolls counted per side to the transcript. Rolls are in
+ * ascending order, one by one or as a summary of the number of every face.
+ * A truncated transcript which doesn't fit the limit is written as a
+ * summary, since the first rolls in ascending order are only the smallest
+ * ones.
+ * @param ctx
+ * @param counts Number of rolls of every side.
+ * @param dice Number of sides.
+ * @param keep Kept rolls or NULL if every roll is kept.
+ * @param nkept Number of kept rolls.
+ * @return Zero on success, DE_MEMORY if can't allocate memory.
+ */
+static enum parse_error
+append_counts(de_ctx *ctx, const int_least64_t *counts, int_least64_t dice,
+    const de_keep *keep, int_least64_t nkept) {
+    str *s = ctx->rolled_expr;
+    int summary = ctx->transcript == DE_TRANSCRIPT_SUMMARY ||
+        (ctx->transcript == DE_TRANSCRIPT_TRUNCATED &&
+         ctx->transcript_limit < (size_t) nkept);
+    // Faces for a summary, rolls otherwise.
+    int_least64_t limit = transcript_limit(ctx, nkept), shown = 0, items = 0;
+    if ((!summary && reserve_transcript(s, limit, dice) != 0) ||
+        str_append_char(s, '(') != 0)
+        return DE_MEMORY;
+
+    int_least64_t first_side = keep != NULL ? keep->low : 1;
+    int_least64_t last_side = keep != NULL ? keep->high : dice;
+    for (int_least64_t side = first_side;
+         side <= last_side && items < limit; side++) {
+        int_least64_t n = kept_count(counts, side, keep);
+        if (n == 0)
+            continue;
+        if (summary) {
+            if (append_face(s, n, side, items == 0) != 0)
+                return DE_MEMORY;
+            items++;
+            shown += n;
+            continue;
+        }
+        for (; n > 0 && items < limit; n--, items++) {
+            if ((items > 0 && str_append_char(s, '+') != 0) ||
+                str_append_int(s, side) != 0)
+                return DE_MEMORY;
+        }
+        shown = items;
+    }
+    if (append_more(s, nkept - shown, items == 0) != 0 ||
+        str_append_char(s, ')') != 0)
+        return DE_MEMORY;
+
+    return 0;
+}
+
+/* Append count×face to a summary.
+ * @param first Non-zero if nothing has been appended inside the parentheses.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_face(str *s, int_least64_t count, int_least64_t face, int first) {
+    if ((!first && str_append_char(s, '+') != 0) ||
+        str_append_int(s, count) != 0 ||
+        str_append_chars(s, TIMES) != 0 ||
+        str_append_int(s, face) != 0)
+        return 1;
+
+    return 0;
+}
+
+/* Append …(N more) for rolls left out of the transcript.
+ * @param more Number of rolls left out, nothing is appended if zero.
+ * @param first Non-zero if nothing has been appended inside the parentheses.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+append_more(str *s, int_least64_t more, int first) {
+    if (more == 0)
+        return 0;
+    if ((!first && str_append_char(s, '+') != 0) ||
+        str_append_chars(s, ELLIPSIS "(") != 0 ||
+        str_append_int(s, more) != 0 ||
+        str_append_chars(s, " more)") != 0)
+        return 1;
+
+    return 0;
+}
+
+/* The maximum number of rolls, or faces of a summary, in the transcript of a
+ * dice.
+ * @param ctx
+ * @param nkept Number of kept rolls.
+ * @return
+ */
+static int_least64_t
+transcript_limit(const de_ctx *ctx, int_least64_t nkept) {
+    if (ctx->transcript == DE_TRANSCRIPT_FULL ||
+        ctx->transcript_limit > (size_t) nkept)
+        return nkept;
+
+    return ctx->transcript_limit;
+}
+
+static void
+kept_filter_init(kept_filter *f, const de_keep *keep) {
+    f->keep = keep;
+    f->low_left = keep != NULL ? keep->low_count : 0;
+    f->high_left = keep != NULL ? keep->high_count : 0;
+}
+
+/* Check whether the next roll is kept. Must be called for every roll in
+ * roll order.
+ * @param f
+ * @param roll
+ * @return Non-zero if the roll is kept.
+ */
+static int
+is_kept(kept_filter *f, int_least64_t roll) {
+    const de_keep *keep = f->keep;
+    if (keep == NULL)
+        return 1;
+    if (roll == keep->low && f->low_left > 0)
+        f->low_left--;
+    else if (roll == keep->high && f->high_left > 0)
+        f->high_left--;
+    else if (roll <= keep->low || roll >= keep->high)
+        return 0;
+
+    return 1;
+}
+
+/* Reserve room for rolls of a dice in the transcript, so that appending them
+ * doesn't grow the string more than once.
+ * @param s
+ * @param nrolls Number of rolls.
+ * @param dice Number of sides, the largest roll.
+ * @return Zero on success, non-zero if can't allocate memory.
+ */
+static int
+reserve_transcript(str *s, int_least64_t nrolls, int_least64_t dice) {
+    int_least64_t digits = 1;
+    for (int_least64_t d = dice; d >= 10; d /= 10)
+        digits++;
+
+    // Parentheses and a plus sign or a parenthesis after every roll.
+    uint_least64_t len = (uint_least64_t) nrolls * (digits + 1) + 1;
+    if (len > SIZE_MAX)
+        return 1;
+
+    return str_reserve(s, len);
+}
+
+static int
+compare_rolls(const void *a, const void *b) {
+    int_least64_t x = *(const int_least64_t*) a, y = *(const int_least64_t*) b;
+
+    return (x > y) - (x < y);
+}
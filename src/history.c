@@ -0,0 +1,120 @@
+#include "history.h"
+
+enum {
+    COLUMN_RESULT,
+    N_COLUMNS
+};
+
+static gboolean
+flush(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data);
+
+static void
+drop_oldest(history *h);
+
+history*
+history_new(GtkTreeView *view, guint capacity) {
+    g_return_val_if_fail(capacity > 0, NULL);
+
+    history *h = g_new(history, 1);
+    h->view = g_object_ref(view);
+    h->store = gtk_list_store_new(N_COLUMNS, G_TYPE_STRING);
+    h->capacity = capacity;
+    g_queue_init(&h->pending);
+    h->tick_id = 0;
+
+    /* Rows are one line high, so the view can compute the height of the
+     * list without measuring every row. Long results are ellipsized and
+     * shown in full in a tooltip.
+     */
+    GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+    g_object_set(renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+    GtkTreeViewColumn *column = gtk_tree_view_column_new_with_attributes(
+        NULL, renderer, "text", COLUMN_RESULT, NULL);
+    gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+    gtk_tree_view_append_column(view, column);
+    gtk_tree_view_set_fixed_height_mode(view, TRUE);
+    gtk_tree_view_set_tooltip_column(view, COLUMN_RESULT);
+    gtk_tree_view_set_model(view, GTK_TREE_MODEL(h->store));
+
+    return h;
+}
+
+void
+history_append(history *h, const gchar *result) {
+    g_queue_push_tail(&h->pending, g_strchomp(g_strdup(result)));
+    // Results which wouldn't fit anyway are never inserted.
+    while (g_queue_get_length(&h->pending) > h->capacity)
+        g_free(g_queue_pop_head(&h->pending));
+
+    if (h->tick_id == 0)
+        h->tick_id = gtk_widget_add_tick_callback(GTK_WIDGET(h->view), flush,
+            h, NULL);
+}
+
+void
+history_clear(history *h) {
+    g_queue_foreach(&h->pending, (GFunc) g_free, NULL);
+    g_queue_clear(&h->pending);
+    gtk_list_store_clear(h->store);
+}
+
+void
+history_set_capacity(history *h, guint capacity) {
+    g_return_if_fail(capacity > 0);
+
+    h->capacity = capacity;
+    drop_oldest(h);
+}
+
+void
+history_free(history *h) {
+    if (h->tick_id != 0)
+        gtk_widget_remove_tick_callback(GTK_WIDGET(h->view), h->tick_id);
+    g_object_unref(h->view);
+    g_queue_foreach(&h->pending, (GFunc) g_free, NULL);
+    g_queue_clear(&h->pending);
+    g_object_unref(h->store);
+    g_free(h);
+}
+
+/* Insert pending results, drop the oldest ones and scroll to the newest.
+ * @param widget
+ * @param clock
+ * @param user_data history object.
+ * @return G_SOURCE_REMOVE, the callback is added again by history_append().
+ */
+static gboolean
+flush(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data) {
+    history *h = user_data;
+    h->tick_id = 0;
+
+    GtkTreeIter iter;
+    gchar *result;
+    while ((result = g_queue_pop_head(&h->pending)) != NULL) {
+        gtk_list_store_insert_with_values(h->store, &iter, -1,
+            COLUMN_RESULT, result, -1);
+        g_free(result);
+    }
+    drop_oldest(h);
+
+    gint n = gtk_tree_model_iter_n_children(GTK_TREE_MODEL(h->store), NULL);
+    if (n > 0) {
+        GtkTreePath *path = gtk_tree_path_new_from_indices(n - 1, -1);
+        gtk_tree_view_scroll_to_cell(h->view, path, NULL, FALSE, 0, 0);
+        gtk_tree_path_free(path);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Remove the oldest results if there are more than the capacity.
+ */
+static void
+drop_oldest(history *h) {
+    GtkTreeModel *model = GTK_TREE_MODEL(h->store);
+    gint n = gtk_tree_model_iter_n_children(model, NULL);
+    GtkTreeIter iter;
+    for (; n > (gint) h->capacity && gtk_tree_model_get_iter_first(model, &iter);
+         n--)
+        gtk_list_store_remove(h->store, &iter);
+}
@@ -0,0 +1,64 @@
+#ifndef HISTORY_H
+    #define HISTORY_H
+
+#include <gtk/gtk.h>
+
+/** The default maximum number of results in a history.
+ */
+#define HISTORY_DEFAULT_CAPACITY 1000
+
+/** History of roll results.
+ * Results are shown in a tree view with fixed height rows, so only the
+ * visible rows are laid out. At most capacity results are kept, the oldest
+ * ones are dropped. Results appended during a frame are inserted together
+ * before the next frame is drawn.
+ */
+typedef struct {
+    GtkTreeView *view;
+    GtkListStore *store;
+    // The maximum number of results kept.
+    guint capacity;
+    // Results waiting for the next frame, oldest first.
+    GQueue pending;
+    // Id of the tick callback inserting pending results, zero if none.
+    guint tick_id;
+} history;
+
+/** Create a history shown in a tree view.
+ * @param view Tree view without a model and columns. The history keeps a
+ * reference to it, since the view can be destroyed before the history.
+ * @param capacity The maximum number of results, at least one.
+ * @return history object.
+ */
+history*
+history_new(GtkTreeView *view, guint capacity);
+
+/** Append a result.
+ * The result is shown on the next frame.
+ * @param h
+ * @param result Result, a trailing newline is removed.
+ */
+void
+history_append(history *h, const gchar *result);
+
+/** Remove all results.
+ * @param h
+ */
+void
+history_clear(history *h);
+
+/** Set the maximum number of results.
+ * The oldest results are dropped if there are more.
+ * @param h
+ * @param capacity At least one.
+ */
+void
+history_set_capacity(history *h, guint capacity);
+
+/** Free history resources.
+ * @param h
+ */
+void
+history_free(history *h);
+
+#endif // HISTORY_H
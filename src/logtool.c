@@ -0,0 +1,293 @@
+/* Read roll logs written by gdice.
+ *
+ * The log is memory mapped and its records are read in place. Matching
+ * records are written as CSV, one per line, or only counted.
+ *
+ * Rolls can be replayed: the generator is seeded again from the seed and the
+ * number of the roll, and the expression is rolled again and compared to the
+ * logged result, so the rolls of a session can be verified.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <getopt.h>
+#include "rolllog.h"
+#include "rng.h"
+
+typedef struct {
+    // Only rolls of this expression, NULL for all.
+    const char *expr;
+    size_t expr_len;
+    // Only failed rolls.
+    int failed;
+    // Count the matching rolls instead of writing them.
+    int count;
+    // Only rolls which don't replay to the logged result.
+    int replay;
+} options;
+
+/* Rolls logged rolls again. The last expression is kept compiled, since
+ * sessions roll the same expressions over and over.
+ */
+typedef struct {
+    de_ctx *ctx;
+    de_expr *compiled;
+    char *expr;
+    size_t expr_len;
+    enum parse_error compile_error;
+    uint64_t replayed, differ;
+} replayer;
+
+static void
+usage(FILE *stream, const char *program);
+
+static int
+parse_options(int argc, char **argv, options *opts, const char **file);
+
+static int
+matches(const options *opts, const de_log_entry *entry);
+
+static int
+replays(replayer *r, const de_log_entry *entry);
+
+static enum parse_error
+compile(replayer *r, const char *expr, size_t len);
+
+static void
+write_csv(FILE *stream, const de_log_entry *entry);
+
+static void
+write_field(FILE *stream, const char *s, size_t len);
+
+int
+main(int argc, char **argv) {
+    options opts = { NULL, 0, 0, 0, 0 };
+    const char *file;
+    if (parse_options(argc, argv, &opts, &file) != 0)
+        return EXIT_FAILURE;
+
+    // Rolled expressions are logged like gdice forms them.
+    replayer r = { NULL, NULL, NULL, 0, 0, 0, 0 };
+    if (opts.replay) {
+        if ((r.ctx = de_ctx_new()) == NULL) {
+            fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+            return EXIT_FAILURE;
+        }
+        de_ctx_set_transcript(r.ctx, DE_TRANSCRIPT_TRUNCATED);
+    }
+
+    de_log_reader reader;
+    int e = de_log_map(file, &reader);
+    if (e != 0) {
+        fprintf(stderr, "%s: %s\n", file, strerror(e));
+        return EXIT_FAILURE;
+    }
+
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    if (!opts.count)
+        printf("time,expression,value,error,rolled,seed,roll,rng\n");
+    uint64_t n = 0;
+    de_log_entry entry;
+    while (de_log_next(&reader, &entry)) {
+        if (!matches(&opts, &entry) || (opts.replay && replays(&r, &entry)))
+            continue;
+        n++;
+        if (!opts.count)
+            write_csv(stdout, &entry);
+    }
+    if (opts.count)
+        printf("%" PRIu64 "\n", n);
+    de_log_unmap(&reader);
+
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        return EXIT_FAILURE;
+    }
+    if (opts.replay) {
+        fprintf(stderr, "%" PRIu64 " rolls replayed, %" PRIu64 " differ\n",
+            r.replayed, r.differ);
+        de_expr_free(r.compiled);
+        free(r.expr);
+        de_ctx_free(r.ctx);
+        if (r.differ > 0)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(FILE *stream, const char *program) {
+    fprintf(stream,
+        "Usage: %s [-e expression] [-E] [-r] [-c] file\n"
+        "Write the rolls of a roll log as CSV.\n"
+        "\n"
+        "  -e expression  only rolls of the expression\n"
+        "  -E             only failed rolls\n"
+        "  -r             roll again, only rolls with a different result\n"
+        "  -c             print the number of rolls instead\n"
+        "  -h             show this help\n", program);
+}
+
+/* Parse command line options.
+ * @return Zero on success, non-zero if the program should exit.
+ */
+static int
+parse_options(int argc, char **argv, options *opts, const char **file) {
+    int opt;
+    while ((opt = getopt(argc, argv, "e:Erch")) != -1) {
+        switch (opt) {
+            case 'e':
+                opts->expr = optarg;
+                opts->expr_len = strlen(optarg);
+                break;
+            case 'E':
+                opts->failed = 1;
+                break;
+            case 'r':
+                opts->replay = 1;
+                break;
+            case 'c':
+                opts->count = 1;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                goto error;
+        }
+    }
+    if (argc - optind != 1)
+        goto error;
+    *file = argv[optind];
+
+    return 0;
+
+    error:
+        usage(stderr, argv[0]);
+        return 1;
+}
+
+/* Whether a record passes the filters.
+ */
+static int
+matches(const options *opts, const de_log_entry *entry) {
+    if (opts->failed && entry->error == 0)
+        return 0;
+    if (opts->expr != NULL && (entry->expr_len != opts->expr_len ||
+            memcmp(entry->expr, opts->expr, opts->expr_len) != 0))
+        return 0;
+
+    return 1;
+}
+
+/* Roll a logged roll again with the generator seeded from its seed and roll
+ * number. Cancelled rolls can't be replayed and always match.
+ * @return Non-zero if the generator and the result are the same as logged.
+ */
+static int
+replays(replayer *r, const de_log_entry *entry) {
+    if (entry->error == DE_CANCELLED)
+        return 1;
+    r->replayed++;
+
+    de_rng *rng = de_ctx_rng(r->ctx);
+    de_rng_seed_stream(rng, entry->seed, entry->roll);
+    int same = memcmp(rng->s, entry->rng, sizeof(rng->s)) == 0;
+    int_least64_t value = 0;
+    const char *rolled = NULL;
+    enum parse_error e = compile(r, entry->expr, entry->expr_len);
+    if (e == 0)
+        e = de_eval(r->ctx, r->compiled, &value, &rolled);
+    if (e != entry->error)
+        same = 0;
+    else if (e == 0 && (value != entry->value ||
+            strlen(rolled) != entry->rolled_len ||
+            memcmp(rolled, entry->rolled, entry->rolled_len) != 0))
+        same = 0;
+    if (!same)
+        r->differ++;
+
+    return same;
+}
+
+/* Compile an expression, unless it's the same as the previous one.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+compile(replayer *r, const char *expr, size_t len) {
+    if (r->expr != NULL && len == r->expr_len &&
+            memcmp(expr, r->expr, len) == 0)
+        return r->compile_error;
+
+    de_expr_free(r->compiled);
+    r->compiled = NULL;
+    free(r->expr);
+    if ((r->expr = malloc(len + 1)) == NULL) {
+        r->expr_len = 0;
+        return DE_MEMORY;
+    }
+    memcpy(r->expr, expr, len);
+    r->expr[len] = '\0';
+    r->expr_len = len;
+    r->compile_error = de_compile(r->ctx, r->expr, &r->compiled);
+
+    return r->compile_error;
+}
+
+/* Write a record as a line of CSV. The time is in UTC, the value is empty if
+ * the roll failed and the state of the random number generator is in hex.
+ */
+static void
+write_csv(FILE *stream, const de_log_entry *entry) {
+    time_t seconds = entry->time / 1000000000;
+    long nanoseconds = entry->time % 1000000000;
+    if (nanoseconds < 0) {
+        seconds--;
+        nanoseconds += 1000000000;
+    }
+    // Consecutive rolls are often in the same second, format it only once.
+    static time_t formatted = -1;
+    static char time_buf[32];
+    if (seconds != formatted) {
+        struct tm tm;
+        if (gmtime_r(&seconds, &tm) == NULL ||
+                strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S",
+                &tm) == 0)
+            time_buf[0] = '\0';
+        formatted = seconds;
+    }
+    fprintf(stream, "%s.%09ldZ,", time_buf, nanoseconds);
+
+    write_field(stream, entry->expr, entry->expr_len);
+    if (entry->error == 0)
+        fprintf(stream, ",%" PRIdLEAST64 ",,", entry->value);
+    else
+        fprintf(stream, ",,%s,", de_strerror(entry->error));
+    write_field(stream, entry->rolled, entry->rolled_len);
+    fprintf(stream, ",%" PRIu64 ",%" PRIu64 ",", entry->seed, entry->roll);
+    fprintf(stream, "%016" PRIx64 "%016" PRIx64 "%016" PRIx64 "%016" PRIx64
+        "\n", entry->rng[0], entry->rng[1], entry->rng[2], entry->rng[3]);
+}
+
+/* Write a CSV field, quoted if needed.
+ */
+static void
+write_field(FILE *stream, const char *s, size_t len) {
+    if (memchr(s, ',', len) == NULL && memchr(s, '"', len) == NULL &&
+            memchr(s, '\n', len) == NULL && memchr(s, '\r', len) == NULL) {
+        fwrite(s, 1, len, stream);
+        return;
+    }
+
+    putc('"', stream);
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '"')
+            putc('"', stream);
+        putc(s[i], stream);
+    }
+    putc('"', stream);
+}
@@ -3,24 +3,112 @@
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include "diceexpr.h"
 #include "config.h"
 #include "sound.h"
-#include "numflow.h"
+#include "history.h"
+#include "completion.h"
+#include "rolllog.h"
+#include "rng.h"
 
 typedef struct {
     gint sides, number_rolls;
 } dice;
 
+// Interval of updating the progress bar of a roll, in milliseconds.
+#define PROGRESS_INTERVAL 100
+// The maximum number of expressions shown in the completion popup.
+#define COMPLETION_MATCHES 50
+// Path of the resources compiled into the program, see gdice.gresource.xml.
+#define RESOURCE_PATH "/com/github/fluks/GDice/"
+
+typedef struct roll_job roll_job;
+
 typedef struct {
     GtkBuilder *builder;
     sound *s;
+    // Results shown to the user.
+    history *history;
+    // Rolled dice expressions for completing the dice expression entry.
+    completion_store *completions;
+    // Context for validating dice expressions.
+    de_ctx *ctx;
+    /* Context for rolling, the last compiled dice expression and its text.
+     * Used by the worker thread, one roll at a time.
+     */
+    de_ctx *roll_ctx;
+    de_expr *compiled;
+    gchar *compiled_text;
+    // Id of the idle source validating the dice expression, zero if none.
+    guint validate_source;
+    // Rolls waiting to be rolled, oldest first, and the roll being rolled.
+    GQueue jobs;
+    roll_job *running;
+    // Id of the timeout updating the progress bar, zero if none.
+    guint progress_source;
+    /* Seed of the session and the number of rolls rolled. Roll n is rolled
+     * with stream n of the seed, see de_rng_seed_stream(), so the rolls of a
+     * session can be replayed with gdice-cli -s seed. Rolls is used by the
+     * worker thread.
+     */
+    guint64 seed;
+    guint64 rolls;
+    // Log of every roll, NULL if disabled. Appended to by the worker thread.
+    de_log *log;
 } roll_param;
 
+/* A roll of the dice expression formed of the GUI state. Rolled in a worker
+ * thread, the result is posted to the history in the main thread.
+ */
+struct roll_job {
+    roll_param *rp;
+    gchar *expr;
+    /* Error forming the expression of the GUI state, NULL if none. Such a
+     * job isn't rolled, the error is only posted to the history in order.
+     */
+    gchar *form_error;
+    /* Text of the dice expression entry, saved for completion if the roll
+     * succeeds. NULL if none.
+     */
+    gchar *entry_text;
+    gboolean verbose;
+    GCancellable *cancellable;
+    // Rolled permille, updated by the worker thread.
+    gint progress;
+    // Result, set by the worker thread.
+    enum parse_error error;
+    int_least64_t result;
+    gchar *rolled_expr;
+};
+
+// Print statistics of the evaluator at exit, set with --stats.
+static gboolean print_stats = FALSE;
+
+// Seed of the session, set with --seed. Random if NULL.
+static gchar *seed_arg = NULL;
+
+// Print the time to the first frame and quit, set with --startup-time.
+static gboolean measure_startup = FALSE;
+// Monotonic time main() was started, in microseconds.
+static gint64 start_time;
+// Decoded icons by resource name, see load_icon().
+static GHashTable *icons = NULL;
+
+static GOptionEntry options[] = {
+    { "stats", 0, 0, G_OPTION_ARG_NONE, &print_stats,
+      N_("Print statistics of the dice expression evaluator at exit"), NULL },
+    { "seed", 0, 0, G_OPTION_ARG_STRING, &seed_arg,
+      N_("Seed the rolls, the same seed and expressions give the same results"),
+      N_("SEED") },
+    { "startup-time", 0, 0, G_OPTION_ARG_NONE, &measure_startup,
+      N_("Print the time to the first frame and quit"), NULL },
+    { NULL }
+};
+
 static void
 roll(GtkWidget *button, gpointer user_data);
 
@@ -46,17 +134,51 @@ static gboolean
 is_verbose(GtkBuilder *builder);
 
 static gboolean
-roll_dices(GList *dices, int_least64_t *result, GString *result_string, GString *error);
+form_dice_expression(roll_param *rp, GString *expr, GString *error);
+
+static void
+append_dices(GString *expr, GList *dices);
+
+static void
+start_roll(roll_param *rp);
+
+static void
+roll_in_thread(GTask *task, gpointer source_object, gpointer task_data,
+    GCancellable *cancellable);
 
 static gboolean
-add_modifier(gint modifier, int_least64_t *result, GString *result_string, GString *error);
+parse_seed(const gchar *s, guint64 *seed);
+
+static void
+log_roll(roll_param *rp, const gchar *expr, const de_rng *rng, guint64 roll,
+    enum parse_error e, int_least64_t value, const char *rolled_expr);
+
+static int
+report_progress(uint64_t rolled, uint64_t total, void *data);
+
+static void
+roll_finished(GObject *source_object, GAsyncResult *res, gpointer user_data);
+
+static gboolean
+update_progress(gpointer user_data);
+
+static void
+cancel_rolls(GtkWidget *button, gpointer user_data);
+
+static void
+roll_job_free(gpointer data);
 
 static gboolean
-add_dice_expression(const gchar *expr, int_least64_t *result, GString *result_string,
-    GString *error);
+check_parse_error(enum parse_error e, GString *error);
+
+static enum parse_error
+compile_dice_expr(roll_param *rp, const gchar *expr, const de_expr **compiled);
 
 static gboolean
-validate_dice_expr(GtkWidget *entry, GdkEvent *event, gpointer builder);
+schedule_validation(GtkWidget *entry, GdkEvent *event, gpointer user_data);
+
+static gboolean
+validate_dice_expr(gpointer user_data);
 
 static void
 set_ui_based_on_dice_expression_validity(GtkWidget *roll_button, GtkWidget *dice_expr,
@@ -72,17 +194,24 @@ static gboolean
 sounds_enabled(GtkBuilder *builder);
 
 static void
-minimize_window(GtkContainer *container, GtkWidget *widget, gpointer user_data);
+sound_toggled(GtkCheckMenuItem *item, gpointer user_data);
 
 static void
-form_result_string(GString *s, int_least64_t result, GtkBuilder *builder);
+minimize_window(GtkContainer *container, GtkWidget *widget, gpointer user_data);
 
 static void
-insert_string_to_buffer(GString *s, GtkBuilder *builder);
+form_result_string(GString *s, int_least64_t result, gboolean verbose);
+
 
 static void
 set_window_icon(GtkWindow *window);
 
+static GdkPixbuf*
+load_icon(const gchar *name);
+
+static void
+first_frame_painted(GdkFrameClock *clock, gpointer user_data);
+
 static void
 load_css();
 
@@ -90,13 +219,19 @@ static void
 set_widgets_same_size(GtkBuilder *builder, const gchar *src, const gchar *dst);
 
 static void
-add_dice_expr_completion(GtkEntry *entry);
+add_dice_expr_completion(GtkEntry *entry, completion_store *store);
+
+static void
+update_dice_expr_completion(GtkEditable *editable, gpointer user_data);
 
 static void
-append_dice_expr_completion(GtkEntry *entry);
+load_preferences(roll_param *rp);
 
 static void
-load_preferences(GtkBuilder *builder);
+history_size_changed(GSettings *settings, gchar *key, gpointer user_data);
+
+static void
+completion_size_changed(GSettings *settings, gchar *key, gpointer user_data);
 
 static void
 show_about_window(GtkMenuItem *menuitem, gpointer user_data);
@@ -104,38 +239,79 @@ show_about_window(GtkMenuItem *menuitem, gpointer user_data);
 static void
 show_help_window(GtkMenuItem *menuitem, gpointer user_data);
 
+static GObject*
+build_window(GtkBuilder *builder, const gchar *resource, const gchar *name);
+
 static void
 connect_help_window_signals(GtkBuilder *builder);
 
 int
 main(int argc, char **argv) {
+    start_time = g_get_monotonic_time();
     bindtextdomain(GETTEXT_PACKAGE, PROGRAMNAME_LOCALEDIR);
     bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
     textdomain(GETTEXT_PACKAGE);
 
-    // For de_parse().
-    srand(time(NULL));
-
+    // Unknown options are left for GStreamer.
+    GOptionContext *context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, options, GETTEXT_PACKAGE);
+    g_option_context_add_group(context, gtk_get_option_group(TRUE));
+    g_option_context_set_ignore_unknown_options(context, TRUE);
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+    guint64 seed = ((guint64) g_random_int() << 32) | g_random_int();
+    if (seed_arg != NULL && !parse_seed(seed_arg, &seed)) {
+        g_printerr("Invalid seed: %s\n", seed_arg);
+        return EXIT_FAILURE;
+    }
+    g_free(seed_arg);
     gtk_init(&argc, &argv);
     sound *s = sound_init(&argc, &argv, RESDIR "dices.ogg");
 
+    gchar *completion_path = g_build_filename(g_get_user_data_dir(),
+        PACKAGE_NAME, "expressions", NULL);
+    roll_param rp = { NULL, s, NULL,
+        completion_store_new(completion_path, COMPLETION_DEFAULT_CAPACITY),
+        de_ctx_new(), de_ctx_new(), NULL, NULL, 0, G_QUEUE_INIT, NULL, 0,
+        seed, 0, NULL };
+    g_free(completion_path);
+    if (rp.ctx == NULL || rp.roll_ctx == NULL) {
+        g_printerr("Out of memory\n");
+        abort();
+    }
+    if (print_stats) {
+        de_ctx_set_stats(rp.ctx, TRUE);
+        de_ctx_set_stats(rp.roll_ctx, TRUE);
+    }
+
     GtkBuilder *builder = gtk_builder_new();
-    gtk_builder_add_from_file(builder, RESDIR "gdice.glade", NULL);
+    // The about and help windows are built when they're shown first.
+    gtk_builder_add_from_resource(builder, RESOURCE_PATH "gdice.glade", NULL);
+    rp.builder = builder;
+    rp.history = history_new(
+        GTK_TREE_VIEW(gtk_builder_get_object(builder, "history")),
+        HISTORY_DEFAULT_CAPACITY);
 
     gtk_builder_connect_signals(builder, NULL);
 
     GObject *dice_expr = gtk_builder_get_object(builder, "dice_expression");
-    g_signal_connect(dice_expr, "key-release-event", G_CALLBACK(validate_dice_expr), builder);
+    g_signal_connect(dice_expr, "key-release-event", G_CALLBACK(schedule_validation), &rp);
 
-    add_dice_expr_completion(GTK_ENTRY(dice_expr));
+    add_dice_expr_completion(GTK_ENTRY(dice_expr), rp.completions);
 
     GObject *roll_button = gtk_builder_get_object(builder, "roll_button");
-    roll_param rp = { builder, s };
     g_signal_connect(roll_button, "clicked", G_CALLBACK(roll), &rp);
     gtk_widget_set_can_default(GTK_WIDGET(roll_button), TRUE);
 
     GObject *reset_button = gtk_builder_get_object(builder, "reset_button");
-    g_signal_connect(reset_button, "clicked", G_CALLBACK(reset), builder);
+    g_signal_connect(reset_button, "clicked", G_CALLBACK(reset), &rp);
+
+    GObject *cancel_button = gtk_builder_get_object(builder, "cancel_button");
+    g_signal_connect(cancel_button, "clicked", G_CALLBACK(cancel_rolls), &rp);
 
     GObject *add_button = gtk_builder_get_object(builder, "add_button");
     g_signal_connect(GTK_WIDGET(add_button), "clicked", G_CALLBACK(add_dice), builder);
@@ -143,7 +319,12 @@ main(int argc, char **argv) {
     GObject *window = gtk_builder_get_object(builder, "window");
     gtk_window_set_default(GTK_WINDOW(window), GTK_WIDGET(roll_button));
     gtk_window_set_resizable(GTK_WINDOW(window), FALSE);
-    set_window_icon(GTK_WINDOW(window));
+    // The seed is needed to replay the rolls of the session.
+    gchar seed_text[24];
+    g_snprintf(seed_text, sizeof(seed_text), "%" G_GUINT64_FORMAT, rp.seed);
+    gchar *title = g_strdup_printf(_("GDice, seed %s"), seed_text);
+    gtk_window_set_title(GTK_WINDOW(window), title);
+    g_free(title);
 
     GObject *variable_dices_box = gtk_builder_get_object(builder, "variable_dices_box");
     g_signal_connect(variable_dices_box, "remove", G_CALLBACK(minimize_window), window);
@@ -155,9 +336,11 @@ main(int argc, char **argv) {
 
     load_css();
 
-    load_preferences(builder);
+    load_preferences(&rp);
 
     gtk_widget_show_all(GTK_WIDGET(window));
+    g_signal_connect(gtk_widget_get_frame_clock(GTK_WIDGET(window)),
+        "after-paint", G_CALLBACK(first_frame_painted), window);
 
     set_widgets_same_size(builder, "dice_expression_label", "dN");
 #ifndef HAVE_GSTREAMER
@@ -167,71 +350,313 @@ main(int argc, char **argv) {
 
     gtk_main();
 
+    // Wait for the worker thread, its result isn't shown.
+    cancel_rolls(NULL, &rp);
+    if (rp.progress_source != 0) {
+        g_source_remove(rp.progress_source);
+        rp.progress_source = 0;
+    }
+    while (rp.running != NULL)
+        g_main_context_iteration(NULL, TRUE);
+
+    int log_error = de_log_close(rp.log);
+    if (log_error != 0)
+        g_printerr("Can't write the roll log: %s\n", g_strerror(log_error));
+
     sound_end(s);
+    history_free(rp.history);
+    if (!completion_store_save(rp.completions, &error)) {
+        g_printerr("%s\n", error->message);
+        g_clear_error(&error);
+    }
+    completion_store_free(rp.completions);
+    if (rp.validate_source != 0)
+        g_source_remove(rp.validate_source);
+    de_expr_free(rp.compiled);
+    g_free(rp.compiled_text);
+    if (print_stats) {
+        de_stats stats, roll_stats;
+        de_ctx_get_stats(rp.ctx, &stats);
+        de_ctx_get_stats(rp.roll_ctx, &roll_stats);
+        de_stats_add(&stats, &roll_stats);
+        de_stats_print(&stats, stdout);
+    }
+    de_ctx_free(rp.ctx);
+    de_ctx_free(rp.roll_ctx);
+    if (icons != NULL)
+        g_hash_table_destroy(icons);
 }
 
-/** Roll dices and put result to TextView.
+/** Queue a roll.
+ * The dice expression, the dices and the modifier are rolled as one
+ * expression in a worker thread, and the result is appended to the history
+ * when it's done. Rolls are rolled one at a time in the order queued. An
+ * error forming the expression is queued too, to be posted in order.
  * @param button Roll button. Not used.
  * @param user_data roll_param struct.
  */
 static void
 roll(GtkWidget *button, gpointer user_data) {
     roll_param *rp = user_data;
-    int_least64_t result = 0;
-    GString *result_string = g_string_new("");
+    GString *expr = g_string_new("");
     GString *error = g_string_new("");
-    GList *const_dices = NULL, *var_dices = NULL;
 
-    const gchar *expr = get_dice_expression(rp->builder);
-    if (!add_dice_expression(expr, &result, result_string, error))
-        goto error;
+    roll_job *job = NULL;
+    if (!form_dice_expression(rp, expr, error)) {
+        job = g_new0(roll_job, 1);
+        job->form_error = g_string_free(error, FALSE);
+        error = NULL;
+        goto queue;
+    }
 
-    const_dices = get_const_dices(rp->builder);
-    if (!roll_dices(const_dices, &result, result_string, error))
-        goto error;
+    /* No input. */
+    if (expr->len == 0)
+        goto clean_up;
 
-    gint modifier = get_modifier(rp->builder);
-    if (!add_modifier(modifier, &result, result_string, error))
-        goto error;
+    job = g_new0(roll_job, 1);
+    job->expr = g_string_free(expr, FALSE);
+    expr = NULL;
+    // The lexer skips newlines, but the saved expressions are lines.
+    const gchar *text = get_dice_expression(rp->builder);
+    if (*text != '\0' && strchr(text, '\n') == NULL)
+        job->entry_text = g_strdup(text);
+    job->verbose = is_verbose(rp->builder);
+
+    queue:
+        job->rp = rp;
+        job->cancellable = g_cancellable_new();
+        g_queue_push_tail(&rp->jobs, job);
+        if (rp->running == NULL)
+            start_roll(rp);
 
-    var_dices = get_var_dices(rp->builder);
-    if (!roll_dices(var_dices, &result, result_string, error))
-        goto error;
+    clean_up:
+        if (expr != NULL)
+            g_string_free(expr, TRUE);
+        if (error != NULL)
+            g_string_free(error, TRUE);
+}
 
-    /* No input. */
-    if (result_string->len == 0)
-        goto clean_up;
+/** Start rolling the oldest queued roll in a worker thread.
+ * @param rp
+ */
+static void
+start_roll(roll_param *rp) {
+    rp->running = g_queue_pop_head(&rp->jobs);
+
+    GTask *task = g_task_new(NULL, rp->running->cancellable, roll_finished,
+        rp);
+    g_task_set_task_data(task, rp->running, NULL);
+    g_task_run_in_thread(task, roll_in_thread);
+    g_object_unref(task);
+
+    if (rp->progress_source == 0)
+        rp->progress_source = g_timeout_add(PROGRESS_INTERVAL,
+            update_progress, rp);
+}
 
-    append_dice_expr_completion(
-        GTK_ENTRY(gtk_builder_get_object(rp->builder, "dice_expression")));
+/** Roll a queued roll, run in a worker thread.
+ * Only the context for rolling and the compiled expression of rp are used.
+ * @param task
+ * @param source_object Not used.
+ * @param task_data roll_job struct.
+ * @param cancellable Not used, the progress callback checks the
+ * cancellable of the job.
+ */
+static void
+roll_in_thread(GTask *task, gpointer source_object, gpointer task_data,
+    GCancellable *cancellable) {
+    roll_job *job = task_data;
+    roll_param *rp = job->rp;
 
-    if (sounds_enabled(rp->builder))
-        sound_play(rp->s);
+    if (job->form_error != NULL) {
+        g_task_return_boolean(task, TRUE);
+        return;
+    }
 
-    form_result_string(result_string, result, rp->builder);
-    insert_string_to_buffer(result_string, rp->builder);
-    goto clean_up;
+    /* The rolled expression is thrown away if not verbose and not logged,
+     * so don't form it. Otherwise show a bounded number of rolls per dice.
+     */
+    de_ctx_set_transcript(rp->roll_ctx, job->verbose || rp->log != NULL ?
+        DE_TRANSCRIPT_TRUNCATED : DE_TRANSCRIPT_NONE);
+    de_ctx_set_progress(rp->roll_ctx, report_progress, job);
+
+    const char *rolled_expr = NULL;
+    const de_expr *compiled = NULL;
+    guint64 roll = rp->rolls++;
+    de_rng_seed_stream(de_ctx_rng(rp->roll_ctx), rp->seed, roll);
+    de_rng rng = *de_ctx_rng(rp->roll_ctx);
+    job->error = compile_dice_expr(rp, job->expr, &compiled);
+    if (job->error == 0)
+        job->error = de_eval(rp->roll_ctx, compiled, &job->result,
+            &rolled_expr);
+    if (rp->log != NULL)
+        log_roll(rp, job->expr, &rng, roll, job->error, job->result,
+            rolled_expr);
+    // NULL if not formed.
+    if (job->error == 0 && job->verbose && rolled_expr != NULL)
+        job->rolled_expr = g_strdup(rolled_expr);
+
+    g_task_return_boolean(task, TRUE);
+}
 
-    error:
-        insert_string_to_buffer(error, rp->builder);
+/** Parse a seed given on the command line.
+ * @param s Decimal, hex with 0x or octal with 0.
+ * @param seed Used to store the seed.
+ * @return TRUE on success, FALSE if s isn't a seed.
+ */
+static gboolean
+parse_seed(const gchar *s, guint64 *seed) {
+    gchar *end;
+    errno = 0;
+    *seed = g_ascii_strtoull(s, &end, 0);
 
-    clean_up:
-        if (const_dices != NULL)
-            g_list_free_full(const_dices, g_free);
-        if (var_dices != NULL)
-            g_list_free_full(var_dices, g_free);
+    return *s != '\0' && *end == '\0' && errno == 0;
+}
+
+/** Append a roll to the roll log, called by the worker thread.
+ * Logging is stopped if the log can't be written.
+ * @param rp
+ * @param expr The rolled dice expression.
+ * @param rng The random number generator before the roll.
+ * @param roll Number of the roll in the session.
+ * @param e Error of the roll or zero.
+ * @param value
+ * @param rolled_expr Can be NULL.
+ */
+static void
+log_roll(roll_param *rp, const gchar *expr, const de_rng *rng, guint64 roll,
+    enum parse_error e, int_least64_t value, const char *rolled_expr) {
+    de_log_entry entry = { g_get_real_time() * 1000,
+        { rng->s[0], rng->s[1], rng->s[2], rng->s[3] }, rp->seed, roll, e,
+        e == 0 ? value : 0, expr, strlen(expr), rolled_expr,
+        e == 0 && rolled_expr != NULL ? strlen(rolled_expr) : 0 };
+    int log_error = de_log_append(rp->log, &entry);
+    if (log_error != 0) {
+        // Rolls are rolled one at a time, nothing else uses the log.
+        g_printerr("Can't write the roll log, logging stopped: %s\n",
+            g_strerror(log_error));
+        de_log_close(rp->log);
+        rp->log = NULL;
+    }
+}
+
+/** Progress callback of rolling, called by the worker thread.
+ * @param rolled
+ * @param total
+ * @param data roll_job struct.
+ * @return Non-zero if the roll is cancelled.
+ */
+static int
+report_progress(uint64_t rolled, uint64_t total, void *data) {
+    roll_job *job = data;
+
+    g_atomic_int_set(&job->progress, total > 0 ? rolled * 1000 / total : 0);
+
+    return g_cancellable_is_cancelled(job->cancellable);
+}
+
+/** Append the result of a roll to the history and start the next one.
+ * @param source_object Not used.
+ * @param res
+ * @param user_data roll_param struct.
+ */
+static void
+roll_finished(GObject *source_object, GAsyncResult *res, gpointer user_data) {
+    roll_param *rp = user_data;
+    roll_job *job = rp->running;
+    rp->running = NULL;
+
+    if (job->error == 0 && job->entry_text != NULL)
+        completion_store_add(rp->completions, job->entry_text);
+    // The widgets are destroyed when the main loop has quit.
+    if (gtk_main_level() > 0 && job->form_error != NULL)
+        history_append(rp->history, job->form_error);
+    else if (gtk_main_level() > 0) {
+        GString *result_string = g_string_new(job->rolled_expr);
+        if (check_parse_error(job->error, result_string)) {
+            if (sounds_enabled(rp->builder))
+                sound_play(rp->s);
+            form_result_string(result_string, job->result, job->verbose);
+        }
+        history_append(rp->history, result_string->str);
         g_string_free(result_string, TRUE);
-        g_string_free(error, TRUE);
+    }
+    roll_job_free(job);
+
+    if (!g_queue_is_empty(&rp->jobs))
+        start_roll(rp);
+    else if (rp->progress_source != 0) {
+        g_source_remove(rp->progress_source);
+        rp->progress_source = 0;
+        GObject *box = gtk_builder_get_object(rp->builder, "progress_box");
+        gtk_widget_hide(GTK_WIDGET(box));
+    }
+}
+
+/** Show the progress of the roll being rolled.
+ * Called periodically while rolling, so quick rolls never show the progress
+ * bar.
+ * @param user_data roll_param struct.
+ * @return G_SOURCE_CONTINUE.
+ */
+static gboolean
+update_progress(gpointer user_data) {
+    roll_param *rp = user_data;
+
+    GObject *bar = gtk_builder_get_object(rp->builder, "roll_progress");
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(bar),
+        g_atomic_int_get(&rp->running->progress) / 1000.0);
+    gchar *text = g_queue_is_empty(&rp->jobs) ? NULL :
+        g_strdup_printf(_("%u more queued"), g_queue_get_length(&rp->jobs));
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(bar), text != NULL);
+    gtk_progress_bar_set_text(GTK_PROGRESS_BAR(bar), text);
+    g_free(text);
+
+    // Not shown by gtk_widget_show_all() of the window.
+    GObject *box = gtk_builder_get_object(rp->builder, "progress_box");
+    gtk_widget_show(GTK_WIDGET(box));
+
+    return G_SOURCE_CONTINUE;
+}
+
+/** Cancel the roll being rolled and the queued rolls.
+ * The cancelled roll is shown in the history.
+ * @param button Cancel button, can be NULL. Not used.
+ * @param user_data roll_param struct.
+ */
+static void
+cancel_rolls(GtkWidget *button, gpointer user_data) {
+    roll_param *rp = user_data;
+
+    g_queue_foreach(&rp->jobs, (GFunc) roll_job_free, NULL);
+    g_queue_clear(&rp->jobs);
+    if (rp->running != NULL)
+        g_cancellable_cancel(rp->running->cancellable);
+}
+
+/** Free a roll.
+ * @param data roll_job struct.
+ */
+static void
+roll_job_free(gpointer data) {
+    roll_job *job = data;
+
+    g_free(job->expr);
+    g_free(job->form_error);
+    g_free(job->entry_text);
+    g_object_unref(job->cancellable);
+    g_free(job->rolled_expr);
+    g_free(job);
 }
 
 /** Form the result string, verbose or just the integer.
  * @param s Result string.
  * @param result Integer result.
- * @param builder
+ * @param verbose
  */
 static void
-form_result_string(GString *s, int_least64_t result, GtkBuilder *builder) {
-    if (is_verbose(builder)) {
+form_result_string(GString *s, int_least64_t result, gboolean verbose) {
+    if (verbose) {
         if (*(s->str) == '+')
             g_string_erase(s, 0, 1);
         g_string_append(s, " = ");
@@ -242,20 +667,6 @@ form_result_string(GString *s, int_least64_t result, GtkBuilder *builder) {
     g_string_append_printf(s, "%" PRIdLEAST64 "\n", result);
 }
 
-/** Insert result string to the textview and scroll to the end of the textview.
- * @param s Result string.
- * @param builder
- */
-static void
-insert_string_to_buffer(GString *s, GtkBuilder *builder) {
-    GObject *textview = gtk_builder_get_object(builder, "textview");
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
-    gtk_text_buffer_insert_at_cursor(buffer, s->str, s->len);
-
-    GtkTextMark *mark = gtk_text_buffer_get_mark(buffer, "insert");
-    gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(textview), mark, 0, FALSE, 0, 0);
-}
-
 /** Add a new variable dice.
  * @param button Add button, which was pressed. Not used.
  * @param user_data GtkBuilder object.
@@ -291,7 +702,8 @@ add_dice(GtkWidget *button, gpointer user_data) {
     gtk_box_pack_start(GTK_BOX(variable_dice), number_rolls, TRUE, TRUE, 0);
 
     GtkWidget *remove_button = gtk_button_new();
-    GtkWidget *remove_image = gtk_image_new_from_file(RESDIR "remove_12x12.svg");
+    GtkWidget *remove_image = gtk_image_new_from_pixbuf(
+        load_icon("remove_12x12.svg"));
     gtk_button_set_image(GTK_BUTTON(remove_button), remove_image);
     g_signal_connect(remove_button, "clicked", G_CALLBACK(remove_dice), variable_dice);
     gtk_widget_set_can_focus(remove_button, FALSE);
@@ -400,93 +812,68 @@ is_verbose(GtkBuilder *builder) {
     return gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(item));
 }
 
-/** Roll many dices.
- * @param dices List of dices.
- * @param result
- * @param result_string
+/** Form one dice expression of the dice expression, the constant dices,
+ * the modifier and the variable dices, in that order.
+ * @param rp
+ * @param expr Used to store the dice expression, empty if there's no input.
  * @param error
- * @return FALSE if integer overflows, TRUE otherwise.
+ * @return FALSE if the dice expression of the user is invalid, TRUE
+ * otherwise.
  */
 static gboolean
-roll_dices(GList *dices, int_least64_t *result, GString *result_string, GString *error) {
-    enum flow_type overflow;
-    for (GList *it = dices; it != NULL; it = it->next) {
-        dice *d = it->data;
-        if (d->sides == 0 || d->number_rolls == 0)
-            continue;
+form_dice_expression(roll_param *rp, GString *expr, GString *error) {
+    GtkBuilder *builder = rp->builder;
+    g_string_assign(expr, get_dice_expression(builder));
+    /* Validated alone, so that the signs appended to it can't complete an
+     * invalid expression, like "5-".
+     */
+    if (expr->len > 0 && !check_parse_error(de_validate(rp->ctx, expr->str),
+            error))
+        return FALSE;
 
-        int_least64_t sum = 0;
-        gint sign = d->number_rolls < 0 ? -1 : 1;
-        g_string_append_printf(result_string, "%c(", sign < 0 ? '-' : '+');
-        for (gint i = 0; i < ABS(d->number_rolls); i++) {
-            gint32 roll = g_random_int_range(1, d->sides + 1);
-            NF_PLUS(sum, roll, INT_LEAST64, overflow);
-            if (overflow != 0)
-                goto integer_overflow;
-            sum += roll;
-            g_string_append_printf(result_string, "%" G_GINT32_FORMAT, roll);
-            if (i != ABS(d->number_rolls) - 1)
-                g_string_append_c(result_string, '+');
-        }
-        g_string_append_c(result_string, ')');
-        NF_MULTIPLY(sum, sign, INT_LEAST64, overflow);
-        if (overflow != 0)
-            goto integer_overflow;
-        sum *= sign;
-        NF_PLUS(*result, sum, INT_LEAST64, overflow);
-        if (overflow != 0)
-            goto integer_overflow;
-        *result += sum;
-    }
+    GList *const_dices = get_const_dices(builder);
+    append_dices(expr, const_dices);
+    g_list_free_full(const_dices, g_free);
 
-    return TRUE;
+    gint modifier = get_modifier(builder);
+    if (modifier != 0)
+        g_string_append_printf(expr, expr->len > 0 ? "%+d" : "%d", modifier);
 
-    integer_overflow:
-        g_string_append(error, _("integer overflow\n"));
-        return FALSE;
+    GList *var_dices = get_var_dices(builder);
+    append_dices(expr, var_dices);
+    g_list_free_full(var_dices, g_free);
+
+    return TRUE;
 }
 
-/** Add modifier to results.
- * @param modifier
- * @param result
- * @param result_string
- * @param error
- * @return FALSE if integer overflows, TRUE otherwise.
+/** Append dices to a dice expression.
+ * A negative number of rolls is subtracted. Dices with no rolls or sides are
+ * skipped.
+ * @param expr
+ * @param dices List of dices.
  */
-static gboolean
-add_modifier(gint modifier, int_least64_t *result, GString *result_string, GString *error) {
-    if (modifier == 0)
-        return TRUE;
-
-    enum flow_type overflow;
-    NF_PLUS(*result, modifier, INT_LEAST64, overflow);
-    if (overflow != 0) {
-        g_string_append(error, _("integer overflow\n"));
-        return FALSE;
-    }
-
-    *result += modifier;
-    g_string_append_printf(result_string, "%+i", modifier);
+static void
+append_dices(GString *expr, GList *dices) {
+    for (GList *it = dices; it != NULL; it = it->next) {
+        dice *d = it->data;
+        if (d->sides == 0 || d->number_rolls == 0)
+            continue;
 
-    return TRUE;
+        if (d->number_rolls < 0)
+            g_string_append_c(expr, '-');
+        else if (expr->len > 0)
+            g_string_append_c(expr, '+');
+        g_string_append_printf(expr, "%dd%d", ABS(d->number_rolls), d->sides);
+    }
 }
 
-/** Add result of a dice expression to results.
- * @param expr A dice expression. If it's empty string, do nothing.
- * @param result
- * @param result_string
- * @param error
- * @return TRUE if nothing failed or no input, FALSE otherwise.
+/** Describe an error of compiling or evaluating a dice expression.
+ * @param e Zero or enum parse_error.
+ * @param error Used to store the description.
+ * @return TRUE if there's no error, FALSE otherwise.
  */
 static gboolean
-add_dice_expression(const gchar *expr, int_least64_t *result, GString *result_string,
-    GString *error) {
-    if (g_strcmp0(expr, "") == 0)
-        return TRUE;
-
-    int_least64_t res = 0;
-    char *rolled_expr = NULL;
-    enum parse_error e = de_parse(expr, &res, &rolled_expr);
+check_parse_error(enum parse_error e, GString *error) {
     /* Overflow and syntax errors should be caught in the validator function, but
      * because that is called on key-release-event, a roll button press can be
      * registered if pressed very quickly before the roll button is disabled.
@@ -503,54 +890,97 @@ add_dice_expression(const gchar *expr, int_least64_t *result, GString *result_st
         case DE_OVERFLOW:
             g_string_assign(error, _("integer overflow\n"));
             return FALSE;
+        case DE_CANCELLED:
+            g_string_assign(error, _("cancelled\n"));
+            return FALSE;
         default:
-            *result = res;
-            g_string_append(result_string, rolled_expr);
-            free(rolled_expr);
             return TRUE;
     }
 }
 
-/** Validate dice expression.
- * If dice expression is invalid show it to the user and disable roll button.
- * @param entry Dice expression entry.
+/** Compile a dice expression using the context for rolling.
+ * The last compiled expression is kept, so rolling the same text again
+ * doesn't compile it. Called by the worker thread.
+ * @param rp
+ * @param expr A dice expression.
+ * @param compiled Used to store the compiled expression. Owned by rp, don't
+ * free.
+ * @return Zero on success, enum parse_error otherwise.
+ */
+static enum parse_error
+compile_dice_expr(roll_param *rp, const gchar *expr, const de_expr **compiled) {
+    if (rp->compiled == NULL || g_strcmp0(expr, rp->compiled_text) != 0) {
+        de_expr_free(rp->compiled);
+        rp->compiled = NULL;
+        g_free(rp->compiled_text);
+        rp->compiled_text = NULL;
+
+        enum parse_error e = de_compile(rp->roll_ctx, expr, &rp->compiled);
+        if (e != 0)
+            return e;
+        rp->compiled_text = g_strdup(expr);
+    }
+    *compiled = rp->compiled;
+
+    return 0;
+}
+
+/** Validate dice expression when idle.
+ * A burst of key presses is validated only once.
+ * @param entry Dice expression entry. Not used.
  * @param event
- * @param user_data GtkBuilder.
+ * @param user_data roll_param struct.
  * @return TRUE to stop other handlers for the event, FALSE otherwise.
  */
 static gboolean
-validate_dice_expr(GtkWidget *entry, GdkEvent *event, gpointer user_data) {
-    GtkBuilder *builder = user_data;
+schedule_validation(GtkWidget *entry, GdkEvent *event, gpointer user_data) {
+    roll_param *rp = user_data;
+
+    if (rp->validate_source == 0)
+        rp->validate_source = g_idle_add(validate_dice_expr, rp);
+
+    return FALSE;
+}
+
+/** Validate dice expression.
+ * If dice expression is invalid show it to the user and disable roll button.
+ * The expression is only validated, dices aren't rolled and no memory is
+ * allocated.
+ * @param user_data roll_param struct.
+ * @return G_SOURCE_REMOVE.
+ */
+static gboolean
+validate_dice_expr(gpointer user_data) {
+    roll_param *rp = user_data;
+    GtkBuilder *builder = rp->builder;
+    rp->validate_source = 0;
 
     GObject *roll_button = gtk_builder_get_object(builder, "roll_button");
+    GtkWidget *entry = GTK_WIDGET(gtk_builder_get_object(builder, "dice_expression"));
     const gchar *expr = gtk_entry_get_text(GTK_ENTRY(entry));
     if (g_strcmp0(expr, "") == 0) {
         set_ui_based_on_dice_expression_validity(GTK_WIDGET(roll_button), entry, TRUE);
-        return FALSE;
+        return G_SOURCE_REMOVE;
     }
 
-    int_least64_t result = 0;
-    char *rolled_expr = NULL;
-    enum parse_error e = de_parse(expr, &result, &rolled_expr);
+    enum parse_error e = de_validate(rp->ctx, expr);
     switch (e) {
-        /* Don't catch DE_OVERFLOW here because same expression can sometimes
-         * result to overflow and others not.
+        /* DE_OVERFLOW means that the expression overflows whatever is
+         * rolled, expressions which only may overflow are valid.
          */
         /* Fallthrough! */
         case DE_INVALID_CHARACTER: case DE_SYNTAX_ERROR: case DE_NROLLS:
-        case DE_IGNORE: case DE_DICE: case DE_ROLLS_TOO_LARGE:
+        case DE_IGNORE: case DE_DICE: case DE_ROLLS_TOO_LARGE: case DE_OVERFLOW:
             set_ui_based_on_dice_expression_validity(GTK_WIDGET(roll_button), entry, FALSE);
             break;
-        /* TODO Maybe just free rolled_expr, but then what? */
         case DE_MEMORY:
             g_printerr("Out of memory\n");
             abort();
         default:
             set_ui_based_on_dice_expression_validity(GTK_WIDGET(roll_button), entry, TRUE);
     }
-    free(rolled_expr);
 
-    return FALSE;
+    return G_SOURCE_REMOVE;
 }
 
 /** Change widgets to reflect validity of dice expression.
@@ -576,16 +1006,18 @@ set_ui_based_on_dice_expression_validity(GtkWidget *roll_button,
 /** Reset.
  * Set every spinbutton's and modifier's value to zero, set dice expression to
  * empty string and clear its completed dice expressions, remove results
- * from textview and enable roll button.
+ * from history and enable roll button.
  * @param button
- * @param user_data GtkBuilder.
+ * @param user_data roll_param struct.
  */
 static void
 reset(GtkWidget *button, gpointer user_data) {
-    GtkBuilder *builder = user_data;
+    roll_param *rp = user_data;
+    GtkBuilder *builder = rp->builder;
 
     GObject *expr = gtk_builder_get_object(builder, "dice_expression");
     gtk_entry_set_text(GTK_ENTRY(expr), "");
+    completion_store_clear(rp->completions);
     GtkEntryCompletion *completion = gtk_entry_get_completion(GTK_ENTRY(expr));
     GtkTreeModel *model = gtk_entry_completion_get_model(completion);
     gtk_list_store_clear(GTK_LIST_STORE(model));
@@ -596,9 +1028,7 @@ reset(GtkWidget *button, gpointer user_data) {
     GObject *modifier = gtk_builder_get_object(builder, "modifier");
     gtk_spin_button_set_value(GTK_SPIN_BUTTON(modifier), 0.0);
 
-    GObject *textview = gtk_builder_get_object(builder, "textview");
-    GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(textview));
-    gtk_text_buffer_set_text(buffer, "", -1);
+    history_clear(rp->history);
 
     GObject *box = gtk_builder_get_object(builder, "const_dices");
     GList *const_spin_buttons = gtk_container_get_children(GTK_CONTAINER(box));
@@ -641,6 +1071,16 @@ sounds_enabled(GtkBuilder *builder) {
     return gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(item));
 }
 
+/** Set up sound when it's turned on.
+ * @param item Sound check menu item.
+ * @param user_data sound object.
+ */
+static void
+sound_toggled(GtkCheckMenuItem *item, gpointer user_data) {
+    if (gtk_check_menu_item_get_active(item))
+        sound_prepare(user_data);
+}
+
 /** Set size of the main window as small as possible to show all widgets.
  * @param container Not used.
  * @param widget Not used.
@@ -657,15 +1097,55 @@ minimize_window(GtkContainer *container, GtkWidget *widget, gpointer user_data)
  */
 static void
 set_window_icon(GtkWindow *window) {
-    GError *error = NULL;
-    GdkPixbuf *icon_buf = gdk_pixbuf_new_from_file(RESDIR "gdice.svg", &error);
-    if (icon_buf) {
+    GdkPixbuf *icon_buf = load_icon("gdice.svg");
+    if (icon_buf)
         gtk_window_set_icon(window, icon_buf);
-        g_object_unref(icon_buf);
-    }
-    else {
+}
+
+/** Decode an icon of the resources on first use.
+ * @param name Name of the icon resource.
+ * @return The icon, owned by the cache, or NULL if it can't be decoded.
+ */
+static GdkPixbuf*
+load_icon(const gchar *name) {
+    if (icons == NULL)
+        icons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            g_object_unref);
+
+    GdkPixbuf *icon = g_hash_table_lookup(icons, name);
+    if (icon != NULL)
+        return icon;
+
+    GError *error = NULL;
+    gchar *path = g_strconcat(RESOURCE_PATH, name, NULL);
+    icon = gdk_pixbuf_new_from_resource(path, &error);
+    g_free(path);
+    if (icon == NULL) {
         g_printerr("Can't load icon: %s\n", error->message);
         g_error_free(error);
+        return NULL;
+    }
+    g_hash_table_insert(icons, g_strdup(name), icon);
+
+    return icon;
+}
+
+/** Finish starting up after the main window is painted the first time.
+ * The window icon isn't needed for the first frame, so decoding it is left
+ * until here. With --startup-time, print the time since main() started and
+ * quit.
+ * @param clock Frame clock of the main window.
+ * @param user_data The main window.
+ */
+static void
+first_frame_painted(GdkFrameClock *clock, gpointer user_data) {
+    g_signal_handlers_disconnect_by_func(clock, first_frame_painted, user_data);
+    set_window_icon(GTK_WINDOW(user_data));
+
+    if (measure_startup) {
+        g_print("%.1f ms to the first frame\n",
+            (g_get_monotonic_time() - start_time) / 1000.0);
+        gtk_main_quit();
     }
 }
 
@@ -673,19 +1153,13 @@ set_window_icon(GtkWindow *window) {
  */
 static void
 load_css() {
+    // Errors of the compiled in css are reported by the parsing-error signal.
     GtkCssProvider *provider = gtk_css_provider_new();
-    GError *error = NULL;
-    gtk_css_provider_load_from_path(provider, RESDIR "gdice.css", &error);
-    if (!error) {
-        GdkScreen *screen = gdk_screen_get_default();
-        gtk_style_context_add_provider_for_screen(screen, GTK_STYLE_PROVIDER(provider),
-            GTK_STYLE_PROVIDER_PRIORITY_USER);
-        g_object_unref(provider);
-    }
-    else {
-        g_printerr("%s\n", error->message);
-        g_error_free(error);
-    }
+    gtk_css_provider_load_from_resource(provider, RESOURCE_PATH "gdice.css");
+    GdkScreen *screen = gdk_screen_get_default();
+    gtk_style_context_add_provider_for_screen(screen, GTK_STYLE_PROVIDER(provider),
+        GTK_STYLE_PROVIDER_PRIORITY_USER);
+    g_object_unref(provider);
 }
 
 /** Resize dst widget as same size as src. This function needs to be called
@@ -708,13 +1182,22 @@ set_widgets_same_size(GtkBuilder *builder, const gchar *src, const gchar *dst) {
 }
 
 /** Add completion for dice expression entry.
+ * The model of the completion holds only the expressions matching the text
+ * of the entry, so the completion doesn't filter every expression of the
+ * store on every key press.
  * @param entry
+ * @param store Expressions to complete.
  */
 static void
-add_dice_expr_completion(GtkEntry *entry) {
+add_dice_expr_completion(GtkEntry *entry, completion_store *store) {
+    // Connected first, so the model is updated before the completion filters it.
+    g_signal_connect(entry, "changed", G_CALLBACK(update_dice_expr_completion),
+        store);
+
     GtkEntryCompletion *completion = gtk_entry_completion_new();
-    gtk_entry_completion_set_model(completion,
-        GTK_TREE_MODEL(gtk_list_store_new(1, G_TYPE_STRING)));
+    GtkListStore *model = gtk_list_store_new(1, G_TYPE_STRING);
+    gtk_entry_completion_set_model(completion, GTK_TREE_MODEL(model));
+    g_object_unref(model);
     gtk_entry_completion_set_popup_completion(completion, TRUE);
     gtk_entry_completion_set_popup_single_match(completion, FALSE);
     gtk_entry_completion_set_inline_completion(completion, TRUE);
@@ -724,45 +1207,96 @@ add_dice_expr_completion(GtkEntry *entry) {
     g_object_unref(completion);
 }
 
-/** Append the dice expression string to the completion list, if it's not
- * in it already.
- * @param entry
+/** Fill the completion model with the most recently used expressions
+ * starting with the text of the entry.
+ * An inline completion is selected at the end of the text and isn't part of
+ * the prefix, so inserting it doesn't change the matches.
+ * @param editable Dice expression entry.
+ * @param user_data completion_store object.
  */
 static void
-append_dice_expr_completion(GtkEntry *entry) {
-    GtkEntryCompletion *completion = gtk_entry_get_completion(entry);
-    GtkTreeModel *model = gtk_entry_completion_get_model(completion);
-    const gchar *dice_expr = gtk_entry_get_text(entry);
-
-    gboolean dice_expr_in_list = FALSE;
-    GtkTreeIter iter;
-    for (gboolean has_next = gtk_tree_model_get_iter_first(model, &iter);
-            has_next;
-            has_next = gtk_tree_model_iter_next(model, &iter)) {
-        GValue value = G_VALUE_INIT;
-        gtk_tree_model_get_value(model, &iter, 0, &value);
-        const gchar *list_text = g_value_get_string(&value);
-        dice_expr_in_list = g_str_equal(dice_expr, list_text);
-        g_value_unset(&value);
-        if (dice_expr_in_list)
-            break;
+update_dice_expr_completion(GtkEditable *editable, gpointer user_data) {
+    completion_store *store = user_data;
+    GtkEntryCompletion *completion = gtk_entry_get_completion(GTK_ENTRY(editable));
+    if (completion == NULL)
+        return;
+
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(editable));
+    gint start, end;
+    gchar *prefix = gtk_editable_get_selection_bounds(editable, &start, &end) &&
+        end == gtk_entry_get_text_length(GTK_ENTRY(editable)) ?
+        g_strndup(text, g_utf8_offset_to_pointer(text, start) - text) :
+        g_strdup(text);
+    const gchar *old_prefix = g_object_get_data(G_OBJECT(completion), "prefix");
+    if (g_strcmp0(prefix, old_prefix) == 0) {
+        g_free(prefix);
+        return;
     }
-    if (!dice_expr_in_list) {
-        GtkTreeIter i;
-        gtk_list_store_append(GTK_LIST_STORE(model), &i);
-        gtk_list_store_set(GTK_LIST_STORE(model), &i, 0, dice_expr, -1);
+
+    GtkListStore *model =
+        GTK_LIST_STORE(gtk_entry_completion_get_model(completion));
+    gtk_list_store_clear(model);
+    if (*prefix != '\0') {
+        GPtrArray *matches = completion_store_match(store, prefix,
+            COMPLETION_MATCHES);
+        for (guint i = 0; i < matches->len; i++)
+            gtk_list_store_insert_with_values(model, NULL, -1,
+                0, g_ptr_array_index(matches, i), -1);
+        g_ptr_array_free(matches, TRUE);
     }
+    g_object_set_data_full(G_OBJECT(completion), "prefix", prefix, g_free);
 }
 
 /** Load preferences and bind them to the GUI.
  */
 static void
-load_preferences(GtkBuilder *builder) {
+load_preferences(roll_param *rp) {
+    GtkBuilder *builder = rp->builder;
     GSettings *settings = g_settings_new("com.github.fluks.GDice");
     GObject *object = gtk_builder_get_object(builder, "sound_checkbox");
     g_settings_bind(settings, "sound", object, "active", G_SETTINGS_BIND_DEFAULT);
+    // Sound is set up only when it's turned on.
+    if (sounds_enabled(builder))
+        sound_prepare(rp->s);
+    g_signal_connect(object, "toggled", G_CALLBACK(sound_toggled), rp->s);
     object = gtk_builder_get_object(builder, "verbose");
     g_settings_bind(settings, "verbose", object, "active", G_SETTINGS_BIND_DEFAULT);
+    history_set_capacity(rp->history, g_settings_get_uint(settings, "history-size"));
+    g_signal_connect(settings, "changed::history-size",
+        G_CALLBACK(history_size_changed), rp->history);
+    completion_store_set_capacity(rp->completions,
+        g_settings_get_uint(settings, "completion-size"));
+    g_signal_connect(settings, "changed::completion-size",
+        G_CALLBACK(completion_size_changed), rp->completions);
+    // Opened before the first roll, only the worker thread uses it after.
+    gchar *roll_log = g_settings_get_string(settings, "roll-log");
+    if (*roll_log != '\0') {
+        int e = de_log_open(roll_log, &rp->log);
+        if (e != 0)
+            g_printerr("Can't open the roll log %s: %s\n", roll_log,
+                g_strerror(e));
+    }
+    g_free(roll_log);
+}
+
+/** Apply a changed history size.
+ * @param settings
+ * @param key
+ * @param user_data history object.
+ */
+static void
+history_size_changed(GSettings *settings, gchar *key, gpointer user_data) {
+    history_set_capacity(user_data, g_settings_get_uint(settings, key));
+}
+
+/** Apply a changed number of saved dice expressions.
+ * @param settings
+ * @param key
+ * @param user_data completion_store object.
+ */
+static void
+completion_size_changed(GSettings *settings, gchar *key, gpointer user_data) {
+    completion_store_set_capacity(user_data, g_settings_get_uint(settings, key));
 }
 
 /** Show the about window.
@@ -773,6 +1307,9 @@ static void
 show_about_window(GtkMenuItem *menuitem, gpointer user_data) {
     GtkBuilder *builder = user_data;
     GObject *about_window = gtk_builder_get_object(builder, "about_window");
+    if (about_window == NULL &&
+            (about_window = build_window(builder, "about.glade", "about_window")) == NULL)
+        return;
     gint response_id = gtk_dialog_run(GTK_DIALOG(about_window));
 
     if (response_id == GTK_RESPONSE_DELETE_EVENT)
@@ -789,11 +1326,38 @@ show_help_window(GtkMenuItem *menuitem, gpointer user_data) {
     GtkBuilder *builder = user_data;
 
     GObject *help_window = gtk_builder_get_object(builder, "help_window");
-    GtkButton *close_button = GTK_BUTTON(gtk_builder_get_object(builder, "help_window_close_button"));
-    g_signal_connect_swapped(close_button, "clicked", G_CALLBACK(gtk_widget_hide), GTK_WIDGET(help_window));
+    if (help_window == NULL) {
+        if ((help_window = build_window(builder, "help.glade", "help_window")) == NULL)
+            return;
+        GtkButton *close_button = GTK_BUTTON(gtk_builder_get_object(builder, "help_window_close_button"));
+        g_signal_connect_swapped(close_button, "clicked", G_CALLBACK(gtk_widget_hide), GTK_WIDGET(help_window));
+    }
     gtk_window_present(GTK_WINDOW(help_window));
 }
 
+/** Add the objects of a UI resource to the builder and connect their
+ * signals.
+ * @param builder
+ * @param resource Name of the UI resource.
+ * @param name Name of the window of the UI.
+ * @return The window or NULL on error.
+ */
+static GObject*
+build_window(GtkBuilder *builder, const gchar *resource, const gchar *name) {
+    GError *error = NULL;
+    gchar *path = g_strconcat(RESOURCE_PATH, resource, NULL);
+    guint added = gtk_builder_add_from_resource(builder, path, &error);
+    g_free(path);
+    if (added == 0) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    gtk_builder_connect_signals(builder, NULL);
+
+    return gtk_builder_get_object(builder, name);
+}
+
 /**
  * Connect signals related to the help window.
  * @param builder GtkBuilder.
@@ -0,0 +1,188 @@
+#include <stddef.h>
+#include <assert.h>
+#include <math.h>
+#include "rng.h"
+
+// Use inversion for binomial distribution if the mean is less than this.
+#define BINOMIAL_INVERSION_MEAN 10.0
+
+/* Return next value of splitmix64.
+ * Used to expand a 64 bit seed to the state of xoshiro256**.
+ * @param x State of splitmix64.
+ * @return
+ */
+static uint64_t
+splitmix64(uint64_t *x);
+
+static uint64_t
+binomial_inversion(de_rng *rng, uint64_t n, double p);
+
+static uint64_t
+binomial_btrs(de_rng *rng, uint64_t n, double p);
+
+static double
+log_factorial(double k);
+
+void
+de_rng_seed(de_rng *rng, uint64_t seed) {
+    assert(rng != NULL);
+
+    rng->next = NULL;
+    rng->user_data = NULL;
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = splitmix64(&seed);
+}
+
+void
+de_rng_seed_stream(de_rng *rng, uint64_t seed, uint64_t stream) {
+    assert(rng != NULL);
+
+    // Hash the stream, so that nearby seeds and streams don't overlap.
+    de_rng_seed(rng, seed ^ splitmix64(&stream));
+}
+
+void
+de_rng_jump(de_rng *rng) {
+    assert(rng != NULL);
+
+    static const uint64_t jump[] = {
+        0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+        0xa9582618e03fc9aa, 0x39abdc4529b1661c
+    };
+    uint64_t s[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & UINT64_C(1) << b) {
+                for (int j = 0; j < 4; j++)
+                    s[j] ^= rng->s[j];
+            }
+            de_rng_xoshiro(rng);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        rng->s[i] = s[i];
+}
+
+uint64_t
+de_rng_binomial(de_rng *rng, uint64_t n, double p) {
+    assert(rng != NULL);
+    assert(p >= 0 && p <= 1);
+
+    if (n == 0 || p == 0)
+        return 0;
+    if (p == 1)
+        return n;
+    // Both algorithms need p <= 0.5.
+    if (p > 0.5)
+        return n - de_rng_binomial(rng, n, 1 - p);
+
+    if (n * p < BINOMIAL_INVERSION_MEAN)
+        return binomial_inversion(rng, n, p);
+    return binomial_btrs(rng, n, p);
+}
+
+/* Binomial distribution by inversion.
+ * Walk the probabilities from zero until the uniform variate is used up.
+ * Expected running time is proportional to n * p.
+ */
+static uint64_t
+binomial_inversion(de_rng *rng, uint64_t n, double p) {
+    double q = 1 - p;
+    double s = p / q;
+    double a = (n + 1) * s;
+
+    for (;;) {
+        double r = pow(q, (double) n);
+        double u = de_rng_double(rng);
+        uint64_t x = 0;
+        while (u > r) {
+            u -= r;
+            x++;
+            if (x > n)
+                break;
+            r *= a / x - s;
+        }
+        // Rounding errors can leave u unused, try again.
+        if (x <= n)
+            return x;
+    }
+}
+
+/* Binomial distribution by BTRS, transformed rejection with squeeze.
+ * W. Hörmann, The generation of binomial random variates, Journal of
+ * Statistical Computation and Simulation 46, 1993. Far from the mode the
+ * acceptance test is squeezed with the normal approximation of BTPE,
+ * V. Kachitvichyanukul and B. W. Schmeiser, Binomial random variate
+ * generation, Communications of the ACM 31, 1988.
+ * Requires n * p >= 10 and p <= 0.5.
+ */
+static uint64_t
+binomial_btrs(de_rng *rng, uint64_t n, double p) {
+    double q = 1 - p;
+    double spq = sqrt(n * p * q);
+    double b = 1.15 + 2.53 * spq;
+    double a = -0.0873 + 0.0248 * b + 0.01 * p;
+    double c = n * p + 0.5;
+    double npq = n * p * q;
+    double vr = 0.92 - 4.2 / b;
+    double alpha = (2.83 + 5.1 / b) * spq;
+    double lpq = log(p / q);
+    double m = floor((n + 1) * p);
+    double h = log_factorial(m) + log_factorial(n - m);
+
+    for (;;) {
+        double u = de_rng_double(rng) - 0.5;
+        double v = de_rng_double(rng);
+        double us = 0.5 - fabs(u);
+        double k = floor((2 * a / us + b) * u + c);
+        if (k < 0 || k > n)
+            continue;
+        // Immediate acceptance from the center of the distribution.
+        if (us >= 0.07 && v <= vr)
+            return (uint64_t) k;
+
+        v = log(v * alpha / (a / (us * us) + b));
+        double km = fabs(k - m);
+        // Squeeze with the normal approximation when far from the mode.
+        if (km > 15) {
+            double rho = (km / npq) *
+                (((km / 3 + 0.625) * km + 1.0 / 6) / npq + 0.5);
+            double t = -km * km / (2 * npq);
+            if (v < t - rho)
+                return (uint64_t) k;
+            if (v > t + rho)
+                continue;
+        }
+        // Compare to the logarithm of f(k) / f(m).
+        if (v <= h - log_factorial(k) - log_factorial(n - k) + (k - m) * lpq)
+            return (uint64_t) k;
+    }
+}
+
+/* Logarithm of k!.
+ * Exact for small k, Stirling series otherwise. Unlike lgamma() doesn't write
+ * to a global variable, so it can be used from many threads.
+ */
+static double
+log_factorial(double k) {
+    static const double table[] = {
+        0.0, 0.0, 0.69314718055994531, 1.7917594692280550,
+        3.1780538303479458, 4.7874917427820460, 6.5792512120101010,
+        8.5251613610654143, 10.604602902745251, 12.801827480081469
+    };
+    if (k < 10)
+        return table[(int) k];
+
+    double x = k + 1;
+    double x2 = x * x;
+    return (x - 0.5) * log(x) - x + 0.91893853320467274
+        + (1.0 / 12 - (1.0 / 360 - 1.0 / (1260 * x2)) / x2) / x;
+}
+
+static uint64_t
+splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
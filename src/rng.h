@@ -0,0 +1,156 @@
+#ifndef RNG_H
+    #define RNG_H
+
+/** @file
+ *
+ * @description Random number generators for rolling dices.
+ *
+ * The default generator is xoshiro256** seeded with splitmix64. A custom
+ * generator can be plugged in by setting de_rng::next. Every generator has
+ * its own state, so generators can be used from different threads without
+ * locking as long as a generator isn't shared.
+ *
+ * Bounded integers are generated with Lemire's multiply-shift method, which
+ * is unbiased for every range and needs a division only rarely.
+ */
+
+#include <stdint.h>
+
+typedef struct de_rng de_rng;
+
+/** Random number generator.
+ */
+struct de_rng {
+    /* Return next 64 random bits. If NULL, xoshiro256** with state s is
+     * used.
+     */
+    uint64_t (*next)(de_rng *rng);
+    // Data for a custom generator.
+    void *user_data;
+    // State of xoshiro256**.
+    uint64_t s[4];
+};
+
+/** Seed the default generator.
+ * Sets next to NULL.
+ * @param rng Can't be NULL.
+ * @param seed Any value, also zero.
+ */
+void
+de_rng_seed(de_rng *rng, uint64_t seed);
+
+/** Seed the default generator for one of many streams.
+ * Every (seed, stream) pair gives an unrelated state, so a sequence of
+ * values, e.g. lines of input, can be rolled in any order or in parallel and
+ * still give the same results as long as every value uses its own stream.
+ * Sets next to NULL.
+ * @param rng Can't be NULL.
+ * @param seed Any value, also zero.
+ * @param stream Any value, also zero.
+ */
+void
+de_rng_seed_stream(de_rng *rng, uint64_t seed, uint64_t stream);
+
+/** Advance the default generator by 2^128 steps.
+ * Used to split one seed to non-overlapping streams for different threads:
+ * copy the generator and jump the original once for every stream.
+ * @param rng Can't be NULL.
+ */
+void
+de_rng_jump(de_rng *rng);
+
+/** Return next 64 random bits from xoshiro256**.
+ * @param rng Can't be NULL.
+ * @return
+ */
+static inline uint64_t
+de_rng_xoshiro(de_rng *rng) {
+    uint64_t *s = rng->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+
+    return result;
+}
+
+/** Return next 64 random bits.
+ * @param rng Can't be NULL.
+ * @return
+ */
+static inline uint64_t
+de_rng_next(de_rng *rng) {
+    return rng->next == NULL ? de_rng_xoshiro(rng) : rng->next(rng);
+}
+
+/** Multiply two 64 bit integers to a 128 bit result.
+ * @param a
+ * @param b
+ * @param lo Used to store low 64 bits.
+ * @return High 64 bits.
+ */
+static inline uint64_t
+de_rng_mul128(uint64_t a, uint64_t b, uint64_t *lo) {
+#ifdef __SIZEOF_INT128__
+    __extension__ typedef unsigned __int128 u128;
+    u128 p = (u128) a * b;
+    *lo = (uint64_t) p;
+    return (uint64_t) (p >> 64);
+#else
+    uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+    uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+    uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi;
+    uint64_t hl = a_hi * b_lo, hh = a_hi * b_hi;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+    *lo = (mid << 32) | (ll & 0xffffffff);
+    return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/** Return a uniformly distributed integer in [0, range).
+ * @param rng Can't be NULL.
+ * @param range Must be > 0.
+ * @return
+ */
+static inline uint64_t
+de_rng_bounded(de_rng *rng, uint64_t range) {
+    uint64_t lo;
+    uint64_t hi = de_rng_mul128(de_rng_next(rng), range, &lo);
+    if (lo < range) {
+        // Reject the values that would make some results more likely.
+        uint64_t threshold = -range % range;
+        while (lo < threshold)
+            hi = de_rng_mul128(de_rng_next(rng), range, &lo);
+    }
+
+    return hi;
+}
+
+/** Return a uniformly distributed double in [0, 1).
+ * @param rng Can't be NULL.
+ * @return
+ */
+static inline double
+de_rng_double(de_rng *rng) {
+    return (de_rng_next(rng) >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+/** Return a binomially distributed integer.
+ * The number of successes in n trials with success probability p. Uses
+ * inversion when the mean is small and Hörmann's BTRS otherwise, so the
+ * running time doesn't grow with n.
+ * @param rng Can't be NULL.
+ * @param n Number of trials, at most 2^53.
+ * @param p Probability of success, in [0, 1].
+ * @return
+ */
+uint64_t
+de_rng_binomial(de_rng *rng, uint64_t n, double p);
+
+#endif // RNG_H
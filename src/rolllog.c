@@ -0,0 +1,436 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rolllog.h"
+
+#define MAGIC "GDICELOG"
+#define BYTE_ORDER_MARK 0x01020304
+#define VERSION 2
+// Time the writer waits for more records after it's woken up, so that a
+// burst of records is written at once and appending doesn't wake it up for
+// every record, in nanoseconds.
+#define BATCH_DELAY 1000000
+
+/* Header of a log file.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t byte_order, version;
+} header;
+
+/* Header of a record, followed by the expression and the rolled expression
+ * and padding to a multiple of eight bytes.
+ */
+typedef struct {
+    // Size of the record including the expressions and the padding.
+    uint32_t size;
+    uint32_t error;
+    int64_t time;
+    uint64_t rng[4];
+    uint64_t seed, roll;
+    int64_t value;
+    uint32_t expr_len, rolled_len;
+} record;
+
+struct de_log {
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    // Signaled when a record is appended or the log is closed.
+    pthread_cond_t appended;
+    // Signaled when the writer takes the pending records.
+    pthread_cond_t taken;
+    // Records waiting for the writer.
+    char *pending;
+    size_t pending_len, pending_size;
+    int closing;
+    // Whether the writer waits for records, otherwise it isn't woken up.
+    int writer_waiting;
+    // The first error, appending fails after it.
+    int error;
+};
+
+static void*
+write_log(void *arg);
+
+static int
+truncate_partial_record(int fd);
+
+static int
+write_all(int fd, const char *buf, size_t len);
+
+static int
+check_header(const char *data, size_t len);
+
+static size_t
+record_at(const char *data, size_t len, size_t pos);
+
+static void
+deadline_after(struct timespec *ts, long ms);
+
+static int
+passed(const struct timespec *deadline);
+
+int
+de_log_open(const char *path, de_log **log) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return errno;
+
+    int e;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        e = errno;
+        goto error;
+    }
+    header h;
+    if (st.st_size == 0) {
+        memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.byte_order = BYTE_ORDER_MARK;
+        h.version = VERSION;
+        if ((e = write_all(fd, (const char*) &h, sizeof(h))) != 0)
+            goto error;
+    }
+    else if (pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+             check_header((const char*) &h, sizeof(h)) != 0) {
+        e = EINVAL;
+        goto error;
+    }
+
+    de_log *l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        e = ENOMEM;
+        goto error;
+    }
+    l->fd = fd;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->appended, &attr);
+    pthread_cond_init(&l->taken, NULL);
+    pthread_condattr_destroy(&attr);
+    if ((e = pthread_create(&l->writer, NULL, write_log, l)) != 0) {
+        pthread_cond_destroy(&l->taken);
+        pthread_cond_destroy(&l->appended);
+        pthread_mutex_destroy(&l->lock);
+        free(l);
+        goto error;
+    }
+    *log = l;
+
+    return 0;
+
+    error:
+        close(fd);
+        return e;
+}
+
+int
+de_log_append(de_log *log, const de_log_entry *entry) {
+    size_t size = (sizeof(record) + entry->expr_len + entry->rolled_len + 7) &
+        ~(size_t) 7;
+    if (size > UINT32_MAX)
+        return EINVAL;
+
+    pthread_mutex_lock(&log->lock);
+    while (log->error == 0 && log->pending_len >= DE_LOG_MAX_PENDING)
+        pthread_cond_wait(&log->taken, &log->lock);
+    int e = log->error;
+    if (e != 0)
+        goto out;
+
+    if (log->pending_size - log->pending_len < size) {
+        size_t new_size = log->pending_size > 0 ? log->pending_size : 4096;
+        while (new_size - log->pending_len < size)
+            new_size *= 2;
+        char *pending = realloc(log->pending, new_size);
+        if (pending == NULL) {
+            e = ENOMEM;
+            goto out;
+        }
+        log->pending = pending;
+        log->pending_size = new_size;
+    }
+
+    char *p = log->pending + log->pending_len;
+    record r = { size, entry->error, entry->time,
+        { entry->rng[0], entry->rng[1], entry->rng[2], entry->rng[3] },
+        entry->seed, entry->roll, entry->value, entry->expr_len,
+        entry->rolled_len };
+    memcpy(p, &r, sizeof(r));
+    p += sizeof(r);
+    // The expressions can be NULL if they're empty.
+    if (entry->expr_len > 0)
+        memcpy(p, entry->expr, entry->expr_len);
+    p += entry->expr_len;
+    if (entry->rolled_len > 0)
+        memcpy(p, entry->rolled, entry->rolled_len);
+    p += entry->rolled_len;
+    memset(p, 0, log->pending + log->pending_len + size - p);
+    log->pending_len += size;
+    if (log->writer_waiting)
+        pthread_cond_signal(&log->appended);
+
+    out:
+        pthread_mutex_unlock(&log->lock);
+        return e;
+}
+
+int
+de_log_close(de_log *log) {
+    if (log == NULL)
+        return 0;
+
+    pthread_mutex_lock(&log->lock);
+    log->closing = 1;
+    pthread_cond_signal(&log->appended);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->writer, NULL);
+
+    int e = log->error;
+    if (close(log->fd) == -1 && e == 0)
+        e = errno;
+    pthread_cond_destroy(&log->taken);
+    pthread_cond_destroy(&log->appended);
+    pthread_mutex_destroy(&log->lock);
+    free(log->pending);
+    free(log);
+
+    return e;
+}
+
+int
+de_log_map(const char *path, de_log_reader *reader) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno;
+
+    int e = 0;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        e = errno;
+    else if ((size_t) st.st_size < sizeof(header))
+        e = EINVAL;
+    else {
+        reader->len = st.st_size;
+        reader->map = mmap(NULL, reader->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (reader->map == MAP_FAILED)
+            e = errno;
+        else if (check_header(reader->map, reader->len) != 0) {
+            munmap((void*) reader->map, reader->len);
+            e = EINVAL;
+        }
+        else
+            posix_madvise((void*) reader->map, reader->len,
+                POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+    reader->pos = sizeof(header);
+
+    return e;
+}
+
+int
+de_log_next(de_log_reader *reader, de_log_entry *entry) {
+    size_t size = record_at(reader->map, reader->len, reader->pos);
+    if (size == 0)
+        return 0;
+
+    const record *r = (const record*) (reader->map + reader->pos);
+    entry->time = r->time;
+    memcpy(entry->rng, r->rng, sizeof(entry->rng));
+    entry->seed = r->seed;
+    entry->roll = r->roll;
+    entry->error = r->error;
+    entry->value = r->value;
+    entry->expr = (const char*) (r + 1);
+    entry->expr_len = r->expr_len;
+    entry->rolled = entry->expr + r->expr_len;
+    entry->rolled_len = r->rolled_len;
+    reader->pos += size;
+
+    return 1;
+}
+
+void
+de_log_unmap(de_log_reader *reader) {
+    munmap((void*) reader->map, reader->len);
+}
+
+/* Writer thread. Takes all the pending records at once, so the records
+ * appended while a batch is written are written with the next write.
+ */
+static void*
+write_log(void *arg) {
+    de_log *log = arg;
+    char *batch = NULL;
+    size_t batch_len = 0, batch_size = 0;
+    // Whether records were written after the last sync, and when to sync.
+    int unsynced = 0;
+    struct timespec sync_deadline;
+
+    int e = truncate_partial_record(log->fd);
+    pthread_mutex_lock(&log->lock);
+    if (e != 0)
+        log->error = e;
+    for (;;) {
+        log->writer_waiting = 1;
+        while (log->pending_len == 0 && !log->closing) {
+            if (!unsynced)
+                pthread_cond_wait(&log->appended, &log->lock);
+            else if (pthread_cond_timedwait(&log->appended, &log->lock,
+                    &sync_deadline) == ETIMEDOUT)
+                break;
+        }
+        log->writer_waiting = 0;
+        if (log->pending_len > 0 && !log->closing) {
+            pthread_mutex_unlock(&log->lock);
+            struct timespec delay = { 0, BATCH_DELAY };
+            nanosleep(&delay, NULL);
+            pthread_mutex_lock(&log->lock);
+        }
+
+        // Swap the buffers, the records are copied only once.
+        char *tmp = batch;
+        size_t tmp_size = batch_size;
+        batch = log->pending;
+        batch_len = log->pending_len;
+        batch_size = log->pending_size;
+        log->pending = tmp;
+        log->pending_len = 0;
+        log->pending_size = tmp_size;
+        int closing = log->closing;
+        e = log->error;
+        pthread_cond_broadcast(&log->taken);
+        pthread_mutex_unlock(&log->lock);
+
+        // Records are dropped after an error.
+        if (e == 0 && batch_len > 0) {
+            e = write_all(log->fd, batch, batch_len);
+            if (!unsynced)
+                deadline_after(&sync_deadline, DE_LOG_SYNC_INTERVAL);
+            unsynced = 1;
+        }
+        if (e == 0 && unsynced && (closing || passed(&sync_deadline))) {
+            if (fdatasync(log->fd) == -1)
+                e = errno;
+            unsynced = 0;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        if (e != 0 && log->error == 0) {
+            log->error = e;
+            pthread_cond_broadcast(&log->taken);
+        }
+        if (closing && log->pending_len == 0)
+            break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(batch);
+
+    return NULL;
+}
+
+/* Remove a partially written record at the end of a log, e.g. after a
+ * crash, so that the records appended after it can be read.
+ * @return Zero on success, errno otherwise.
+ */
+static int
+truncate_partial_record(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return errno;
+    size_t len = st.st_size;
+    const char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return errno;
+    posix_madvise((void*) map, len, POSIX_MADV_SEQUENTIAL);
+
+    size_t pos = sizeof(header), size;
+    while ((size = record_at(map, len, pos)) != 0)
+        pos += size;
+    munmap((void*) map, len);
+
+    return pos < len && ftruncate(fd, pos) == -1 ? errno : 0;
+}
+
+/* Write a buffer, retrying short writes.
+ * @return Zero on success, errno otherwise.
+ */
+static int
+write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Check the header of a log.
+ * @return Zero if the log was written on a machine with the same byte order,
+ * non-zero otherwise.
+ */
+static int
+check_header(const char *data, size_t len) {
+    header h;
+    if (len < sizeof(h))
+        return 1;
+    memcpy(&h, data, sizeof(h));
+
+    return memcmp(h.magic, MAGIC, sizeof(h.magic)) != 0 ||
+        h.byte_order != BYTE_ORDER_MARK || h.version != VERSION;
+}
+
+/* Size of a complete record.
+ * @return Size of the record at pos, zero if there's no complete record.
+ */
+static size_t
+record_at(const char *data, size_t len, size_t pos) {
+    if (len - pos < sizeof(record))
+        return 0;
+
+    const record *r = (const record*) (data + pos);
+    if (r->size < sizeof(record) || r->size % 8 != 0 || r->size > len - pos ||
+            (uint64_t) r->expr_len + r->rolled_len > r->size - sizeof(record))
+        return 0;
+
+    return r->size;
+}
+
+/* Set a monotonic deadline ms milliseconds from now.
+ */
+static void
+deadline_after(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += ms % 1000 * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Whether a monotonic deadline has passed.
+ */
+static int
+passed(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec &&
+        now.tv_nsec >= deadline->tv_nsec);
+}
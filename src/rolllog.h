@@ -0,0 +1,122 @@
+#ifndef ROLLLOG_H
+    #define ROLLLOG_H
+
+/** @file
+ *
+ * @description Append-only log of rolls.
+ *
+ * A log file starts with a header and is followed by records, one per roll.
+ * Records are written in the byte order of the machine, which is recorded in
+ * the header, and padded to a multiple of eight bytes, so a memory mapped
+ * log can be read in place.
+ *
+ * Appending copies the record to a buffer and wakes a writer thread, so it
+ * doesn't wait for the disk. The writer writes everything appended while it
+ * was writing the previous batch with one write and syncs the file to the
+ * disk at most once every DE_LOG_SYNC_INTERVAL milliseconds. Records
+ * appended after the last sync can be lost if the machine crashes, a
+ * partially written last record is ignored when reading.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "diceexpr.h"
+
+/** The maximum time between writing a record and syncing it to the disk.
+ */
+#define DE_LOG_SYNC_INTERVAL 1000
+
+/** Amount of appended records waiting for the writer, in bytes, after which
+ * appending waits for the writer.
+ */
+#define DE_LOG_MAX_PENDING (16 * 1024 * 1024)
+
+/** A logged roll.
+ */
+typedef struct {
+    // Wall clock time of the roll, in nanoseconds since the epoch.
+    int64_t time;
+    // State of the random number generator before the roll, de_rng::s.
+    uint64_t rng[4];
+    /* Seed of the session and the number of the roll in the session, zero
+     * based. The generator was seeded with de_rng_seed_stream(seed, roll).
+     */
+    uint64_t seed, roll;
+    // Zero or the error of the roll.
+    enum parse_error error;
+    int_least64_t value;
+    // Dice expression and the rolled expression, not null terminated.
+    const char *expr;
+    size_t expr_len;
+    const char *rolled;
+    size_t rolled_len;
+} de_log_entry;
+
+/** Log being written.
+ */
+typedef struct de_log de_log;
+
+/** Open a log for appending and start its writer thread.
+ * The file is created if it doesn't exist.
+ * @param path
+ * @param log Used to store the log, must point to NULL. Close with
+ * de_log_close().
+ * @return Zero on success, errno otherwise. EINVAL if the file isn't a log
+ * written on a machine with the same byte order.
+ */
+int
+de_log_open(const char *path, de_log **log);
+
+/** Append a record.
+ * Doesn't do any I/O, unless DE_LOG_MAX_PENDING bytes are waiting for the
+ * writer. Can be called from many threads at the same time.
+ * @param log Can't be NULL.
+ * @param entry Can't be NULL.
+ * @return Zero on success, errno otherwise. If the writer has failed, its
+ * error.
+ */
+int
+de_log_append(de_log *log, const de_log_entry *entry);
+
+/** Write and sync the appended records, stop the writer and close the log.
+ * @param log Can be NULL.
+ * @return Zero on success, errno of the first error of the log otherwise.
+ */
+int
+de_log_close(de_log *log);
+
+/** Log being read.
+ * The file is memory mapped, entries point to the mapped memory.
+ */
+typedef struct {
+    const char *map;
+    size_t len;
+    // Offset of the next record.
+    size_t pos;
+} de_log_reader;
+
+/** Memory map a log for reading.
+ * @param path
+ * @param reader Used to store the reader. Close with de_log_unmap().
+ * @return Zero on success, errno otherwise. EINVAL if the file isn't a log
+ * written on a machine with the same byte order.
+ */
+int
+de_log_map(const char *path, de_log_reader *reader);
+
+/** Read the next record.
+ * @param reader Can't be NULL.
+ * @param entry Used to store the record. The expressions point to the mapped
+ * memory and are valid until de_log_unmap().
+ * @return Non-zero if a record was read, zero at the end of the log.
+ */
+int
+de_log_next(de_log_reader *reader, de_log_entry *entry);
+
+/** Unmap a log.
+ * @param reader Can't be NULL.
+ */
+void
+de_log_unmap(de_log_reader *reader);
+
+#endif // ROLLLOG_H
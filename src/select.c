@@ -0,0 +1,203 @@
+#include <assert.h>
+#include <string.h>
+#include "select.h"
+
+// Compare and exchange without branches, a < b afterwards.
+#define CSWAP(a, b) {                                  \
+    int_least64_t lo_ = (a) < (b) ? (a) : (b);         \
+    int_least64_t hi_ = (a) < (b) ? (b) : (a);         \
+    (a) = lo_;                                         \
+    (b) = hi_;                                         \
+}
+
+static void
+select_network(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep);
+
+static enum parse_error
+select_histogram(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large,
+    de_keep *keep);
+
+static enum parse_error
+select_quick(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep);
+
+static void
+nth_element(int_least64_t *a, int_least64_t from, int_least64_t to,
+    int_least64_t nth);
+
+static void
+count_kept(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep);
+
+enum parse_error
+de_select(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large,
+    de_keep *keep) {
+    assert(small + large < nrolls);
+
+    if (nrolls <= SELECT_NETWORK_MAX) {
+        select_network(rolls, nrolls, small, large, keep);
+        return 0;
+    }
+    if (dice <= nrolls && dice <= SELECT_HISTOGRAM_MAX_SIDES)
+        return select_histogram(ctx, rolls, nrolls, dice, small, large, keep);
+
+    return select_quick(ctx, rolls, nrolls, small, large, keep);
+}
+
+/* Sort a copy of the rolls with odd-even transposition sort.
+ * It's a sorting network, so the comparisons don't depend on the data.
+ */
+static void
+select_network(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep) {
+    int_least64_t a[SELECT_NETWORK_MAX];
+    memcpy(a, rolls, nrolls * sizeof(*a));
+
+    for (int_least64_t round = 0; round < nrolls; round++) {
+        for (int_least64_t i = round & 1; i + 1 < nrolls; i += 2)
+            CSWAP(a[i], a[i + 1]);
+    }
+
+    keep->low = a[small];
+    keep->high = a[nrolls - large - 1];
+    keep->low_count = 0;
+    keep->high_count = 0;
+    for (int_least64_t i = small; i < nrolls - large; i++) {
+        keep->low_count += a[i] == keep->low;
+        keep->high_count += a[i] == keep->high && keep->high != keep->low;
+    }
+}
+
+/* Count the rolls of every side and walk the counts from both ends.
+ */
+static enum parse_error
+select_histogram(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large,
+    de_keep *keep) {
+    if (de_reserve(ctx, &ctx->counts, &ctx->counts_size, dice) != 0)
+        return DE_MEMORY;
+    int_least64_t *counts = ctx->counts;
+    memset(counts, 0, dice * sizeof(*counts));
+
+    for (int_least64_t i = 0; i < nrolls; i++)
+        counts[rolls[i] - 1]++;
+
+    de_select_counts(counts, dice, nrolls, small, large, keep);
+
+    return 0;
+}
+
+void
+de_select_counts(const int_least64_t *counts, int_least64_t dice,
+    int_least64_t nrolls, int_least64_t small, int_least64_t large,
+    de_keep *keep) {
+    assert(small + large < nrolls);
+
+    // Sides below low and above high are ignored completely.
+    int_least64_t low = 0, below = 0;
+    while (below + counts[low] <= small)
+        below += counts[low++];
+    int_least64_t high = dice - 1, above = 0;
+    while (above + counts[high] <= large)
+        above += counts[high--];
+
+    keep->low = low + 1;
+    keep->high = high + 1;
+    if (low == high) {
+        keep->low_count = nrolls - small - large;
+        keep->high_count = 0;
+    }
+    else {
+        keep->low_count = below + counts[low] - small;
+        keep->high_count = above + counts[high] - large;
+    }
+}
+
+/* Find the smallest and the largest kept roll with quickselect on a copy of
+ * the rolls.
+ */
+static enum parse_error
+select_quick(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep) {
+    if (de_reserve(ctx, &ctx->scratch, &ctx->scratch_size, nrolls) != 0)
+        return DE_MEMORY;
+    int_least64_t *a = ctx->scratch;
+    memcpy(a, rolls, nrolls * sizeof(*a));
+
+    nth_element(a, 0, nrolls, small);
+    // Elements after small are not smaller than it.
+    nth_element(a, small, nrolls, nrolls - large - 1);
+    keep->low = a[small];
+    keep->high = a[nrolls - large - 1];
+    count_kept(rolls, nrolls, small, large, keep);
+
+    return 0;
+}
+
+/* Partially sort a, so that a[nth] is the element which would be there if a
+ * was sorted, smaller or equal elements are before it and larger or equal
+ * after it.
+ * @param a
+ * @param from First index of the range to sort.
+ * @param to One past the last index of the range.
+ * @param nth
+ */
+static void
+nth_element(int_least64_t *a, int_least64_t from, int_least64_t to,
+    int_least64_t nth) {
+    int_least64_t lo = from, hi = to - 1;
+    while (lo < hi) {
+        // Median of three as the pivot.
+        int_least64_t mid = lo + (hi - lo) / 2;
+        CSWAP(a[lo], a[mid]);
+        CSWAP(a[mid], a[hi]);
+        CSWAP(a[lo], a[mid]);
+        int_least64_t pivot = a[mid];
+
+        int_least64_t i = lo, j = hi;
+        while (i <= j) {
+            while (a[i] < pivot)
+                i++;
+            while (a[j] > pivot)
+                j--;
+            if (i <= j) {
+                int_least64_t t = a[i];
+                a[i++] = a[j];
+                a[j--] = t;
+            }
+        }
+        if (nth <= j)
+            hi = j;
+        else if (nth >= i)
+            lo = i;
+        else
+            return;
+    }
+}
+
+/* Count the rolls equal to low and high which are kept.
+ * keep->low and keep->high must be set.
+ */
+static void
+count_kept(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, de_keep *keep) {
+    int_least64_t below = 0, low = 0, high = 0, above = 0;
+    for (int_least64_t i = 0; i < nrolls; i++) {
+        below += rolls[i] < keep->low;
+        low += rolls[i] == keep->low;
+        high += rolls[i] == keep->high;
+        above += rolls[i] > keep->high;
+    }
+
+    if (keep->low == keep->high) {
+        keep->low_count = nrolls - small - large;
+        keep->high_count = 0;
+    }
+    else {
+        keep->low_count = below + low - small;
+        keep->high_count = above + high - large;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef SELECT_H
+    #define SELECT_H
+
+/** @file
+ *
+ * @description Selection of the rolls kept when the smallest and the largest
+ * rolls of a dice are ignored, without sorting all the rolls.
+ *
+ * The strategy depends on the number of rolls and sides: small pools are
+ * sorted with a sorting network, pools with few sides are counted to a
+ * histogram and other pools use quickselect on a copy of the rolls.
+ */
+
+#include <stdint.h>
+#include "deimpl.h"
+
+/** The maximum number of rolls sorted with a sorting network.
+ */
+#define SELECT_NETWORK_MAX 16
+
+/** The maximum number of sides for the histogram strategy.
+ */
+#define SELECT_HISTOGRAM_MAX_SIDES 65536
+
+/** Rolls kept after ignoring.
+ * If the rolls were sorted, the kept rolls would be the ones from index small
+ * to nrolls - large - 1. Rolls strictly between low and high are kept, and
+ * low_count rolls equal to low and high_count rolls equal to high. If low is
+ * equal to high, high_count is zero.
+ */
+typedef struct {
+    int_least64_t low, high;
+    int_least64_t low_count, high_count;
+} de_keep;
+
+/** Select the rolls to keep.
+ * @param ctx Context, its buffers are used.
+ * @param rolls Rolls, not modified.
+ * @param nrolls Number of rolls. Must be > small + large.
+ * @param dice Number of sides.
+ * @param small Number of smallest rolls to ignore.
+ * @param large Number of largest rolls to ignore.
+ * @param keep Used to store the kept rolls.
+ * @return Zero on success, DE_MEMORY if can't allocate memory.
+ */
+enum parse_error
+de_select(de_ctx *ctx, const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large,
+    de_keep *keep);
+
+/** Select the rolls to keep from the number of rolls of every side.
+ * @param counts Number of rolls of every side, counts[i] rolls of i + 1.
+ * @param dice Number of sides.
+ * @param nrolls Number of rolls. Must be > small + large.
+ * @param small Number of smallest rolls to ignore.
+ * @param large Number of largest rolls to ignore.
+ * @param keep Used to store the kept rolls.
+ */
+void
+de_select_counts(const int_least64_t *counts, int_least64_t dice,
+    int_least64_t nrolls, int_least64_t small, int_least64_t large,
+    de_keep *keep);
+
+#endif // SELECT_H
@@ -0,0 +1,661 @@
+/* Roll dice expressions for clients over a Unix domain socket or localhost
+ * TCP.
+ *
+ * Protocol, one request and one response per line. Clients can send many
+ * requests without waiting for the responses, responses are sent in the same
+ * order.
+ *
+ *   request  ::= option* expression | "stats"
+ *   option   ::= "verbose " | "seed=" INTEGER " "
+ *   response ::= "ok " value [" " rolled-expression] | "error " message |
+ *                "stats " statistics
+ *
+ * Without a seed, every connection rolls with its own random number
+ * generator. With a seed, the request is rolled with a generator seeded with
+ * it, so the same request gives the same result.
+ *
+ * The server is a single threaded poll loop. Every iteration evaluates up to
+ * MAX_TURN_REQUESTS complete requests of each connection as a batch and
+ * writes their responses with one write. The rest of the received requests
+ * wait for the next iterations, so a client sending many requests at once
+ * doesn't hold up the other clients until all of them are evaluated. A
+ * single expensive request still blocks the loop while it's evaluated. A
+ * connection isn't read while it has requests waiting or too many of its
+ * responses wait to be written, so a client which doesn't read its responses
+ * can't make the server buffer without bound.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "diceexpr.h"
+#include "str.h"
+
+// The maximum length of a request in bytes, without the newline.
+#define MAX_REQUEST 4096
+// Bytes read at once.
+#define READ_SIZE (64 * 1024)
+// Connection isn't read while it has more unsent response bytes than this.
+#define MAX_PENDING_OUTPUT (1024 * 1024)
+// The maximum number of connections, more are refused.
+#define MAX_CONNECTIONS 1024
+// The maximum number of batches whose responses aren't written yet.
+#define MAX_BATCHES 64
+// The maximum number of requests of a connection evaluated per iteration.
+#define MAX_TURN_REQUESTS 64
+
+/* Requests evaluated in one iteration. Their latency is measured from the
+ * read to the write of their last response.
+ */
+typedef struct {
+    // Number of requests.
+    uint64_t n;
+    // Position in the output after the responses.
+    uint64_t end;
+    // Time when read, in nanoseconds.
+    uint64_t time;
+} batch;
+
+typedef struct {
+    int fd;
+    // Received bytes which aren't handled yet.
+    char *in;
+    size_t in_len;
+    // Received requests may wait to be evaluated.
+    int backlog;
+    // Time of the last read, in nanoseconds.
+    uint64_t read_time;
+    // Responses, written from out_pos.
+    str *out;
+    size_t out_pos;
+    // Number of response bytes ever appended and written.
+    uint64_t appended, written;
+    // Batches waiting for their responses to be written, a ring buffer.
+    batch batches[MAX_BATCHES];
+    size_t first_batch, nbatches;
+    // Random number generator of the connection.
+    de_rng rng;
+    // Close after the responses are written.
+    int closing;
+    // Latency statistics, in nanoseconds.
+    uint64_t requests, latency_sum, latency_max;
+} connection;
+
+static volatile sig_atomic_t stop;
+
+static void
+usage(FILE *stream, const char *program);
+
+static void
+on_signal(int signum);
+
+static int
+listen_unix(const char *path);
+
+static int
+remove_socket(const char *path);
+
+static int
+listen_tcp(const char *port);
+
+static int
+set_nonblocking(int fd);
+
+static void
+accept_connection(int listener, connection **conns, size_t *nconns,
+    uint64_t *seed);
+
+static connection*
+connection_new(int fd, uint64_t seed);
+
+static void
+connection_free(connection *c);
+
+static int
+connection_read(connection *c);
+
+static int
+connection_runnable(const connection *c);
+
+static int
+connection_evaluate(connection *c, de_ctx *ctx);
+
+static int
+connection_write(connection *c);
+
+static void
+handle_request(connection *c, de_ctx *ctx, const char *request, size_t len);
+
+static const char*
+parse_option(const char *p, const char *end, int *verbose, int *seeded,
+    uint64_t *seed, enum parse_error *error);
+
+static void
+append_stats(connection *c);
+
+static void
+log_stats(const connection *c);
+
+static uint64_t
+now(void);
+
+int
+main(int argc, char **argv) {
+    const char *path = NULL, *port = NULL;
+    int quiet = 0, opt;
+    while ((opt = getopt(argc, argv, "u:p:qh")) != -1) {
+        switch (opt) {
+            case 'u':
+                path = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'h':
+                usage(stdout, argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(stderr, argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if ((path == NULL && port == NULL) || optind != argc) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int listeners[2], nlisteners = 0;
+    if (path != NULL && (listeners[nlisteners++] = listen_unix(path)) < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (port != NULL && (listeners[nlisteners++] = listen_tcp(port)) < 0) {
+        fprintf(stderr, "port %s: %s\n", port, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    de_ctx *ctx = de_ctx_new();
+    connection **conns = calloc(MAX_CONNECTIONS, sizeof(*conns));
+    struct pollfd *fds = calloc(MAX_CONNECTIONS + 2, sizeof(*fds));
+    if (ctx == NULL || conns == NULL || fds == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        abort();
+    }
+    size_t nconns = 0;
+    uint64_t seed = now() ^ ((uint64_t) getpid() << 32);
+
+    while (!stop) {
+        // Don't wait if requests are waiting to be evaluated.
+        int timeout = -1;
+        for (int i = 0; i < nlisteners; i++)
+            fds[i] = (struct pollfd) { listeners[i], POLLIN, 0 };
+        for (size_t i = 0; i < nconns; i++) {
+            connection *c = conns[i];
+            short events = 0;
+            if (!c->closing && !c->backlog &&
+                    c->out->len - c->out_pos < MAX_PENDING_OUTPUT)
+                events |= POLLIN;
+            if (c->out_pos < c->out->len)
+                events |= POLLOUT;
+            if (connection_runnable(c))
+                timeout = 0;
+            fds[nlisteners + i] = (struct pollfd) { c->fd, events, 0 };
+        }
+
+        if (poll(fds, nlisteners + nconns, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        // Iterate backwards, so that removing a connection doesn't skip one.
+        for (size_t i = nconns; i-- > 0; ) {
+            connection *c = conns[i];
+            short revents = fds[nlisteners + i].revents;
+            int error = 0;
+            if (!c->closing && !c->backlog &&
+                    (revents & (POLLIN | POLLHUP | POLLERR)))
+                error = connection_read(c);
+            if (error == 0 && connection_runnable(c))
+                error = connection_evaluate(c, ctx);
+            if (error == 0 && c->out_pos < c->out->len)
+                error = connection_write(c);
+            if (error != 0 || (c->closing && !c->backlog &&
+                    c->out_pos == c->out->len)) {
+                if (!quiet)
+                    log_stats(c);
+                connection_free(c);
+                conns[i] = conns[--nconns];
+            }
+        }
+        for (int i = 0; i < nlisteners; i++) {
+            if (fds[i].revents & POLLIN)
+                accept_connection(listeners[i], conns, &nconns, &seed);
+        }
+    }
+
+    for (size_t i = 0; i < nconns; i++)
+        connection_free(conns[i]);
+    for (int i = 0; i < nlisteners; i++)
+        close(listeners[i]);
+    if (path != NULL)
+        remove_socket(path);
+    free(fds);
+    free(conns);
+    de_ctx_free(ctx);
+
+    return EXIT_SUCCESS;
+}
+
+static void
+usage(FILE *stream, const char *program) {
+    fprintf(stream,
+        "Usage: %s [-u path] [-p port] [-q]\n"
+        "Roll dice expressions for clients, one request per line.\n"
+        "\n"
+        "  -u path  listen to a Unix domain socket\n"
+        "  -p port  listen to a TCP port on localhost\n"
+        "  -q       don't log connection statistics\n"
+        "  -h       show this help\n", program);
+}
+
+static void
+on_signal(int signum) {
+    (void) signum;
+    stop = 1;
+}
+
+/* Listen to a Unix domain socket.
+ * @return Socket or negative on error and errno is set.
+ */
+static int
+listen_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (remove_socket(path) != 0 ||
+        bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 || set_nonblocking(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Remove a socket left by a previous server. Anything else at the path is
+ * left alone, so a mistyped path doesn't delete a file.
+ * @return Zero if there's nothing at the path anymore, negative on error and
+ * errno is set, EADDRINUSE if the path isn't a socket.
+ */
+static int
+remove_socket(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    return unlink(path);
+}
+
+/* Listen to a TCP port on the loopback interface only.
+ * @return Socket or negative on error and errno is set.
+ */
+static int
+listen_tcp(const char *port) {
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(port, &end, 10);
+    if (errno != 0 || *end != '\0' || n == 0 || n > 65535) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(n);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 || set_nonblocking(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int
+set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Accept pending connections. Connections over MAX_CONNECTIONS are closed
+ * right away.
+ * @param seed Used to seed connections, advanced for every connection.
+ */
+static void
+accept_connection(int listener, connection **conns, size_t *nconns,
+    uint64_t *seed) {
+    int fd;
+    while ((fd = accept(listener, NULL, NULL)) >= 0) {
+        connection *c = NULL;
+        if (*nconns == MAX_CONNECTIONS || set_nonblocking(fd) != 0 ||
+            (c = connection_new(fd, (*seed)++)) == NULL) {
+            close(fd);
+            continue;
+        }
+        conns[(*nconns)++] = c;
+    }
+}
+
+static connection*
+connection_new(int fd, uint64_t seed) {
+    connection *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->fd = fd;
+    c->in = malloc(MAX_REQUEST + READ_SIZE);
+    c->out = str_new(NULL);
+    if (c->in == NULL || c->out == NULL) {
+        c->fd = -1;
+        connection_free(c);
+        return NULL;
+    }
+    de_rng_seed(&c->rng, seed);
+
+    return c;
+}
+
+static void
+connection_free(connection *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->in);
+    if (c->out != NULL)
+        str_free(c->out);
+    free(c);
+}
+
+/* Read requests. They're evaluated by connection_evaluate().
+ * The connection must not have a backlog, so at least READ_SIZE bytes fit.
+ * @return Zero on success, non-zero if the connection should be closed now.
+ */
+static int
+connection_read(connection *c) {
+    ssize_t n = read(c->fd, c->in + c->in_len, MAX_REQUEST + READ_SIZE -
+        c->in_len);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+            0 : 1;
+    c->read_time = now();
+    if (n == 0) {
+        // Respond to the requests already received, then close.
+        c->closing = 1;
+        if (c->in_len == 0)
+            return 0;
+        // The last request doesn't need a newline.
+        c->in[c->in_len++] = '\n';
+    }
+    c->in_len += n;
+    c->backlog = 1;
+
+    return 0;
+}
+
+/* Whether requests of a connection can be evaluated now. They wait while too
+ * many responses wait to be written.
+ */
+static int
+connection_runnable(const connection *c) {
+    return c->backlog && c->out->len - c->out_pos < MAX_PENDING_OUTPUT;
+}
+
+/* Evaluate up to MAX_TURN_REQUESTS received requests as one batch and append
+ * their responses. The backlog is cleared when no complete request is left.
+ * @return Zero on success, non-zero if the connection should be closed now.
+ */
+static int
+connection_evaluate(connection *c, de_ctx *ctx) {
+    uint64_t requests = 0;
+    char *request = c->in, *end = c->in + c->in_len, *newline = NULL;
+    while (requests < MAX_TURN_REQUESTS &&
+            (newline = memchr(request, '\n', end - request)) != NULL) {
+        size_t len = newline - request;
+        if (len > 0 && request[len - 1] == '\r')
+            len--;
+        handle_request(c, ctx, request, len);
+        requests++;
+        request = newline + 1;
+    }
+    c->in_len = end - request;
+    memmove(c->in, request, c->in_len);
+    // Complete requests may be left if the turn ended.
+    if (newline != NULL)
+        c->backlog = memchr(c->in, '\n', c->in_len) != NULL;
+    else
+        c->backlog = 0;
+    if (!c->backlog && c->in_len > MAX_REQUEST) {
+        if (str_append_chars(c->out, "error request too long\n") != 0)
+            return 1;
+        requests++;
+        c->in_len = 0;
+        c->closing = 1;
+    }
+    c->appended = c->written + (c->out->len - c->out_pos);
+
+    if (requests > 0) {
+        if (c->nbatches == MAX_BATCHES) {
+            // Merge to the newest batch, its latency is measured.
+            size_t last = (c->first_batch + c->nbatches - 1) % MAX_BATCHES;
+            c->batches[last].n += requests;
+            c->batches[last].end = c->appended;
+        }
+        else {
+            size_t last = (c->first_batch + c->nbatches++) % MAX_BATCHES;
+            c->batches[last] = (batch) { requests, c->appended,
+                c->read_time };
+        }
+    }
+
+    return 0;
+}
+
+/* Write pending responses and update latency statistics.
+ * @return Zero on success, non-zero if the connection should be closed now.
+ */
+static int
+connection_write(connection *c) {
+    ssize_t n = write(c->fd, c->out->str + c->out_pos,
+        c->out->len - c->out_pos);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ?
+            0 : 1;
+    c->out_pos += n;
+    c->written += n;
+    if (c->out_pos == c->out->len) {
+        str_erase(c->out);
+        c->out_pos = 0;
+    }
+
+    uint64_t time = now();
+    while (c->nbatches > 0 && c->batches[c->first_batch].end <= c->written) {
+        batch *b = &c->batches[c->first_batch];
+        uint64_t latency = time - b->time;
+        c->requests += b->n;
+        c->latency_sum += b->n * latency;
+        if (latency > c->latency_max)
+            c->latency_max = latency;
+        c->first_batch = (c->first_batch + 1) % MAX_BATCHES;
+        c->nbatches--;
+    }
+
+    return 0;
+}
+
+/* Evaluate one request and append its response.
+ */
+static void
+handle_request(connection *c, de_ctx *ctx, const char *request, size_t len) {
+    const char *p = request, *end = request + len;
+    if (len == 5 && memcmp(request, "stats", 5) == 0) {
+        append_stats(c);
+        return;
+    }
+
+    int verbose = 0, seeded = 0;
+    uint64_t seed = 0;
+    enum parse_error e = 0;
+    const char *next;
+    while (e == 0 &&
+            (next = parse_option(p, end, &verbose, &seeded, &seed, &e)) != NULL)
+        p = next;
+
+    int_least64_t value;
+    const char *rolled = NULL;
+    if (e == 0) {
+        de_rng *rng = de_ctx_rng(ctx);
+        if (seeded)
+            de_rng_seed(rng, seed);
+        else
+            *rng = c->rng;
+        de_ctx_set_transcript(ctx,
+            verbose ? DE_TRANSCRIPT_TRUNCATED : DE_TRANSCRIPT_NONE);
+        e = de_parse_rn(ctx, p, end - p, &value, verbose ? &rolled : NULL);
+        if (!seeded)
+            c->rng = *rng;
+    }
+
+    int error = 0;
+    if (e != 0) {
+        error |= str_append_chars(c->out, "error ");
+        error |= str_append_chars(c->out, de_strerror(e));
+    }
+    else {
+        error |= str_append_chars(c->out, "ok ");
+        error |= str_append_int(c->out, value);
+        if (rolled != NULL) {
+            error |= str_append_char(c->out, ' ');
+            error |= str_append_chars(c->out, rolled);
+        }
+    }
+    error |= str_append_char(c->out, '\n');
+    if (error != 0) {
+        fprintf(stderr, "Out of memory\n");
+        abort();
+    }
+}
+
+/* Parse an option at the start of a request.
+ * @param error Set to DE_OVERFLOW if the seed doesn't fit 64 bits.
+ * @return Start of the rest of the request, NULL if there's no option or on
+ * error.
+ */
+static const char*
+parse_option(const char *p, const char *end, int *verbose, int *seeded,
+    uint64_t *seed, enum parse_error *error) {
+    static const char verbose_option[] = "verbose ", seed_option[] = "seed=";
+    size_t len = end - p;
+
+    if (len >= sizeof(verbose_option) - 1 &&
+        memcmp(p, verbose_option, sizeof(verbose_option) - 1) == 0) {
+        *verbose = 1;
+        return p + sizeof(verbose_option) - 1;
+    }
+
+    if (len >= sizeof(seed_option) - 1 &&
+        memcmp(p, seed_option, sizeof(seed_option) - 1) == 0) {
+        const char *q = p + sizeof(seed_option) - 1;
+        uint64_t value = 0;
+        int overflow = 0;
+        for (; q < end && *q >= '0' && *q <= '9'; q++) {
+            if (value > (UINT64_MAX - (*q - '0')) / 10)
+                overflow = 1;
+            value = value * 10 + (*q - '0');
+        }
+        if (q == p + sizeof(seed_option) - 1 || q == end || *q != ' ')
+            return NULL;
+        if (overflow) {
+            *error = DE_OVERFLOW;
+            return NULL;
+        }
+        *seeded = 1;
+        *seed = value;
+        return q + 1;
+    }
+
+    return NULL;
+}
+
+/* Append the latency statistics of a connection as a response.
+ */
+static void
+append_stats(connection *c) {
+    uint64_t mean = c->requests == 0 ? 0 : c->latency_sum / c->requests;
+    if (str_append_format(c->out, "stats requests=%" PRIu64 " mean_us=%"
+            PRIu64 " max_us=%" PRIu64 " pending=%zu\n", c->requests,
+            mean / 1000, c->latency_max / 1000,
+            c->out->len - c->out_pos) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        abort();
+    }
+}
+
+static void
+log_stats(const connection *c) {
+    uint64_t mean = c->requests == 0 ? 0 : c->latency_sum / c->requests;
+    fprintf(stderr, "connection %d closed: %" PRIu64 " requests, mean latency "
+        "%" PRIu64 " us, max %" PRIu64 " us\n", c->fd, c->requests,
+        mean / 1000, c->latency_max / 1000);
+}
+
+/* Monotonic time in nanoseconds.
+ */
+static uint64_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sim.h"
+#include "deimpl.h"
+
+// Number of values evaluated at once by a worker.
+#define SIM_BATCH 4096
+
+/* A worker thread. Inputs are set before the thread is started, results are
+ * written once when the thread finishes.
+ */
+typedef struct {
+    pthread_t thread;
+    const de_expr *expr;
+    // Number of evaluations.
+    uint64_t n;
+    de_rng rng;
+    // Histogram buckets, like in de_sim.
+    int_least64_t lo;
+    uint64_t width;
+    size_t nbuckets;
+    // Results.
+    enum parse_error error;
+    uint64_t *counts;
+    int_least64_t min, max;
+    double mean, m2;
+} worker;
+
+static void*
+work(void *arg);
+
+static void
+merge_moments(uint64_t *n, double *mean, double *m2, uint64_t n2, double mean2,
+    double m2_2);
+
+enum parse_error
+de_simulate(const de_expr *expr, uint64_t n, unsigned int threads,
+    uint64_t seed, de_sim **sim) {
+    assert(expr != NULL);
+    assert(n > 0);
+    assert(sim != NULL && *sim == NULL);
+
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    if (threads > n)
+        threads = n;
+
+    de_sim *result = calloc(1, sizeof(*result));
+    worker *workers = calloc(threads, sizeof(*workers));
+    if (result == NULL || workers == NULL)
+        goto memory_error;
+
+    int_least64_t hi;
+    de_bounds(expr, &result->lo, &hi);
+    uint64_t span = (uint64_t) hi - (uint64_t) result->lo;
+    result->width = span / DE_SIM_MAX_BUCKETS + 1;
+    result->nbuckets = span / result->width + 1;
+    if ((result->counts = calloc(result->nbuckets,
+            sizeof(*result->counts))) == NULL)
+        goto memory_error;
+
+    de_rng rng;
+    de_rng_seed(&rng, seed);
+    unsigned int started = 0;
+    enum parse_error e = 0;
+    for (; started < threads; started++) {
+        worker *w = &workers[started];
+        w->expr = expr;
+        w->n = n / threads + (started < n % threads);
+        w->rng = rng;
+        de_rng_jump(&rng);
+        w->lo = result->lo;
+        w->width = result->width;
+        w->nbuckets = result->nbuckets;
+        if (pthread_create(&w->thread, NULL, work, w) != 0) {
+            e = DE_MEMORY;
+            break;
+        }
+    }
+
+    result->min = INT_LEAST64_MAX;
+    result->max = INT_LEAST64_MIN;
+    for (unsigned int i = 0; i < started; i++) {
+        worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        if (e == 0)
+            e = w->error;
+        if (e == 0) {
+            for (size_t b = 0; b < result->nbuckets; b++)
+                result->counts[b] += w->counts[b];
+            merge_moments(&result->n, &result->mean, &result->variance, w->n,
+                w->mean, w->m2);
+            if (w->min < result->min)
+                result->min = w->min;
+            if (w->max > result->max)
+                result->max = w->max;
+        }
+        free(w->counts);
+    }
+    free(workers);
+    if (e != 0) {
+        de_sim_free(result);
+        return e;
+    }
+    result->mean += result->lo;
+    result->variance /= result->n;
+    *sim = result;
+
+    return 0;
+
+    memory_error:
+        free(workers);
+        de_sim_free(result);
+        return DE_MEMORY;
+}
+
+void
+de_sim_free(de_sim *sim) {
+    if (sim == NULL)
+        return;
+
+    free(sim->counts);
+    free(sim);
+}
+
+int_least64_t
+de_sim_percentile(const de_sim *sim, double q) {
+    assert(sim != NULL);
+
+    uint64_t target = q * sim->n;
+    if (target < q * sim->n)
+        target++;
+    if (target == 0)
+        target = 1;
+
+    uint64_t cumulative = 0;
+    size_t i = 0;
+    for (; i < sim->nbuckets - 1; i++) {
+        cumulative += sim->counts[i];
+        if (cumulative >= target)
+            break;
+    }
+
+    return sim->lo + (int_least64_t) (i * sim->width);
+}
+
+/* Evaluate the expression of a worker and collect the histogram and the
+ * moments of the values.
+ */
+static void*
+work(void *arg) {
+    worker *w = arg;
+    int_least64_t values[SIM_BATCH];
+
+    // Allocated by the thread, so that the memory is local to it.
+    de_ctx *ctx = de_ctx_new();
+    uint64_t *counts = calloc(w->nbuckets, sizeof(*counts));
+    if (ctx == NULL || counts == NULL) {
+        w->error = DE_MEMORY;
+        goto exit;
+    }
+    *de_ctx_rng(ctx) = w->rng;
+
+    uint64_t done = 0;
+    double mean = 0, m2 = 0;
+    int_least64_t min = INT_LEAST64_MAX, max = INT_LEAST64_MIN;
+    while (done < w->n) {
+        size_t batch = w->n - done < SIM_BATCH ? w->n - done : SIM_BATCH;
+        if ((w->error = de_eval_batch(ctx, w->expr, batch, values)) != 0)
+            goto exit;
+
+        // Moments of offsets from lo keep the precision of large values.
+        double sum = 0;
+        for (size_t i = 0; i < batch; i++) {
+            int_least64_t v = values[i];
+            min = v < min ? v : min;
+            max = v > max ? v : max;
+            uint64_t offset = (uint64_t) v - (uint64_t) w->lo;
+            sum += offset;
+            counts[w->width == 1 ? offset : offset / w->width]++;
+        }
+        double batch_mean = sum / batch, batch_m2 = 0;
+        for (size_t i = 0; i < batch; i++) {
+            double d = ((uint64_t) values[i] - (uint64_t) w->lo) - batch_mean;
+            batch_m2 += d * d;
+        }
+        merge_moments(&done, &mean, &m2, batch, batch_mean, batch_m2);
+    }
+    w->min = min;
+    w->max = max;
+    w->mean = mean;
+    w->m2 = m2;
+
+    exit:
+        w->counts = counts;
+        de_ctx_free(ctx);
+        return NULL;
+}
+
+/* Merge the count, the mean and the sum of squared deviations of two sets of
+ * values with Chan's formula, into the first set.
+ */
+static void
+merge_moments(uint64_t *n, double *mean, double *m2, uint64_t n2, double mean2,
+    double m2_2) {
+    uint64_t total = *n + n2;
+    double delta = mean2 - *mean;
+    *mean += delta * n2 / total;
+    *m2 += m2_2 + delta * delta * ((double) *n * n2 / total);
+    *n = total;
+}
@@ -0,0 +1,73 @@
+#ifndef SIM_H
+    #define SIM_H
+
+/** @file
+ *
+ * @description Monte Carlo simulation of dice expressions.
+ *
+ * For expressions whose exact distribution is too expensive, see dist.h.
+ * The evaluations are split between worker threads. Every worker has its own
+ * context, a random number stream jumped from the same seed and its own
+ * histogram, so workers share nothing until their results are merged at the
+ * end.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "diceexpr.h"
+
+/** The maximum number of buckets in the histogram of a simulation.
+ */
+#define DE_SIM_MAX_BUCKETS (1 << 16)
+
+/** Result of a simulation.
+ */
+typedef struct {
+    // Number of evaluations.
+    uint64_t n;
+    // The smallest and the largest value.
+    int_least64_t min, max;
+    // Mean and variance.
+    double mean, variance;
+    /* Histogram, counts[i] values in [lo + i * width, lo + (i + 1) * width).
+     * The buckets cover all possible values of the expression, the width is
+     * one unless there are more than DE_SIM_MAX_BUCKETS possible values.
+     */
+    int_least64_t lo;
+    uint64_t width;
+    size_t nbuckets;
+    uint64_t *counts;
+} de_sim;
+
+/** Evaluate an expression n times in parallel.
+ * @param expr Compiled expression, can't be NULL.
+ * @param n Number of evaluations, must be > 0.
+ * @param threads Number of worker threads, zero for the number of online
+ * processors.
+ * @param seed Seed of the random number generators. The same seed and number
+ * of threads give the same result.
+ * @param sim Used to store the result, must point to NULL. Free with
+ * de_sim_free().
+ * @return Zero on success, DE_MEMORY or DE_OVERFLOW otherwise.
+ */
+enum parse_error
+de_simulate(const de_expr *expr, uint64_t n, unsigned int threads,
+    uint64_t seed, de_sim **sim);
+
+/** Free the result of a simulation.
+ * @param sim Can be NULL.
+ */
+void
+de_sim_free(de_sim *sim);
+
+/** The smallest value whose cumulative frequency is at least q.
+ * If the width of the buckets is more than one, the start of the bucket is
+ * returned.
+ * @param sim Can't be NULL.
+ * @param q In [0, 1], e.g. 0.5 for the median.
+ * @return
+ */
+int_least64_t
+de_sim_percentile(const de_sim *sim, double q);
+
+#endif // SIM_H
@@ -1,11 +1,66 @@
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include "config.h"
 #include "sound.h"
+#ifdef HAVE_GSTREAMER
+    #include <gst/app/gstappsrc.h>
+    #include <gst/app/gstappsink.h>
+#endif
 
 #ifdef HAVE_GSTREAMER
+// Format the sound is decoded to and mixed in.
+#define RATE 44100
+#define CHANNELS 2
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    #define SAMPLE_FORMAT "S16LE"
+#else
+    #define SAMPLE_FORMAT "S16BE"
+#endif
+// Frames mixed at a time, 10 ms.
+#define CHUNK_FRAMES (RATE / 100)
+// Chunks queued in the pipeline before the sink, adds to the latency.
+#define QUEUED_CHUNKS 2
+// The pipeline is paused after this many silent chunks in a row, long
+// enough for the sink to play what it has buffered.
+#define IDLE_CHUNKS 20
+// Buffer and period of the audio sink, in microseconds.
+#define SINK_BUFFER_TIME 40000
+#define SINK_LATENCY_TIME 10000
+
+static gpointer
+set_up(gpointer data);
+
+static gboolean
+decode(sound *s);
+
+static GstElement*
+create_pipeline(sound *s);
+
+static GstCaps*
+sample_caps(void);
+
+static void
+set_sink_latency(GstBin *bin, GstBin *sub_bin, GstElement *element,
+    gpointer user_data);
+
+static void
+need_data(GstAppSrc *src, guint length, gpointer user_data);
+
+static gboolean
+mix(sound *s, gint16 *out);
+
+static void
+start_playing(sound *s);
+
+static gboolean
+pause_if_idle(gpointer user_data);
+
 static gboolean
 bus_cb(GstBus *bus, GstMessage *message, gpointer user_data);
+
+static void
+print_error(GstMessage *message);
 #endif
 
 sound*
@@ -13,89 +68,367 @@ sound_init(int *argc, char ***argv, const gchar *file) {
 #ifndef HAVE_GSTREAMER
     return NULL;
 #else
-    gst_init(argc, argv);
-
     sound *s = g_new(sound, 1);
-    s->player = NULL;
-
-    GError *error = NULL;
-    gchar *uri = gst_filename_to_uri(file, &error);
-    if (uri == NULL) {
-        g_printerr("%s\n", error->message);
-        g_error_free(error);
-        return s;
-    }
-
-    if ((s->player = gst_element_factory_make("playbin", "player")) == NULL) {
-        g_printerr("Can't create playbin element.\n");
-        goto clean_up;
-    }
-    g_object_set(G_OBJECT(s->player), "uri", uri, NULL);
-
-    GstBus *bus = gst_element_get_bus(s->player);
-    gst_bus_add_watch(bus, bus_cb, s->player);
-    gst_object_unref(bus);
-
-    clean_up:
-        g_free(uri);
+    s->pipeline = NULL;
+    s->file = g_strdup(file);
+    s->args = g_new(gchar*, *argc + 1);
+    for (int i = 0; i < *argc; i++)
+        s->args[i] = g_strdup((*argv)[i]);
+    s->args[*argc] = NULL;
+    s->sample = NULL;
+    s->nframes = 0;
+    s->pushed = 0;
+    g_mutex_init(&s->lock);
+    for (int i = 0; i < SOUND_VOICES; i++)
+        s->voices[i] = -1;
+    s->silent_chunks = 0;
+    s->ready = FALSE;
+    s->playing = FALSE;
+    s->pause_source = 0;
+    s->setup = NULL;
 
     return s;
 #endif
 }
 
+void
+sound_prepare(sound *s) {
+#ifdef HAVE_GSTREAMER
+    if (s->setup == NULL)
+        s->setup = g_thread_new("sound", set_up, s);
+#endif
+}
+
 void
 sound_play(sound *s) {
 #ifdef HAVE_GSTREAMER
-    if (s->player == NULL)
-        return;
+    sound_prepare(s);
+    g_mutex_lock(&s->lock);
+    // A free voice or the one playing the longest.
+    int voice = 0;
+    for (int i = 1; i < SOUND_VOICES && s->voices[voice] >= 0; i++) {
+        if (s->voices[i] < 0 || s->voices[i] > s->voices[voice])
+            voice = i;
+    }
+    s->voices[voice] = 0;
+    s->silent_chunks = 0;
+    g_mutex_unlock(&s->lock);
 
-    if (GST_STATE(s->player) == GST_STATE_PLAYING)
-        return;
-    if (gst_element_set_state(s->player, GST_STATE_PLAYING) ==
-            GST_STATE_CHANGE_FAILURE)
-        g_printerr("Failed to set playbin's state to playing.\n");
+    start_playing(s);
 #endif
 }
 
 void
 sound_end(sound *s) {
 #ifdef HAVE_GSTREAMER
-    if (s->player != NULL) {
-        gst_element_set_state(s->player, GST_STATE_NULL);
-        gst_object_unref(s->player);
+    if (s->setup != NULL)
+        g_thread_join(s->setup);
+    if (s->pipeline != NULL) {
+        gst_element_set_state(s->pipeline, GST_STATE_NULL);
+        GstBus *bus = gst_element_get_bus(s->pipeline);
+        gst_bus_remove_watch(bus);
+        gst_object_unref(bus);
+        gst_object_unref(s->pipeline);
     }
+    // The streaming thread is stopped, it doesn't add sources anymore.
+    if (s->pause_source != 0)
+        g_source_remove(s->pause_source);
+    g_mutex_clear(&s->lock);
+    g_free(s->sample);
+    g_free(s->file);
+    g_strfreev(s->args);
     g_free(s);
 #endif
 }
 
 #ifdef HAVE_GSTREAMER
+/* Initialize GStreamer, decode the sound and set up the pipeline. Run in
+ * the setup thread. Sounds played meanwhile start when the pipeline is set
+ * up.
+ */
+static gpointer
+set_up(gpointer data) {
+    sound *s = data;
+
+    // gst_init() removes the arguments it handles from the array.
+    int argc = g_strv_length(s->args);
+    char **argv = g_new(char*, argc + 1);
+    memcpy(argv, s->args, (argc + 1) * sizeof(*argv));
+    gst_init(&argc, &argv);
+    g_free(argv);
+
+    GstElement *pipeline;
+    if (!decode(s) || (pipeline = create_pipeline(s)) == NULL)
+        return NULL;
+
+    g_mutex_lock(&s->lock);
+    s->pipeline = pipeline;
+    s->ready = TRUE;
+    g_mutex_unlock(&s->lock);
+
+    start_playing(s);
+
+    return NULL;
+}
+
+/* Decode the whole sound file into memory.
+ * @return TRUE on success, FALSE on error.
+ */
 static gboolean
-bus_cb(GstBus *bus, GstMessage *message, gpointer user_data) {
-    GstElement *player = user_data;
+decode(sound *s) {
+    GError *error = NULL;
+    GstElement *decoder = gst_parse_launch("filesrc name=file ! decodebin ! "
+        "audioconvert ! audioresample ! appsink name=sink sync=false", &error);
+    if (decoder == NULL) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    GstElement *file = gst_bin_get_by_name(GST_BIN(decoder), "file");
+    g_object_set(G_OBJECT(file), "location", s->file, NULL);
+    gst_object_unref(file);
+    GstElement *sink = gst_bin_get_by_name(GST_BIN(decoder), "sink");
+    GstCaps *caps = sample_caps();
+    gst_app_sink_set_caps(GST_APP_SINK(sink), caps);
+    gst_caps_unref(caps);
 
-    switch (GST_MESSAGE_TYPE(message)) {
-        case GST_MESSAGE_EOS:
-            if (gst_element_set_state(player, GST_STATE_PAUSED) ==
-                    GST_STATE_CHANGE_FAILURE)
-                g_printerr("Failed to set playbin's state to paused.\n");
-            if (!gst_element_seek_simple(player, GST_FORMAT_TIME,
-                    GST_SEEK_FLAG_FLUSH, 0))
-                g_printerr("Failed to seek to start of stream.\n");
+    GByteArray *frames = g_byte_array_new();
+    gboolean decoded = FALSE;
+    if (gst_element_set_state(decoder, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Failed to start decoding %s.\n", s->file);
+        goto clean_up;
+    }
 
+    // Pulling blocks until the next sample or the end of the stream, but
+    // not on errors, check them between.
+    GstBus *bus = gst_element_get_bus(decoder);
+    for (;;) {
+        GstSample *sample = gst_app_sink_try_pull_sample(GST_APP_SINK(sink),
+            100 * GST_MSECOND);
+        if (sample != NULL) {
+            GstMapInfo map;
+            GstBuffer *buffer = gst_sample_get_buffer(sample);
+            if (buffer != NULL && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+                g_byte_array_append(frames, map.data, map.size);
+                gst_buffer_unmap(buffer, &map);
+            }
+            gst_sample_unref(sample);
+            continue;
+        }
+        if (gst_app_sink_is_eos(GST_APP_SINK(sink))) {
+            decoded = TRUE;
             break;
-        case GST_MESSAGE_ERROR: {
-            GError *error = NULL;
-            gchar *debug = NULL;
-            gst_message_parse_error(message, &error, &debug);
-            g_printerr("Error from element %s: %s\n",
-                GST_OBJECT_NAME(message->src), error->message);
-            g_error_free(error);
-            g_free(debug);
+        }
+        GstMessage *message = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR);
+        if (message != NULL) {
+            print_error(message);
+            gst_message_unref(message);
             break;
         }
-        default: ;
     }
+    gst_object_unref(bus);
+
+    clean_up:
+        gst_element_set_state(decoder, GST_STATE_NULL);
+        gst_object_unref(sink);
+        gst_object_unref(decoder);
+        if (decoded) {
+            s->nframes = frames->len / (CHANNELS * sizeof(gint16));
+            s->sample = (gint16*) g_byte_array_free(frames, FALSE);
+        }
+        else
+            g_byte_array_free(frames, TRUE);
+
+    return decoded;
+}
+
+/* Create the pipeline playing the mixed voices and pause it, so that the
+ * audio device is opened before the first sound.
+ * @return The pipeline or NULL on error.
+ */
+static GstElement*
+create_pipeline(sound *s) {
+    static GstAppSrcCallbacks callbacks = { need_data, NULL, NULL, { NULL } };
+
+    GError *error = NULL;
+    GstElement *pipeline = gst_parse_launch("appsrc name=voices ! "
+        "audioconvert ! audioresample ! autoaudiosink", &error);
+    if (pipeline == NULL) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    g_signal_connect(pipeline, "deep-element-added",
+        G_CALLBACK(set_sink_latency), NULL);
+
+    GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "voices");
+    GstCaps *caps = sample_caps();
+    gst_app_src_set_caps(GST_APP_SRC(src), caps);
+    gst_caps_unref(caps);
+    g_object_set(G_OBJECT(src), "format", GST_FORMAT_TIME, NULL);
+    gst_app_src_set_max_bytes(GST_APP_SRC(src),
+        QUEUED_CHUNKS * CHUNK_FRAMES * CHANNELS * sizeof(gint16));
+    gst_app_src_set_callbacks(GST_APP_SRC(src), &callbacks, s, NULL);
+    gst_object_unref(src);
+
+    GstBus *bus = gst_element_get_bus(pipeline);
+    gst_bus_add_watch(bus, bus_cb, NULL);
+    gst_object_unref(bus);
+
+    if (gst_element_set_state(pipeline, GST_STATE_PAUSED) ==
+            GST_STATE_CHANGE_FAILURE) {
+        g_printerr("Failed to set the sound pipeline's state to paused.\n");
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        bus = gst_element_get_bus(pipeline);
+        gst_bus_remove_watch(bus);
+        gst_object_unref(bus);
+        gst_object_unref(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/* Caps of the decoded sound.
+ */
+static GstCaps*
+sample_caps(void) {
+    return gst_caps_new_simple("audio/x-raw",
+        "format", G_TYPE_STRING, SAMPLE_FORMAT,
+        "layout", G_TYPE_STRING, "interleaved",
+        "rate", G_TYPE_INT, RATE,
+        "channels", G_TYPE_INT, CHANNELS, NULL);
+}
+
+/* Make the audio sink chosen by autoaudiosink buffer less, by default it
+ * buffers hundreds of milliseconds, which would delay every sound.
+ */
+static void
+set_sink_latency(GstBin *bin, GstBin *sub_bin, GstElement *element,
+        gpointer user_data) {
+    GObjectClass *class = G_OBJECT_GET_CLASS(element);
+    if (g_object_class_find_property(class, "buffer-time") != NULL &&
+            g_object_class_find_property(class, "latency-time") != NULL)
+        g_object_set(G_OBJECT(element),
+            "buffer-time", (gint64) SINK_BUFFER_TIME,
+            "latency-time", (gint64) SINK_LATENCY_TIME, NULL);
+}
+
+/* Push the next chunk of the mixed voices. Called by the streaming thread
+ * when the queue of the appsrc isn't full.
+ */
+static void
+need_data(GstAppSrc *src, guint length, gpointer user_data) {
+    sound *s = user_data;
+
+    gsize size = CHUNK_FRAMES * CHANNELS * sizeof(gint16);
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+
+    g_mutex_lock(&s->lock);
+    if (mix(s, (gint16*) map.data))
+        s->silent_chunks = 0;
+    else if (++s->silent_chunks == IDLE_CHUNKS && s->playing) {
+        s->playing = FALSE;
+        s->pause_source = g_idle_add(pause_if_idle, s);
+    }
+    g_mutex_unlock(&s->lock);
+
+    gst_buffer_unmap(buffer, &map);
+    GST_BUFFER_PTS(buffer) = gst_util_uint64_scale(s->pushed, GST_SECOND,
+        RATE);
+    GST_BUFFER_DURATION(buffer) = gst_util_uint64_scale(CHUNK_FRAMES,
+        GST_SECOND, RATE);
+    s->pushed += CHUNK_FRAMES;
+    gst_app_src_push_buffer(src, buffer);
+}
+
+/* Mix a chunk of the playing voices and advance them.
+ * @param s Locked.
+ * @param out CHUNK_FRAMES frames.
+ * @return TRUE if any voice was playing, FALSE if the chunk is silent.
+ */
+static gboolean
+mix(sound *s, gint16 *out) {
+    gint32 sum[CHUNK_FRAMES * CHANNELS] = { 0 };
+    gboolean mixed = FALSE;
+    for (int i = 0; i < SOUND_VOICES; i++) {
+        if (s->voices[i] < 0)
+            continue;
+
+        gsize start = s->voices[i];
+        gsize frames = MIN(CHUNK_FRAMES, s->nframes - start);
+        const gint16 *in = s->sample + start * CHANNELS;
+        for (gsize j = 0; j < frames * CHANNELS; j++)
+            sum[j] += in[j];
+        s->voices[i] = start + frames < s->nframes ? (gint64) (start + frames) :
+            -1;
+        mixed = TRUE;
+    }
+
+    for (gsize j = 0; j < CHUNK_FRAMES * CHANNELS; j++)
+        out[j] = CLAMP(sum[j], G_MININT16, G_MAXINT16);
+
+    return mixed;
+}
+
+/* Set the pipeline playing if it's set up, paused and a voice is playing.
+ */
+static void
+start_playing(sound *s) {
+    g_mutex_lock(&s->lock);
+    gboolean voice_playing = FALSE;
+    for (int i = 0; i < SOUND_VOICES; i++)
+        voice_playing = voice_playing || s->voices[i] >= 0;
+    gboolean start = s->ready && !s->playing && voice_playing;
+    if (start)
+        s->playing = TRUE;
+    g_mutex_unlock(&s->lock);
+
+    if (start && gst_element_set_state(s->pipeline, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE)
+        g_printerr("Failed to set the sound pipeline's state to playing.\n");
+}
+
+/* Pause the pipeline, unless a sound was played after it became silent.
+ * Called in the main thread, so that it doesn't race with sound_play().
+ */
+static gboolean
+pause_if_idle(gpointer user_data) {
+    sound *s = user_data;
+
+    g_mutex_lock(&s->lock);
+    s->pause_source = 0;
+    gboolean pause = !s->playing;
+    g_mutex_unlock(&s->lock);
+
+    if (pause && gst_element_set_state(s->pipeline, GST_STATE_PAUSED) ==
+            GST_STATE_CHANGE_FAILURE)
+        g_printerr("Failed to set the sound pipeline's state to paused.\n");
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+bus_cb(GstBus *bus, GstMessage *message, gpointer user_data) {
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR)
+        print_error(message);
 
     return TRUE;
 }
+
+/* Print an error message of an element.
+ */
+static void
+print_error(GstMessage *message) {
+    GError *error = NULL;
+    gchar *debug = NULL;
+    gst_message_parse_error(message, &error, &debug);
+    g_printerr("Error from element %s: %s\n",
+        GST_OBJECT_NAME(message->src), error->message);
+    g_error_free(error);
+    g_free(debug);
+}
 #endif
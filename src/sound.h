@@ -7,15 +7,42 @@
 #endif
 #include <glib.h>
 
+/** The maximum number of sounds played at the same time.
+ */
+#define SOUND_VOICES 4
+
 typedef struct {
 #ifdef HAVE_GSTREAMER
-    GstElement *player;    
+    // Plays the mixed voices, NULL until set up or if can't be set up.
+    GstElement *pipeline;
+    // Thread setting up the pipeline, NULL until sound_prepare().
+    GThread *setup;
+    // Sound file and arguments for GStreamer, used by the setup thread.
+    gchar *file;
+    gchar **args;
+    // The decoded sound, interleaved frames. Set before the pipeline.
+    gint16 *sample;
+    gsize nframes;
+    // Number of frames pushed to the pipeline, used by the streaming thread.
+    guint64 pushed;
+    // Guards the rest.
+    GMutex lock;
+    // Frame each voice is playing, -1 if the voice isn't playing.
+    gint64 voices[SOUND_VOICES];
+    // Number of silent chunks mixed in a row.
+    guint silent_chunks;
+    // Whether the pipeline is set up, and whether it's playing or paused.
+    gboolean ready, playing;
+    // Id of the idle source pausing the pipeline, zero if none.
+    guint pause_source;
 #else
     void *not_used;
 #endif
 } sound;
 
 /** Initialize playing audio.
+ * Nothing is set up until sound_prepare() or sound_play() is called, so
+ * GStreamer isn't loaded if sounds are off.
  * @param argc
  * @param argv
  * @param file Sound file to play.
@@ -24,13 +51,27 @@ typedef struct {
 sound*
 sound_init(int *argc, char ***argv, const gchar *file);
 
-/** Play a sound if not already playing.
+/** Set up playing in the background.
+ * GStreamer is initialized, the sound file decoded into memory and the
+ * pipeline set up in a background thread, so that they don't slow down the
+ * GUI. Call when sounds are turned on, so that the first sound plays without
+ * a delay. Does nothing if already called.
+ * @param s
+ */
+void
+sound_prepare(sound *s);
+
+/** Play the sound.
+ * The sound is mixed with the sounds already playing. If SOUND_VOICES sounds
+ * are playing, the one started first is restarted. If the pipeline isn't set
+ * up yet, the sound starts when it is.
  * @param s
  */
 void
 sound_play(sound *s);
 
 /** Free sound resources.
+ * Waits for the setup thread, if started.
  * @param s
  */
 void
@@ -7,6 +7,8 @@
 #include <stdio.h>
 #define DEFAULT_STR_SIZE 10
 #define SIZE_MULTIPLIER 2
+// Enough for any 64 bit integer in decimal with a sign.
+#define INT_DIGITS 20
 
 /* Resize memory allocated for data.
  * @param s Can't be NULL.
@@ -59,21 +61,32 @@ str_erase(str *s) {
 }
 
 int
-str_append_char(str *s, int c) {
+str_reserve(str *s, size_t len) {
     assert(s != NULL);
 
-    if (s->len + 1 >= s->size) {
-        s->size *= SIZE_MULTIPLIER;
-        if (resize_str(s, s->size) != 0)
-            return ENOMEM;
-    }
-    s->str[s->len++] = c;
+    if (s->size - s->len > len)
+        return 0;
 
-    if (s->len + 1 >= s->size) {
-        s->size *= SIZE_MULTIPLIER;
-        if (resize_str(s, s->size) != 0)
+    size_t size = s->size;
+    while (size - s->len <= len) {
+        if (size > SIZE_MAX / SIZE_MULTIPLIER)
             return ENOMEM;
+        size *= SIZE_MULTIPLIER;
     }
+    if (resize_str(s, size) != 0)
+        return ENOMEM;
+    s->size = size;
+
+    return 0;
+}
+
+int
+str_append_char(str *s, int c) {
+    assert(s != NULL);
+
+    if (str_reserve(s, 1) != 0)
+        return ENOMEM;
+    s->str[s->len++] = c;
     s->str[s->len] = '\0';
 
     return 0;
@@ -85,35 +98,69 @@ str_append_chars(str *s, const char *chars) {
     assert(chars != NULL);
     
     size_t len = strlen(chars);
-    while (s->size < s->len + len + 1) {
-        s->size *= SIZE_MULTIPLIER;
-        if (resize_str(s, s->size) != 0)
-            return ENOMEM;
-    }
+    if (str_reserve(s, len) != 0)
+        return ENOMEM;
 
-    strcpy(s->str + s->len, chars);
+    memcpy(s->str + s->len, chars, len + 1);
     s->len += len;
 
     return 0;
 }
 
+int
+str_append_int(str *s, int_least64_t i) {
+    assert(s != NULL);
+
+    if (str_reserve(s, INT_DIGITS) != 0)
+        return ENOMEM;
+
+    // Digits from the end of a buffer, using unsigned to negate the minimum.
+    char digits[INT_DIGITS];
+    char *p = digits + INT_DIGITS;
+    uint_least64_t u = i < 0 ? -(uint_least64_t) i : (uint_least64_t) i;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+    if (i < 0)
+        *--p = '-';
+
+    size_t len = digits + INT_DIGITS - p;
+    memcpy(s->str + s->len, p, len);
+    s->len += len;
+    s->str[s->len] = '\0';
+
+    return 0;
+}
+
 int
 str_append_format(str *s, const char *format, ...) {
     assert(s != NULL);
     assert(format != NULL);
 
-    int retval = 0;
-    char *temp = NULL;
-    va_list ap;
+    va_list ap, retry;
     va_start(ap, format);
-    if (vasprintf(&temp, format, ap) == -1) {
+    va_copy(retry, ap);
+    int retval = 0;
+    int len = vsnprintf(s->str + s->len, s->size - s->len, format, ap);
+    if (len < 0) {
+        s->str[s->len] = '\0';
         retval = -1;
         goto end;
     }
-    str_append_chars(s, temp);
-    free(temp);
+    // Didn't fit, grow and format again.
+    if ((size_t) len >= s->size - s->len) {
+        if (str_reserve(s, len) != 0) {
+            s->str[s->len] = '\0';
+            retval = -1;
+            goto end;
+        }
+        vsnprintf(s->str + s->len, s->size - s->len, format, retry);
+    }
+    s->len += len;
 
     end:
+        va_end(retry);
         va_end(ap);
 
     return retval;
@@ -132,6 +179,16 @@ str_copy_to_chars(str *s, char **chars) {
     return 0;
 }
 
+char*
+str_release(str *s) {
+    assert(s != NULL);
+
+    char *chars = s->str;
+    free(s);
+
+    return chars;
+}
+
 static int
 resize_str(str *s, size_t size) {
     assert(s != NULL);
@@ -1,6 +1,7 @@
 #ifndef STR_H
     #define STR_H
 #include <stddef.h>
+#include <stdint.h>
 
 /** A string library.
  * The data of the strings are handled as bytes, so the length of a string may not
@@ -40,6 +41,14 @@ str_free(str *s);
 void
 str_erase(str *s);
 
+/** Make room for appending without allocating.
+ * @param s Can't be NULL.
+ * @param len Number of bytes to append, not counting '\0'.
+ * @return Zero on success, ENOMEM on error.
+ */
+int
+str_reserve(str *s, size_t len);
+
 /** Append a character.
  * @param s Can't be NULL.
  * @param c
@@ -56,7 +65,17 @@ str_append_char(str *s, int c);
 int
 str_append_chars(str *s, const char *chars);
 
+/** Append an integer in decimal.
+ * Faster than str_append_format() and doesn't allocate if there's room.
+ * @param s Can't be NULL.
+ * @param i
+ * @return Zero on success, ENOMEM on error.
+ */
+int
+str_append_int(str *s, int_least64_t i);
+
 /** Append a string using format string.
+ * Formats directly to the data of s, so it doesn't allocate if there's room.
  * @param s Can't be NULL.
  * @param format Format string, can't be NULL.
  * @param ... Variables for format string.
@@ -75,4 +94,12 @@ str_append_format(str *s, const char *format, ...);
 int
 str_copy_to_chars(str *s, char **chars);
 
+/** Free str type, but return its data instead of freeing it.
+ * Use instead of str_copy_to_chars() and str_free() to avoid copying.
+ * @param s Can't be NULL.
+ * @return Data of s, nul terminated. Free it after use.
+ */
+char*
+str_release(str *s);
+
 #endif // STR_H
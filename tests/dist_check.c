@@ -0,0 +1,190 @@
+/* Check exact distributions against brute force.
+ *
+ * Every outcome of the rolls of small expressions is enumerated, the ignored
+ * rolls are dropped from a sorted copy, and the counts of the values are
+ * compared to de_distribution(). Exits with non-zero status if a check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <inttypes.h>
+#include "diceexpr.h"
+#include "dist.h"
+
+#define MAX_TERMS 3
+#define MAX_ROLLS 8
+// Allowed error of a probability and of the mean and the variance.
+#define TOLERANCE 1e-12
+
+/* A dice of an expression, added or subtracted.
+ */
+typedef struct {
+    int sign, nrolls, dice, small, large;
+} term;
+
+/* An expression and its dices.
+ */
+typedef struct {
+    const char *expr;
+    int nterms;
+    term terms[MAX_TERMS];
+    int constant;
+} test_case;
+
+static const test_case cases[] = {
+    { "3d6", 1, { { 1, 3, 6, 0, 0 } }, 0 },
+    { "4d6<", 1, { { 1, 4, 6, 1, 0 } }, 0 },
+    { "4d6<+2", 1, { { 1, 4, 6, 1, 0 } }, 2 },
+    { "2d20>", 1, { { 1, 2, 20, 0, 1 } }, 0 },
+    { "5d4<<>", 1, { { 1, 5, 4, 2, 1 } }, 0 },
+    { "6d3<>>", 1, { { 1, 6, 3, 1, 2 } }, 0 },
+    { "2d6+1d8-1d4", 3,
+      { { 1, 2, 6, 0, 0 }, { 1, 1, 8, 0, 0 }, { -1, 1, 4, 0, 0 } }, 0 },
+    { "3d6<-2d4>-1", 2, { { 1, 3, 6, 1, 0 }, { -1, 2, 4, 0, 1 } }, -1 },
+    { "8d2<<<>>", 1, { { 1, 8, 2, 3, 2 } }, 0 },
+};
+
+static int
+check(de_ctx *ctx, const test_case *c);
+
+static void
+enumerate(const test_case *c, int_least64_t min, uint64_t *counts);
+
+static int
+kept_sum(const term *t, const int *rolls);
+
+int
+main(void) {
+    de_ctx *ctx = de_ctx_new();
+    if (ctx == NULL) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        failed |= check(ctx, &cases[i]);
+
+    de_ctx_free(ctx);
+    printf("%s\n", failed ? "FAIL" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Compare the distribution of an expression to brute force.
+ * @return Non-zero if the check failed.
+ */
+static int
+check(de_ctx *ctx, const test_case *c) {
+    // Bounds of the value, every roll is at least 1 and at most dice.
+    int_least64_t min = c->constant, max = c->constant;
+    for (int i = 0; i < c->nterms; i++) {
+        const term *t = &c->terms[i];
+        int kept = t->nrolls - t->small - t->large;
+        min += t->sign > 0 ? kept : -kept * t->dice;
+        max += t->sign > 0 ? kept * t->dice : -kept;
+    }
+    size_t len = max - min + 1;
+    uint64_t *counts = calloc(len, sizeof(*counts));
+    if (counts == NULL) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        exit(EXIT_FAILURE);
+    }
+    enumerate(c, min, counts);
+    uint64_t total = 0;
+    for (size_t i = 0; i < len; i++)
+        total += counts[i];
+
+    de_expr *compiled = NULL;
+    de_pmf *pmf = NULL;
+    enum parse_error e = de_compile(ctx, c->expr, &compiled);
+    if (e == 0)
+        e = de_distribution(ctx, compiled, &pmf);
+    de_expr_free(compiled);
+    if (e != 0) {
+        fprintf(stderr, "%s: %s\n", c->expr, de_strerror(e));
+        free(counts);
+        return 1;
+    }
+
+    int failed = 0;
+    double mean = 0, square = 0;
+    // Also a value past both ends, which must have zero probability.
+    for (int_least64_t v = min - 1; v <= max + 1; v++) {
+        double expected = v < min || v > max ? 0 :
+            (double) counts[v - min] / total;
+        double p = de_pmf_probability(pmf, v);
+        if (fabs(p - expected) > TOLERANCE) {
+            fprintf(stderr, "%s: P(%" PRIdLEAST64 ") is %.17g, not %.17g\n",
+                c->expr, v, p, expected);
+            failed = 1;
+        }
+        mean += v * expected;
+        square += (double) v * v * expected;
+    }
+    double variance = square - mean * mean;
+    if (fabs(pmf->mean - mean) > TOLERANCE * fabs(mean) + TOLERANCE ||
+            fabs(pmf->variance - variance) > TOLERANCE * (fabs(mean) + 1) *
+            (fabs(mean) + 1)) {
+        fprintf(stderr, "%s: mean %.17g and variance %.17g, not %.17g and "
+            "%.17g\n", c->expr, pmf->mean, pmf->variance, mean, variance);
+        failed = 1;
+    }
+    de_pmf_free(pmf);
+    free(counts);
+
+    return failed;
+}
+
+/* Count the values of every outcome of the rolls.
+ * @param counts Counts of values from min.
+ */
+static void
+enumerate(const test_case *c, int_least64_t min, uint64_t *counts) {
+    int rolls[MAX_TERMS][MAX_ROLLS];
+    for (int i = 0; i < c->nterms; i++) {
+        for (int j = 0; j < c->terms[i].nrolls; j++)
+            rolls[i][j] = 1;
+    }
+
+    for (;;) {
+        int_least64_t value = c->constant;
+        for (int i = 0; i < c->nterms; i++)
+            value += c->terms[i].sign * kept_sum(&c->terms[i], rolls[i]);
+        counts[value - min]++;
+
+        // The next outcome, like counting with a digit per roll.
+        int i = 0, j = 0;
+        for (; i < c->nterms; i++) {
+            for (j = 0; j < c->terms[i].nrolls; j++) {
+                if (++rolls[i][j] <= c->terms[i].dice)
+                    break;
+                rolls[i][j] = 1;
+            }
+            if (j < c->terms[i].nrolls)
+                break;
+        }
+        if (i == c->nterms)
+            return;
+    }
+}
+
+/* Sum of the rolls of a dice after ignoring the smallest and the largest.
+ */
+static int
+kept_sum(const term *t, const int *rolls) {
+    int sorted[MAX_ROLLS];
+    for (int i = 0; i < t->nrolls; i++) {
+        // Insertion sort, there are only a few rolls.
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > rolls[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = rolls[i];
+    }
+
+    int sum = 0;
+    for (int i = t->small; i < t->nrolls - t->large; i++)
+        sum += sorted[i];
+
+    return sum;
+}
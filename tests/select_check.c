@@ -0,0 +1,221 @@
+/* Check the selection of kept rolls and rolling by counting rolls per side.
+ *
+ * Random pools are selected with de_select() and de_select_counts() and
+ * compared to the kept rolls of a sorted copy. Pool sizes and sides are
+ * chosen around the thresholds of the strategies: the sorting network, the
+ * histogram and quickselect. Dices rolled by counting are checked through
+ * the evaluator: the rolls in the transcript must be the kept ones and sum up
+ * to the value. Exits with non-zero status if a check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "diceexpr.h"
+#include "select.h"
+#include "rng.h"
+
+#define SEED 0x5e1ec7
+#define POOLS_PER_SIZE 200
+// Fewer pools of more rolls than this are checked, qsort takes most of the
+// time.
+#define LARGE_POOL 10000
+
+static int
+check_pools(de_ctx *ctx, de_rng *rng, int_least64_t nrolls,
+    int_least64_t dice);
+
+static void
+reference(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, int_least64_t *sorted,
+    de_keep *keep);
+
+static int
+same_keep(const de_keep *a, const de_keep *b);
+
+static int
+check_counted(de_ctx *ctx, const char *expr, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large);
+
+static int
+compare_rolls(const void *a, const void *b);
+
+int
+main(void) {
+    static const int_least64_t sizes[] = {
+        1, 2, 3, SELECT_NETWORK_MAX - 1, SELECT_NETWORK_MAX,
+        SELECT_NETWORK_MAX + 1, 100, 1000
+    };
+    static const int_least64_t sides[] = {
+        1, 2, 6, 20, 1000, SELECT_HISTOGRAM_MAX_SIDES,
+        SELECT_HISTOGRAM_MAX_SIDES + 1, INT64_C(1000000000)
+    };
+    de_ctx *ctx = de_ctx_new();
+    if (ctx == NULL) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        return EXIT_FAILURE;
+    }
+    de_rng rng;
+    de_rng_seed(&rng, SEED);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(sides) / sizeof(sides[0]); j++)
+            failed |= check_pools(ctx, &rng, sizes[i], sides[j]);
+    }
+    // The histogram with the most sides.
+    failed |= check_pools(ctx, &rng, 100000, SELECT_HISTOGRAM_MAX_SIDES);
+
+    de_ctx_set_transcript(ctx, DE_TRANSCRIPT_FULL);
+    de_ctx_seed(ctx, SEED);
+    failed |= check_counted(ctx, "96d6", 96, 6, 0, 0);
+    failed |= check_counted(ctx, "200d6<5>7", 200, 6, 5, 7);
+    failed |= check_counted(ctx, "1000d2<499>500", 1000, 2, 499, 500);
+    failed |= check_counted(ctx, "100000d20<<<", 100000, 20, 3, 0);
+    failed |= check_counted(ctx, "2000000d6>99999", 2000000, 6, 0, 99999);
+
+    de_ctx_free(ctx);
+    printf("%s\n", failed ? "FAIL" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Select random pools of a size with random numbers of ignored rolls and
+ * compare to the reference.
+ * @return Non-zero if a check failed.
+ */
+static int
+check_pools(de_ctx *ctx, de_rng *rng, int_least64_t nrolls,
+    int_least64_t dice) {
+    int_least64_t *rolls = malloc(2 * nrolls * sizeof(*rolls));
+    int_least64_t *counts = dice <= SELECT_HISTOGRAM_MAX_SIDES ?
+        calloc(dice, sizeof(*counts)) : NULL;
+    if (rolls == NULL || (dice <= SELECT_HISTOGRAM_MAX_SIDES &&
+            counts == NULL)) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        exit(EXIT_FAILURE);
+    }
+    int_least64_t *sorted = rolls + nrolls;
+
+    int failed = 0;
+    int pools = nrolls > LARGE_POOL ? POOLS_PER_SIZE / 10 : POOLS_PER_SIZE;
+    for (int pool = 0; pool < pools && !failed; pool++) {
+        // Few distinct rolls make ties at the boundaries likely.
+        int_least64_t range = pool % 2 == 0 ? dice : (dice < 3 ? dice : 3);
+        for (int_least64_t i = 0; i < nrolls; i++)
+            rolls[i] = (int_least64_t) de_rng_bounded(rng, range) + 1;
+        if (counts != NULL) {
+            memset(counts, 0, dice * sizeof(*counts));
+            for (int_least64_t i = 0; i < nrolls; i++)
+                counts[rolls[i] - 1]++;
+        }
+
+        int_least64_t small = (int_least64_t) de_rng_bounded(rng, nrolls);
+        int_least64_t large = (int_least64_t) de_rng_bounded(rng,
+            nrolls - small);
+        de_keep expected, keep;
+        reference(rolls, nrolls, small, large, sorted, &expected);
+        if (de_select(ctx, rolls, nrolls, dice, small, large, &keep) != 0) {
+            fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+            exit(EXIT_FAILURE);
+        }
+        if (!same_keep(&keep, &expected)) {
+            fprintf(stderr, "de_select: %" PRIdLEAST64 "d%" PRIdLEAST64
+                " ignoring %" PRIdLEAST64 " and %" PRIdLEAST64 " differs\n",
+                nrolls, dice, small, large);
+            failed = 1;
+        }
+        if (counts != NULL) {
+            de_select_counts(counts, dice, nrolls, small, large, &keep);
+            if (!same_keep(&keep, &expected)) {
+                fprintf(stderr, "de_select_counts: %" PRIdLEAST64 "d%"
+                    PRIdLEAST64 " ignoring %" PRIdLEAST64 " and %"
+                    PRIdLEAST64 " differs\n", nrolls, dice, small, large);
+                failed = 1;
+            }
+        }
+    }
+    free(rolls);
+    free(counts);
+
+    return failed;
+}
+
+/* Kept rolls of a sorted copy of the rolls.
+ */
+static void
+reference(const int_least64_t *rolls, int_least64_t nrolls,
+    int_least64_t small, int_least64_t large, int_least64_t *sorted,
+    de_keep *keep) {
+    memcpy(sorted, rolls, nrolls * sizeof(*sorted));
+    qsort(sorted, nrolls, sizeof(*sorted), compare_rolls);
+
+    keep->low = sorted[small];
+    keep->high = sorted[nrolls - large - 1];
+    keep->low_count = 0;
+    keep->high_count = 0;
+    for (int_least64_t i = small; i < nrolls - large; i++) {
+        if (sorted[i] == keep->low)
+            keep->low_count++;
+        else if (sorted[i] == keep->high)
+            keep->high_count++;
+    }
+}
+
+static int
+same_keep(const de_keep *a, const de_keep *b) {
+    return a->low == b->low && a->high == b->high &&
+        a->low_count == b->low_count && a->high_count == b->high_count;
+}
+
+/* Roll a dice rolled by counting rolls per side and check its transcript.
+ * The kept rolls must be listed in ascending order, there must be as many as
+ * are kept, they must be rolls of the dice and their sum must be the value.
+ * @return Non-zero if a check failed.
+ */
+static int
+check_counted(de_ctx *ctx, const char *expr, int_least64_t nrolls,
+    int_least64_t dice, int_least64_t small, int_least64_t large) {
+    int_least64_t value;
+    const char *rolled;
+    enum parse_error e = de_parse_r(ctx, expr, &value, &rolled);
+    if (e != 0) {
+        fprintf(stderr, "%s: %s\n", expr, de_strerror(e));
+        return 1;
+    }
+
+    int_least64_t n = 0, sum = 0, previous = 1;
+    const char *p = rolled;
+    if (*p++ != '(')
+        goto error;
+    for (;;) {
+        char *end;
+        long long roll = strtoll(p, &end, 10);
+        if (end == p || roll < previous || roll > dice)
+            goto error;
+        n++;
+        sum += roll;
+        previous = roll;
+        p = end;
+        if (*p == ')')
+            break;
+        if (*p++ != '+')
+            goto error;
+    }
+    if (n != nrolls - small - large || sum != value || p[1] != '\0')
+        goto error;
+
+    return 0;
+
+    error:
+        fprintf(stderr, "%s: transcript doesn't match the value %" PRIdLEAST64
+            "\n", expr, value);
+        return 1;
+}
+
+static int
+compare_rolls(const void *a, const void *b) {
+    int_least64_t x = *(const int_least64_t*) a, y = *(const int_least64_t*) b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,359 @@
+/* Check gdice-server through local clients.
+ *
+ * The server is started on a Unix domain socket in a temporary directory.
+ * Responses must follow the protocol: seeded requests roll the same, errors
+ * are answered, the last request doesn't need a newline and a too long
+ * request closes the connection. A client sending many requests at once must
+ * not hold up another client until all of them are evaluated. Exits with
+ * non-zero status if a check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "diceexpr.h"
+
+#ifndef SERVER
+#define SERVER "../src/gdice-server"
+#endif
+
+// The maximum length of a response checked.
+#define MAX_RESPONSE 1024
+// Requests sent at once by the busy client, fit one read of the server.
+#define BUSY_REQUESTS 4000
+#define BUSY_REQUEST "10000d1000000\n"
+// Seconds until the check is killed, if the server hangs.
+#define TIMEOUT 120
+
+/* A connection to the server and the received bytes not read yet.
+ */
+typedef struct {
+    int fd;
+    char in[MAX_RESPONSE];
+    size_t in_len;
+} client;
+
+static int
+check_protocol(const char *path);
+
+static int
+check_last_request(const char *path);
+
+static int
+check_too_long(const char *path);
+
+static int
+check_busy_client(const char *path);
+
+static int
+client_connect(client *c, const char *path);
+
+static int
+client_send(client *c, const char *data, size_t len);
+
+static int
+client_response(client *c, char *line, int wait);
+
+static int
+expect(client *c, const char *request, const char *prefix);
+
+int
+main(void) {
+    alarm(TIMEOUT);
+    signal(SIGPIPE, SIG_IGN);
+
+    char dir[] = "/tmp/gdice-check-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/socket", dir);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        rmdir(dir);
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        execl(SERVER, SERVER, "-q", "-u", path, (char*) NULL);
+        perror(SERVER);
+        _exit(127);
+    }
+
+    int failed = check_protocol(path);
+    failed |= check_last_request(path);
+    failed |= check_too_long(path);
+    failed |= check_busy_client(path);
+
+    int status;
+    kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "server didn't exit cleanly\n");
+        failed = 1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        fprintf(stderr, "server didn't remove its socket\n");
+        unlink(path);
+        failed = 1;
+    }
+    rmdir(dir);
+    printf("%s\n", failed ? "FAIL" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Requests sent without waiting for the responses.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_protocol(const char *path) {
+    client c;
+    if (client_connect(&c, path) != 0)
+        return 1;
+
+    static const char requests[] =
+        "seed=7 verbose 3d6\n"
+        "seed=7 verbose 3d6\r\n"
+        "seed=18446744073709551615 1d6\n"
+        "seed=18446744073709551616 1d6\n"
+        "1d0\n"
+        "2d1+3\n"
+        "stats\n";
+    char first[MAX_RESPONSE], second[MAX_RESPONSE];
+    char overflow[MAX_RESPONSE];
+    snprintf(overflow, sizeof(overflow), "error %s",
+        de_strerror(DE_OVERFLOW));
+    int failed = client_send(&c, requests, sizeof(requests) - 1) != 0 ||
+        client_response(&c, first, 1) != 0 ||
+        client_response(&c, second, 1) != 0;
+    if (!failed && (strncmp(first, "ok ", 3) != 0 ||
+            strchr(first, '(') == NULL || strcmp(first, second) != 0)) {
+        fprintf(stderr, "seeded requests: \"%s\" and \"%s\"\n", first,
+            second);
+        failed = 1;
+    }
+    failed |= expect(&c, "largest seed", "ok ");
+    failed |= expect(&c, "seed out of range", overflow);
+    failed |= expect(&c, "invalid dice", "error ");
+    failed |= expect(&c, "2d1+3", "ok 5");
+    failed |= expect(&c, "stats", "stats requests=");
+    close(c.fd);
+
+    return failed;
+}
+
+/* The last request before the client shuts down its side.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_last_request(const char *path) {
+    client c;
+    if (client_connect(&c, path) != 0)
+        return 1;
+
+    int failed = client_send(&c, "1d1\n3d1", 7) != 0 ||
+        shutdown(c.fd, SHUT_WR) != 0;
+    failed |= expect(&c, "1d1", "ok 1");
+    failed |= expect(&c, "3d1 without a newline", "ok 3");
+    char line[MAX_RESPONSE];
+    if (!failed && client_response(&c, line, 1) != -1) {
+        fprintf(stderr, "connection not closed after the last response\n");
+        failed = 1;
+    }
+    close(c.fd);
+
+    return failed;
+}
+
+/* A request longer than the server accepts.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_too_long(const char *path) {
+    client c;
+    if (client_connect(&c, path) != 0)
+        return 1;
+
+    char request[8192];
+    memset(request, '1', sizeof(request));
+    int failed = client_send(&c, request, sizeof(request)) != 0;
+    failed |= expect(&c, "too long request", "error request too long");
+    char line[MAX_RESPONSE];
+    if (!failed && client_response(&c, line, 1) != -1) {
+        fprintf(stderr, "connection not closed after a too long request\n");
+        failed = 1;
+    }
+    close(c.fd);
+
+    return failed;
+}
+
+/* A client sends many requests at once, then another client sends one. The
+ * other client must be answered while requests of the busy one are still
+ * being evaluated.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_busy_client(const char *path) {
+    client busy, other;
+    if (client_connect(&busy, path) != 0)
+        return 1;
+    if (client_connect(&other, path) != 0) {
+        close(busy.fd);
+        return 1;
+    }
+
+    size_t len = sizeof(BUSY_REQUEST) - 1;
+    char *requests = malloc(BUSY_REQUESTS * len);
+    if (requests == NULL) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < BUSY_REQUESTS; i++)
+        memcpy(requests + i * len, BUSY_REQUEST, len);
+    int failed = client_send(&busy, requests, BUSY_REQUESTS * len) != 0;
+    free(requests);
+
+    // The server has started on the busy client when it has a response.
+    char line[MAX_RESPONSE];
+    int received = 0;
+    if (!failed && client_response(&busy, line, 1) == 0)
+        received++;
+    failed |= client_send(&other, "1d1\n", 4) != 0 ||
+        expect(&other, "1d1 of the other client", "ok 1");
+    while (!failed && client_response(&busy, line, 0) == 0)
+        received++;
+    if (!failed && received == BUSY_REQUESTS) {
+        fprintf(stderr, "other client waited for all %d requests of the "
+            "busy client\n", BUSY_REQUESTS);
+        failed = 1;
+    }
+
+    // The rest of the responses.
+    while (!failed && received < BUSY_REQUESTS) {
+        if (client_response(&busy, line, 1) != 0 ||
+                strncmp(line, "ok ", 3) != 0) {
+            fprintf(stderr, "busy client: response %d is \"%s\"\n",
+                received + 1, line);
+            failed = 1;
+        }
+        received++;
+    }
+    close(busy.fd);
+    close(other.fd);
+
+    return failed;
+}
+
+/* Connect to the server, waiting for it to start listening.
+ * @return Zero on success, non-zero on error.
+ */
+static int
+client_connect(client *c, const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    c->in_len = 0;
+
+    for (int attempt = 0; attempt < 500; attempt++) {
+        c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (c->fd < 0)
+            break;
+        if (connect(c->fd, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+            return 0;
+        close(c->fd);
+        if (errno != ENOENT && errno != ECONNREFUSED)
+            break;
+        struct timespec delay = { 0, 10000000 };
+        nanosleep(&delay, NULL);
+    }
+    fprintf(stderr, "connect to %s: %s\n", path, strerror(errno));
+
+    return 1;
+}
+
+/* @return Zero on success, non-zero on error.
+ */
+static int
+client_send(client *c, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(c->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("write");
+            return 1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Read a response without the newline.
+ * @param line At least MAX_RESPONSE bytes.
+ * @param wait Non-zero to wait for the response, otherwise only a response
+ * already received is read.
+ * @return Zero on success, 1 if there's no response yet, -1 if the server
+ * closed the connection or on error.
+ */
+static int
+client_response(client *c, char *line, int wait) {
+    *line = '\0';
+    for (;;) {
+        char *newline = memchr(c->in, '\n', c->in_len);
+        if (newline != NULL) {
+            size_t len = newline - c->in;
+            memcpy(line, c->in, len);
+            line[len] = '\0';
+            c->in_len -= len + 1;
+            memmove(c->in, newline + 1, c->in_len);
+            return 0;
+        }
+        if (c->in_len == sizeof(c->in))
+            return -1;
+
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len,
+            wait ? 0 : MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n <= 0)
+            return -1;
+        c->in_len += n;
+    }
+}
+
+/* Read a response and check that it starts with a prefix.
+ * @param request Described in the error message.
+ * @return Non-zero if the check failed.
+ */
+static int
+expect(client *c, const char *request, const char *prefix) {
+    char line[MAX_RESPONSE];
+    if (client_response(c, line, 1) != 0) {
+        fprintf(stderr, "%s: no response\n", request);
+        return 1;
+    }
+    if (strncmp(line, prefix, strlen(prefix)) != 0) {
+        fprintf(stderr, "%s: response \"%s\", expected \"%s\"\n", request,
+            line, prefix);
+        return 1;
+    }
+
+    return 0;
+}
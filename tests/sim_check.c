@@ -0,0 +1,184 @@
+/* Check simulations against exact distributions.
+ *
+ * Expressions are simulated with de_simulate() with different numbers of
+ * threads. The frequencies of the values, the mean, the variance and the
+ * percentiles must be within a few standard errors of de_distribution(), and
+ * the same seed and number of threads must give the same histogram. Fixed
+ * seeds make the check deterministic. Exits with non-zero status if a check
+ * fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <inttypes.h>
+#include "diceexpr.h"
+#include "dist.h"
+#include "sim.h"
+
+#define SEED 0x5135eed
+#define SIMULATIONS 200000
+// Allowed difference in standard errors.
+#define SIGMAS 5
+
+static const char *const expressions[] = {
+    "3d6", "4d6<+2", "2d20>", "2d6+1d8-1d4", "3d6<-2d4>-1", "20d10<<>"
+};
+
+static const unsigned int thread_counts[] = { 1, 2, 3, 8 };
+
+static int
+check(de_ctx *ctx, const char *expr, unsigned int threads);
+
+static int
+check_frequencies(const char *expr, const de_sim *sim, const de_pmf *pmf);
+
+static int
+check_moments(const char *expr, const de_sim *sim, const de_pmf *pmf);
+
+static int
+check_percentiles(const char *expr, const de_sim *sim, const de_pmf *pmf);
+
+int
+main(void) {
+    de_ctx *ctx = de_ctx_new();
+    if (ctx == NULL) {
+        fprintf(stderr, "%s\n", de_strerror(DE_MEMORY));
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(expressions) / sizeof(expressions[0]);
+            i++) {
+        for (size_t j = 0;
+                j < sizeof(thread_counts) / sizeof(thread_counts[0]); j++)
+            failed |= check(ctx, expressions[i], thread_counts[j]);
+    }
+
+    de_ctx_free(ctx);
+    printf("%s\n", failed ? "FAIL" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Simulate an expression twice and compare to its distribution.
+ * @return Non-zero if the check failed.
+ */
+static int
+check(de_ctx *ctx, const char *expr, unsigned int threads) {
+    de_expr *compiled = NULL;
+    de_pmf *pmf = NULL;
+    de_sim *sim = NULL, *again = NULL;
+    enum parse_error e = de_compile(ctx, expr, &compiled);
+    if (e == 0)
+        e = de_distribution(ctx, compiled, &pmf);
+    if (e == 0)
+        e = de_simulate(compiled, SIMULATIONS, threads, SEED, &sim);
+    if (e == 0)
+        e = de_simulate(compiled, SIMULATIONS, threads, SEED, &again);
+    de_expr_free(compiled);
+    if (e != 0) {
+        fprintf(stderr, "%s: %s\n", expr, de_strerror(e));
+        de_pmf_free(pmf);
+        de_sim_free(sim);
+        return 1;
+    }
+
+    int failed = 0;
+    if (sim->n != SIMULATIONS || sim->width != 1) {
+        fprintf(stderr, "%s with %u threads: %" PRIu64 " evaluations in "
+            "buckets of %" PRIu64 "\n", expr, threads, sim->n, sim->width);
+        failed = 1;
+    }
+    else if (again->nbuckets != sim->nbuckets || memcmp(again->counts,
+            sim->counts, sim->nbuckets * sizeof(*sim->counts)) != 0) {
+        fprintf(stderr, "%s with %u threads: the same seed gave a different "
+            "histogram\n", expr, threads);
+        failed = 1;
+    }
+    else {
+        failed |= check_frequencies(expr, sim, pmf);
+        failed |= check_moments(expr, sim, pmf);
+        failed |= check_percentiles(expr, sim, pmf);
+        if (failed)
+            fprintf(stderr, "%s: failed with %u threads\n", expr, threads);
+    }
+    de_pmf_free(pmf);
+    de_sim_free(sim);
+    de_sim_free(again);
+
+    return failed;
+}
+
+/* The frequency of every value, also outside of the possible values.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_frequencies(const char *expr, const de_sim *sim, const de_pmf *pmf) {
+    int failed = 0;
+    for (size_t i = 0; i < sim->nbuckets; i++) {
+        int_least64_t v = sim->lo + (int_least64_t) i;
+        double p = de_pmf_probability(pmf, v);
+        double frequency = (double) sim->counts[i] / sim->n;
+        double error = sqrt(p * (1 - p) / sim->n);
+        if ((p == 0 && sim->counts[i] > 0) ||
+                fabs(frequency - p) > SIGMAS * error) {
+            fprintf(stderr, "%s: frequency of %" PRIdLEAST64 " is %g, "
+                "probability %g\n", expr, v, frequency, p);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+/* The mean and the variance. The standard error of the variance comes from
+ * the fourth central moment.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_moments(const char *expr, const de_sim *sim, const de_pmf *pmf) {
+    double m4 = 0;
+    for (size_t i = 0; i < pmf->len; i++) {
+        double d = pmf->min + (int_least64_t) i - pmf->mean;
+        m4 += pmf->p[i] * d * d * d * d;
+    }
+    double mean_error = sqrt(pmf->variance / sim->n);
+    double variance_error = sqrt((m4 - pmf->variance * pmf->variance) /
+        sim->n);
+    if (fabs(sim->mean - pmf->mean) > SIGMAS * mean_error ||
+            fabs(sim->variance - pmf->variance) > SIGMAS * variance_error) {
+        fprintf(stderr, "%s: mean %g and variance %g, expected %g and %g\n",
+            expr, sim->mean, sim->variance, pmf->mean, pmf->variance);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* A percentile v must have a cumulative probability close to at least q, and
+ * the value before it close to at most q.
+ * @return Non-zero if the check failed.
+ */
+static int
+check_percentiles(const char *expr, const de_sim *sim, const de_pmf *pmf) {
+    static const double quantiles[] = { 0.01, 0.05, 0.25, 0.5, 0.75, 0.95,
+        0.99 };
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        double q = quantiles[i];
+        int_least64_t v = de_sim_percentile(sim, q);
+        double below = 0;
+        for (int_least64_t u = pmf->min; u < v; u++)
+            below += de_pmf_probability(pmf, u);
+        double at = below + de_pmf_probability(pmf, v);
+        double error = sqrt(q * (1 - q) / sim->n);
+        if (at < q - SIGMAS * error || below > q + SIGMAS * error) {
+            fprintf(stderr, "%s: percentile %g is %" PRIdLEAST64 " with "
+                "cumulative probability %g\n", expr, q * 100, v, at);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}